@@ -35,6 +35,22 @@
 #include <stdbool.h>
 #include <arpa/inet.h>
 #include <sys/io.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <linux/netlink.h>
+#include <linux/hdreg.h>
+#include <linux/nvme_ioctl.h>
+#include <scsi/sg.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include "fancontrol_shm.h"
+#include <signal.h>
+#include <spawn.h>
+#include <sys/resource.h>
 
 // These defaults can be overridden at the CLI
 static bool debug = false; // Turn on/off logging
@@ -48,6 +64,51 @@ static double ki = 0.5;
 static double imax = 255.0;
 static double kd = 0.0;
 const static int pwmmax = 255.0; // Max PWM value, do not change
+static int pwmceil = pwmmax; // Max PWM value of the active profile
+static double setpoint_shift = 0; // Setpoint of the active profile relative to setpoint
+static double profile_ramp = 60; // Seconds to move between profiles
+static const char *control_socket = NULL;
+static int control_sockfd = -1;
+static double precool_lead = 30;  // Minutes before an announced heavy job to start cooling
+static double precool_delta = 3;  // Degrees the setpoint is lowered for announced jobs
+static const char *precool_dir = NULL;
+static bool simulate = false;     // Run against the built-in thermal model instead of the hardware
+static double sim_clock = 0;      // Seconds of simulated time
+static double sim_duration = 0;   // Stop the simulation after this many seconds, 0 runs forever
+static double sim_ambient = 25;   // Simulated room temperature
+static double sim_job_watts = 4;  // Extra heat per drive while an announced job runs
+static double slew_up = 25;       // Max PWM increase per second, 0 for no limit
+static double slew_down = 5;      // Max PWM decrease per second, 0 for no limit
+static double ramp_tick = 0.25;   // Seconds between PWM ramp steps
+static int pwm_deadband = 0;      // Ignore PWM changes smaller than this
+static int temp_hysteresis = 0;   // Degrees a reading must move before it is accepted
+static long pwm_suppressed = 0;   // PWM updates dropped by the deadband
+static long temp_suppressed = 0;  // Readings held back by the hysteresis
+static int stall_rpm = 200;       // A fan below this speed is stalled, 0 disables stall detection
+static int stall_pwm = 60;        // Only consider a fan stalled when driven at least this hard
+static double stall_time = 5;     // Seconds a fan must be stalled before it is kicked
+static double kick_time = 5;      // Seconds of full duty to restart a stalled fan
+static int failover_pwm = 255;    // Minimum PWM of the remaining fan while one has failed
+static bool cascade = false;      // Outer temperature loop sets an RPM, inner loop finds the PWM
+static int fan_rpm_max = 1500;    // Fan speed at full duty, scales the outer loop output in cascade mode
+static double rpm_kp = 0.05;      // Inner loop PWM per RPM of change in error
+static double rpm_ki = 0.1;       // Inner loop PWM per RPM of error and second
+static int rpm_deadband = 20;     // Inner loop leaves the PWM alone within this many RPM of the target
+enum fan_sync_mode { SYNC_OFF, SYNC_LOCK, SYNC_GAP };
+static int fan_sync = SYNC_OFF;   // Coordinate the two fan speeds to avoid an audible beat
+static int fan_gap_rpm = 100;     // Minimum speed difference in gap mode
+static int fan_blades = 7;        // Blades per fan, for the beat frequency
+static double fan_sync_gain = 0.02; // PWM shifted per RPM of error and second
+static double fan_sync_max = 32;  // Most PWM shifted from one fan to the other
+static double fan_sync_offset = 0; // PWM added to the first fan and taken from the second
+static int pwm_freq_select = -1;  // PWM base clock select 0-7, -1 leaves the chip setting alone
+static bool calibrate = false;    // Measure the best PWM base clock and minimum PWM, then exit
+static bool calibrating = false;  // Calibration drives the fans directly
+static const char *calibration_file = "/var/lib/fancontrol/calibration";
+static int calibration_margin = 8; // PWM added to the lowest duty at which the fans still turned
+static int calibrated_freq_select = -1;
+static int calibrated_pwmmin = 0;
+static time_t start_time = 0;
 const static uint8_t port = 0x2e;
 const static uint8_t fanspeed = 200;
 static uint16_t ecbar = 0x00;
@@ -57,6 +118,258 @@ static int graphite_sockfd = -1;
 static time_t graphite_last_connect_attempt = 0;
 static time_t graphite_connect_timeout = 5; // Try to reconnect every 5 seconds
 static int cputemp_max_values = 10; // Number of values for rolling average of cpu temperature
+static const char *sensor_config = NULL; // Per-sensor setpoint/weight/offset overrides
+static bool drive_auto = false; // Discover drives instead of using drive_list
+static const char *drive_filter = NULL; // by-id patterns that discovered drives must match
+static int uevent_sockfd = -1;
+static double discover_at = 0; // Rescan the drives at this monotonic time, 0 for no rescan
+static double helper_timeout = 2; // Seconds a helper sensor has to answer
+static int smart_interval = 3600; // Seconds between SMART attribute reports, 0 to disable
+static double latency_factor = 4; // Probes this many times slower than usual are outliers
+static int breaker_trips = 3; // Failed probes in a row that open a sensor's breaker
+static double breaker_slow = 5; // Probes taking longer than this many seconds count as failed
+static int breaker_backoff = 600; // Longest wait in seconds between probes of a failed sensor
+static int breaker_margin = 5; // Added to the last good temperature of a failed sensor
+static int breaker_pwm = 0; // Minimum PWM while a sensor has failed
+static const char *mdstat_path = "/proc/mdstat"; // md RAID status
+static const char *zfs_kstat_dir = "/proc/spl/kstat/zfs"; // ZFS pool kstats
+static int array_interval = 60; // Seconds between array maintenance checks, 0 to disable
+static double maint_delta = 2; // Lower the setpoint this much during array maintenance
+static int maint_pwm = 0; // Minimum PWM during array maintenance
+static double zfs_busy_mbps = 100; // MB/s of ZFS pool reads that make the pool read-busy
+static const char *array_check = NULL; // Check the parsers against the captures in this directory and exit
+static const char *cgroup_root = "/sys/fs/cgroup"; // cgroup v2 mount point
+static int throttle_span = 5; // Degrees above overheat where throttling is at its strongest
+static int throttle_hysteresis = 2; // Lift throttles this many degrees below overheat
+static double throttle_cpu = 10; // CPU percent left to throttled cgroups at the strongest
+static double throttle_io = 10; // MB/s per drive left to throttled cgroups at the strongest
+static double throttle_io_start = 200; // MB/s per drive as soon as throttling starts
+static const char *rapl_zone = "/sys/class/powercap/intel-rapl:0"; // CPU package powercap zone
+static double rapl_min = 0; // Lowest CPU power limit in W when the fans saturate, 0 for no capping
+static double rapl_step = 2; // W the CPU power limit moves per cycle
+static double pid_terms[3]; // P, I and D of the last cycle
+static const char *shm_path = NULL; // Publish live state in this shared memory file
+static const char *fleet_server = NULL; // Send readings to the fleet aggregator at <ip:port>
+static bool fleet_tcp = false; // Use TCP instead of UDP for the fleet aggregator
+static const char *fleet_name = NULL; // Name of this machine in the fleet, the hostname by default
+static int fleet_listen = 0; // Run as fleet aggregator on this port
+static int fleet_flush = 10; // Seconds between fleet forwards to Graphite
+static int fleet_bench = 0; // Simulate this many agents over loopback and exit
+static const char *mqtt_server = NULL; // Publish to the MQTT broker at <ip:port>
+static const char *mqtt_topic = NULL; // Topic prefix, fancontrol/<hostname> by default
+static const char *mqtt_discovery = "homeassistant"; // Home Assistant discovery prefix, empty for none
+static int mqtt_keepalive = 60; // Seconds, 0 to disable
+static const char *mqtt_user = NULL;
+static const char *mqtt_password = NULL;
+static bool mqtt_bench = false; // Check the client against a stand-in broker over loopback and exit
+static const char *agentx_master = NULL; // Serve SNMP through the AgentX master at this socket
+static bool agentx_bench = false; // Check the subagent against a stand-in master over loopback and exit
+static int hook_interval = 300; // Seconds between hook commands for the same event and subject
+static int hook_max = 4; // Hook commands running at the same time
+static int hook_timeout = 60; // Seconds before a hook command is killed
+static volatile sig_atomic_t stop_requested = 0; // Set by SIGTERM and SIGINT
+static long smart_limit[6] = { 1, 1, 1, 0, 0, 1 }; // Alert at these SMART values, 0 for none
+static int aggregate_mean = 0; // Act on the mean sensor error instead of the worst one
+
+enum sensor_kind { SENSOR_DRIVE, SENSOR_CPU, SENSOR_HELPER };
+enum smart_attr { SMART_REALLOCATED, SMART_PENDING, SMART_CRC, SMART_POWER_ON_HOURS, SMART_LOAD_CYCLES, SMART_MEDIA_ERRORS, SMART_COUNT };
+#define LATENCY_BUCKETS 16
+enum breaker_state { BREAKER_OK, BREAKER_DEGRADED, BREAKER_OPEN };
+enum drive_type { DRIVE_UNKNOWN, DRIVE_SMARTCTL, DRIVE_ATA, DRIVE_SAT, DRIVE_SCSI, DRIVE_NVME };
+
+// Every temperature input has its own setpoint, so that each device is only
+// cooled as far as it needs. The controller acts on the weighted errors.
+#define SENSOR_NAME_MAX 95 // Bounds sensor names in metric paths, as %.*s
+
+struct sensor {
+    char name[SENSOR_NAME_MAX + 1];
+    char dev[32];    // Kernel name of a drive, e.g. sda
+    bool present;    // False for a discovered drive that has been removed
+    int type;        // How the drive is probed, see drive_type
+    long smart[SMART_COUNT]; // Last decoded SMART attributes, -1 if not reported
+    double smart_at; // When SMART attributes are decoded next
+    bool smart_fresh; // Decoded but not reported yet
+    unsigned smart_alerts; // Bit per attribute over its limit
+    unsigned long latency_hist[LATENCY_BUCKETS]; // Probe latencies from 64 µs, doubling
+    double latency_ms; // Latency of this cycle's probe, 0 if none
+    double latency_baseline; // Moving average of the latency in ms
+    bool latency_outlier;
+    int breaker;     // See breaker_state
+    int failures;    // Failed probes in a row
+    double retry_at; // When an open breaker lets the next probe through
+    double backoff;  // Seconds until the retry after that
+    int last_good;   // Last temperature that was read successfully
+    time_t read_at;  // When it was read successfully
+    int kind;
+    int temp;        // Last reading, 0 when unavailable (e.g. drive in standby)
+    int setpoint;    // Target temperature for this device
+    double weight;   // Scales this sensor's error relative to the others
+    int offset;      // Added to the reading before it is compared to setpoint
+    double error;    // weight * (temp + offset - setpoint) of the last cycle
+};
+
+#define MAX_SENSORS 64
+static struct sensor sensors[MAX_SENSORS];
+static int sensor_count = 0;
+
+// Event hooks (--hook=<event>:<command>) run a command when something needs a human,
+// e.g. to send an email or page someone:
+//   overheat  a sensor is above overheat on the global setpoint scale, cleared again
+//             throttle_hysteresis degrees below it
+//   stall     a fan did not restart after a kick, cleared when it turns again
+//   sensor    the breaker of a sensor opened after repeated failed probes
+//   smart     a SMART attribute reached its --smart_alert limit
+// Commands run through /bin/sh with posix_spawn and are never waited for. They get
+// FANCONTROL_EVENT, FANCONTROL_STATE (raised or cleared), FANCONTROL_SUBJECT,
+// FANCONTROL_VALUE, FANCONTROL_LIMIT, FANCONTROL_MESSAGE, FANCONTROL_HOST and
+// FANCONTROL_TIME. A command only runs when the state of an event and subject changed
+// since the last one, at most once per --hook_interval: a sensor flapping faster than
+// that is reported with its latest state when the interval is over, or not at all if
+// it is back where it was. At most --hook_max commands run at the same time, and a
+// command still running after --hook_timeout seconds is killed.
+enum hook_event { HOOK_OVERHEAT, HOOK_STALL, HOOK_SENSOR, HOOK_SMART, HOOK_COUNT };
+static const char *hook_names[HOOK_COUNT] = { "overheat", "stall", "sensor", "smart" };
+static const char *hook_commands[HOOK_COUNT];
+
+#define HOOK_KEYS 64
+#define HOOK_MAX_RUNNING 16
+
+// One event and subject, e.g. overheat of sda
+struct hook_key {
+    int event;
+    char subject[112];
+    bool state;       // Latest state, true while raised
+    bool reported;    // State the last command ran with
+    bool pending;     // state differs from reported
+    double last_run;  // Monotonic time of the last command
+    long value;
+    long limit;
+    char message[160];
+};
+
+struct hook_run {
+    pid_t pid;
+    double started;   // CLOCK_MONOTONIC, also when simulating
+    int key;
+};
+
+static struct hook_key hook_keys[HOOK_KEYS];
+static int hook_key_count = 0;
+static struct hook_run hook_runs[HOOK_MAX_RUNNING];
+static int hook_running = 0;
+
+// Record the state of an event, the command runs from hook_dispatch()
+void hook_raise(int event, const char *subject, bool state, long value, long limit, const char *message)
+{
+    if (!hook_commands[event]) return;
+
+    struct hook_key *k = NULL;
+    for (int i = 0; i < hook_key_count && !k; ++i) {
+        if (hook_keys[i].event == event && strcmp(hook_keys[i].subject, subject) == 0) k = &hook_keys[i];
+    }
+    if (!k) {
+        // Clearing something that was never raised
+        if (!state) return;
+        if (hook_key_count == HOOK_KEYS) {
+            if (debug) printf("Hook: no room for %s %s\n", hook_names[event], subject);
+            return;
+        }
+        k = &hook_keys[hook_key_count++];
+        memset(k, 0, sizeof(*k));
+        k->event = event;
+        snprintf(k->subject, sizeof(k->subject), "%s", subject);
+        k->last_run = -1e9;
+    }
+
+    k->state = state;
+    k->pending = state != k->reported;
+    k->value = value;
+    k->limit = limit;
+    snprintf(k->message, sizeof(k->message), "%s", message);
+}
+
+int hook_spawn(struct hook_key *k, double started)
+{
+    char vars[8][320], hostname[64];
+    if (gethostname(hostname, sizeof(hostname)) < 0) snprintf(hostname, sizeof(hostname), "localhost");
+    hostname[sizeof(hostname) - 1] = '\0';
+
+    snprintf(vars[0], sizeof(vars[0]), "FANCONTROL_EVENT=%s", hook_names[k->event]);
+    snprintf(vars[1], sizeof(vars[1]), "FANCONTROL_STATE=%s", k->state ? "raised" : "cleared");
+    snprintf(vars[2], sizeof(vars[2]), "FANCONTROL_SUBJECT=%s", k->subject);
+    snprintf(vars[3], sizeof(vars[3]), "FANCONTROL_VALUE=%ld", k->value);
+    snprintf(vars[4], sizeof(vars[4]), "FANCONTROL_LIMIT=%ld", k->limit);
+    snprintf(vars[5], sizeof(vars[5]), "FANCONTROL_MESSAGE=%s", k->message);
+    snprintf(vars[6], sizeof(vars[6]), "FANCONTROL_HOST=%s", hostname);
+    snprintf(vars[7], sizeof(vars[7]), "FANCONTROL_TIME=%ld", static_cast<long>(time(NULL)));
+
+    // The daemon's environment, without FANCONTROL_ variables it may have inherited
+    char *envp[256 + 9];
+    int n = 0;
+    for (char **e = environ; *e && n < 256; ++e) {
+        if (strncmp(*e, "FANCONTROL_", 11) != 0) envp[n++] = *e;
+    }
+    for (int i = 0; i < 8; ++i) envp[n++] = vars[i];
+    envp[n] = NULL;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+
+    pid_t pid;
+    char *argv[] = { const_cast<char *>("sh"), const_cast<char *>("-c"), const_cast<char *>(hook_commands[k->event]), NULL };
+    int err = posix_spawn(&pid, "/bin/sh", &actions, NULL, argv, envp);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (err != 0) {
+        printf("Error: Could not run %s hook: %s\n", hook_names[k->event], strerror(err));
+        return -1;
+    }
+
+    if (debug) printf("Hook %s %s for %s (pid %d)\n", hook_names[k->event], k->state ? "raised" : "cleared", k->subject, pid);
+    hook_runs[hook_running].pid = pid;
+    hook_runs[hook_running].started = started;
+    hook_runs[hook_running].key = static_cast<int>(k - hook_keys);
+    ++hook_running;
+    return 0;
+}
+
+// Reap finished commands and start the ones that are due, never blocks
+void hook_dispatch(double now)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double clock = ts.tv_sec + ts.tv_nsec / 1000000000.0;
+
+    for (int r = hook_running - 1; r >= 0; --r) {
+        struct hook_run *run = &hook_runs[r];
+        const char *event = hook_names[hook_keys[run->key].event];
+        int status;
+        pid_t pid = waitpid(run->pid, &status, WNOHANG);
+
+        if (pid == 0) {
+            if (clock - run->started < hook_timeout) continue;
+            printf("Warning: %s hook (pid %d) still running after %d seconds, killing it\n", event, run->pid, hook_timeout);
+            kill(run->pid, SIGKILL);
+            pid = waitpid(run->pid, &status, 0);
+        } else if (pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+            printf("Warning: %s hook exited with status %d\n", event, WEXITSTATUS(status));
+        }
+
+        *run = hook_runs[--hook_running];
+    }
+
+    for (int i = 0; i < hook_key_count && hook_running < hook_max; ++i) {
+        struct hook_key *k = &hook_keys[i];
+        if (!k->pending || now - k->last_run < hook_interval) continue;
+
+        // A command that could not be started is retried after the interval as well
+        k->last_run = now;
+        if (hook_spawn(k, clock) < 0) continue;
+        k->reported = k->state;
+        k->pending = false;
+    }
+}
 
 void iowrite(uint8_t reg, uint8_t val)
 {
@@ -70,18 +383,244 @@ uint8_t ioread(uint8_t reg)
   return inb(port + 1);
 }
 
+static uint8_t sim_ec[256];
+
 void ecwrite(uint8_t reg, uint8_t val)
 {
+  if (simulate) {
+    sim_ec[reg] = val;
+    return;
+  }
   outb(reg, ecbar + 5);
   outb(val, ecbar + 6);
 }
 
 uint8_t ecread(uint8_t reg)
 {
+  if (simulate) return sim_ec[reg];
   outb(reg, ecbar + 5);
   return inb(ecbar + 6);
 }
 
+// The two fan outputs. The controller sets a target, and fans_ramp() moves the duty
+// cycle towards it at a limited rate on a fast timer between control cycles. Only
+// values that actually change are written to the EC.
+enum fan_state { FAN_OK, FAN_KICK, FAN_FAILED };
+
+struct fan {
+    const char *name;   // Named after the IT8613E fan channel
+    uint8_t pwm_reg;    // Duty cycle register
+    uint8_t tach_lsb;   // 16-bit tachometer count registers
+    uint8_t tach_msb;
+    uint8_t freq_reg;   // PWM base clock select in bits 6:4, shared by fan 2 and 3
+    int target;         // PWM requested by the controller
+    double output;      // Current position of the ramp
+    int written;        // Last value written to the EC, -1 before the first write
+    int rpm;            // Last tachometer reading
+    int target_rpm;     // Speed requested by the controller in cascade mode
+    int prev_rpm_error; // RPM error of the previous inner loop step
+    int state;          // fan_state
+    double stall_since; // When the fan was first seen stalled, 0 if it is spinning
+    double kick_until;  // End of the current kick-start attempt
+    bool alarm;         // Set when a kick failed, stays set until cleared
+};
+
+#define FAN_COUNT 2
+static struct fan fans[FAN_COUNT] = {
+    { "fan2", 0x6b, 0x0e, 0x19, 0x55, 0, 0, -1, 0, 0, 0, FAN_OK, 0, 0, false },
+    { "fan3", 0x73, 0x0f, 0x1a, 0x55, 0, 0, -1, 0, 0, 0, FAN_OK, 0, 0, false },
+};
+static double fans_ramp_last = 0;
+static long ec_writes = 0;      // PWM writes issued
+static long ec_writes_saved = 0; // Ramp steps that did not change the written value
+
+void set_fan_pwm(struct fan *f, int value)
+{
+    if (value == f->written) {
+        ++ec_writes_saved;
+        return;
+    }
+
+    ecwrite(f->pwm_reg, value);
+    f->written = value;
+    ++ec_writes;
+}
+
+// Write a value right away, bypassing the ramp
+void init_fan_pwm(struct fan *f, int value)
+{
+    f->target = value;
+    f->output = value;
+    set_fan_pwm(f, value);
+}
+
+// Convert the 16-bit tachometer count, 0xffff means the fan is not turning
+int read_fan_rpm(const struct fan *f)
+{
+    int count = ecread(f->tach_lsb) | (ecread(f->tach_msb) << 8);
+    if (count == 0 || count == 0xffff) return 0;
+    return 1350000 / (count * 2);
+}
+
+// A fan that stays below stall_rpm for stall_time seconds while it is driven above
+// stall_pwm gets a kick at full duty for kick_time seconds. If it is still not turning
+// after that, it is marked failed, the alarm is raised and the other fan takes over.
+void fan_check_stall(struct fan *f, double now)
+{
+    if (stall_rpm <= 0) return;
+
+    bool stalled = f->rpm < stall_rpm;
+
+    switch (f->state) {
+    case FAN_OK:
+        if (!stalled || f->written < stall_pwm) {
+            f->stall_since = 0;
+        } else if (f->stall_since == 0) {
+            f->stall_since = now;
+        } else if (now - f->stall_since >= stall_time) {
+            printf("Fan %s stalled at PWM %d (%d RPM), kick-starting\n", f->name, f->written, f->rpm);
+            f->state = FAN_KICK;
+            f->kick_until = now + kick_time;
+            f->output = pwmmax;
+            set_fan_pwm(f, pwmmax);
+        }
+        break;
+    case FAN_KICK:
+        if (now < f->kick_until) break;
+        f->stall_since = 0;
+        if (stalled) {
+            printf("Fan %s failed to restart, running the remaining fan at %d\n", f->name, failover_pwm);
+            f->state = FAN_FAILED;
+            f->alarm = true;
+            hook_raise(HOOK_STALL, f->name, true, f->rpm, stall_rpm, "Fan failed to restart after a kick");
+        } else {
+            printf("Fan %s restarted at %d RPM\n", f->name, f->rpm);
+            f->state = FAN_OK;
+        }
+        break;
+    case FAN_FAILED:
+        // Keep full duty on it in case it frees itself
+        if (!stalled) {
+            printf("Fan %s is turning again at %d RPM\n", f->name, f->rpm);
+            f->state = FAN_OK;
+            hook_raise(HOOK_STALL, f->name, false, f->rpm, stall_rpm, "Fan is turning again");
+        }
+        break;
+    }
+}
+
+bool fan_failed()
+{
+    for (int i = 0; i < FAN_COUNT; ++i) {
+        if (fans[i].state == FAN_FAILED) return true;
+    }
+    return false;
+}
+
+// Hand the controller output to the fans. While one fan has failed the others run at
+// least at failover_pwm to make up for the missing airflow. In cascade mode the output
+// is a fraction of fan_rpm_max, and the inner loop in fans_ramp() finds the PWM that
+// gives that speed.
+void set_fan_targets(int pwm)
+{
+    for (int i = 0; i < FAN_COUNT; ++i) {
+        struct fan *f = &fans[i];
+        f->target = pwm;
+        if (f->state == FAN_FAILED) f->target = pwmmax;
+        else if (fan_failed() && f->target < failover_pwm) f->target = failover_pwm;
+        f->target_rpm = f->target * fan_rpm_max / pwmmax;
+    }
+
+    // Split the speed targets around the controller output to keep the fans apart
+    if (cascade && fan_sync == SYNC_GAP && FAN_COUNT == 2 && !fan_failed()) {
+        fans[0].target_rpm += fan_gap_rpm / 2;
+        fans[1].target_rpm -= fan_gap_rpm / 2;
+    }
+}
+
+// One step of the inner speed loop, in velocity form so that the integral is the
+// duty cycle itself and cannot wind up past the PWM limits
+double rpm_loop_step(struct fan *f, double dt)
+{
+    int error = f->target_rpm - f->rpm;
+    if (error > -rpm_deadband && error < rpm_deadband) error = 0;
+
+    double delta = rpm_kp * (error - f->prev_rpm_error) + rpm_ki * error * dt;
+    f->prev_rpm_error = error;
+
+    if (f->output + delta > pwmceil) delta = pwmceil - f->output;
+    else if (f->output + delta < pwmmin) delta = pwmmin - f->output;
+    return delta;
+}
+
+// Two fans at slightly different speeds beat against each other at the difference of
+// their blade-pass frequencies
+double fan_beat_hz(double rpm_a, double rpm_b)
+{
+    double diff = rpm_a > rpm_b ? rpm_a - rpm_b : rpm_b - rpm_a;
+    return diff * fan_blades / 60.0;
+}
+
+// Shift PWM from one fan to the other, keeping the total, until their speeds match
+// (lock) or are at least fan_gap_rpm apart (gap). In cascade mode the inner loops take
+// care of this through the speed targets instead.
+void fan_sync_update(double dt)
+{
+    if (fan_sync == SYNC_OFF || cascade || FAN_COUNT != 2 || fans[0].state != FAN_OK || fans[1].state != FAN_OK) {
+        fan_sync_offset = 0;
+        return;
+    }
+
+    int diff = fans[0].rpm - fans[1].rpm;
+    int gap = diff < 0 ? -diff : diff;
+
+    if (fan_sync == SYNC_LOCK) {
+        if (gap > rpm_deadband) fan_sync_offset -= fan_sync_gain * diff * dt;
+    } else if (gap < fan_gap_rpm) {
+        // Widen the gap in the direction the fans already differ
+        fan_sync_offset += (diff >= 0 ? 1 : -1) * fan_sync_gain * (fan_gap_rpm - gap) * dt;
+    }
+
+    if (fan_sync_offset > fan_sync_max) fan_sync_offset = fan_sync_max;
+    else if (fan_sync_offset < -fan_sync_max) fan_sync_offset = -fan_sync_max;
+}
+
+void fans_ramp(double now)
+{
+    double dt = now - fans_ramp_last;
+    fans_ramp_last = now;
+
+    for (int i = 0; i < FAN_COUNT; ++i) {
+        fans[i].rpm = read_fan_rpm(&fans[i]);
+        if (!calibrating) fan_check_stall(&fans[i], now);
+    }
+    if (calibrating) return;
+
+    fan_sync_update(dt);
+
+    for (int i = 0; i < FAN_COUNT; ++i) {
+        struct fan *f = &fans[i];
+
+        // A kick holds full duty until it is evaluated
+        if (f->state == FAN_KICK) continue;
+
+        double target = f->target;
+        if (fan_sync_offset != 0) {
+            target += i == 0 ? fan_sync_offset : -fan_sync_offset;
+            if (target > pwmceil) target = pwmceil;
+            else if (target < pwmmin) target = pwmmin;
+        }
+
+        double delta = cascade && f->state == FAN_OK ? rpm_loop_step(f, dt) : target - f->output;
+
+        if (delta > 0 && slew_up > 0 && delta > slew_up * dt) delta = slew_up * dt;
+        else if (delta < 0 && slew_down > 0 && -delta > slew_down * dt) delta = -slew_down * dt;
+
+        f->output += delta;
+        set_fan_pwm(f, static_cast<int>(f->output + 0.5));
+    }
+}
+
 int split_drive_names(const char *drive_list, char ***drives)
 {
   int count = 1;
@@ -109,122 +648,5068 @@ int split_drive_names(const char *drive_list, char ***drives)
   return count;
 }
 
-void print_usage() {
-    printf("Usage:\n"
-           "\n"
-           " fancontrol --drive_list=<drive_list> [--debug=<value>] [--setpoint=<value>] [--pwminit=<value>] [--interval=<value>] [--overheat=<value>] [--pwmmin=<value>] [--kp=<value>] [--ki=<value>] [--imax=<value>] [--kd=<value>] [--cpu_avg=<value>] [--graphite_server=<ip:port>]\n"
-           "\n"
-           "drive_list        A comma-separated list of drive names between quotes e.g. 'sda,sdc' (required)\n"
-           "debug             Enable (1) or disable (0) debug logs (default: 0)\n"
-           "setpoint          Target maximum hard drive operating temperature in\n"
-           "                  degrees Celsius (default: 37)\n"
-           "pwminit           Initial PWM value to write (default: 128)\n"
-           "interval          How often we poll for temperatures in seconds (default: 10)\n"
-           "overheat          Overheat temperature threshold in degrees Celsius above \n"
-           "                  which we drive the fans at maximum speed (default: 45)\n"
-           "pwmmin            Never drive the fans below this PWM value (default: 80)\n"
-           "kp                Proportional coefficient (default: 50.0)\n"
-           "ki                Integral coefficient (default: 0.5)\n"
-           "imax              Maximum integral value (default: 255.0)\n"
-           "kd                Derivative coefficient (default: 0.0)\n"
-           "cpu_avg           Number of CPU temperature measurements for rolling average (default: 10)\n"
-           "graphite_server   Graphite server IP address and port in the format <ip:port> (optional)\n");
+struct sensor *add_sensor(const char *name, int kind, int sensor_setpoint)
+{
+    if (sensor_count >= MAX_SENSORS) {
+        printf("Error: Too many sensors (max %d)\n", MAX_SENSORS);
+        return NULL;
+    }
+
+    struct sensor *s = &sensors[sensor_count++];
+    memset(s, 0, sizeof(*s));
+    snprintf(s->name, sizeof(s->name), "%s", name);
+    snprintf(s->dev, sizeof(s->dev), "%s", name);
+    s->present = true;
+    s->kind = kind;
+    s->setpoint = sensor_setpoint;
+    s->weight = 1.0;
+    return s;
 }
 
-int connect_to_graphite() {
-    if (!graphite_server) {
-        graphite_sockfd = -1;
-        return -1;
+struct sensor *find_sensor(const char *name)
+{
+    for (int i = 0; i < sensor_count; ++i) {
+        if (strcmp(sensors[i].name, name) == 0 || strcmp(sensors[i].dev, name) == 0) return &sensors[i];
     }
+    return NULL;
+}
 
-    // Do not try to reconnect on every call to send_to_graphite()
-    time_t now = time(NULL);
-    if (now - graphite_last_connect_attempt < graphite_connect_timeout) return -1;
+// Parse "<name>:<setpoint>[:<weight>[:<offset>]],..." and apply it to the sensor table,
+// or only to the given sensor. Names may be sensor names or kernel drive names.
+int apply_sensor_config(const char *config, struct sensor *only)
+{
+    char *list_copy = strdup(config);
+    char *saveptr = NULL;
+    int ret = 0;
 
-    graphite_last_connect_attempt = now;
-    printf("Connecting to Graphite server %s:%d...\n", graphite_server, graphite_port);
+    for (char *entry = strtok_r(list_copy, ",", &saveptr); entry; entry = strtok_r(NULL, ",", &saveptr)) {
+        char *fields[4] = { NULL, NULL, NULL, NULL };
+        int nfields = 0;
+        char *fieldptr = NULL;
 
-    struct sockaddr_in servaddr;
-    graphite_sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (graphite_sockfd < 0) {
-        printf("Error: Could not create socket\n");
+        for (char *f = strtok_r(entry, ":", &fieldptr); f && nfields < 4; f = strtok_r(NULL, ":", &fieldptr)) {
+            fields[nfields++] = f;
+        }
+
+        struct sensor *s = nfields >= 2 ? find_sensor(fields[0]) : NULL;
+        if (only && s != only) continue;
+
+        // Discovered drives may simply not be there right now
+        if (!s && !(drive_auto && nfields >= 2)) {
+            printf("Error: Invalid sensor configuration '%s'\n", entry);
+            ret = -1;
+            break;
+        }
+        if (!s) continue;
+
+        s->setpoint = atoi(fields[1]);
+        if (nfields >= 3) s->weight = atof(fields[2]);
+        if (nfields >= 4) s->offset = atoi(fields[3]);
     }
-    else
-    {
-        memset(&servaddr, 0, sizeof(servaddr));
-        servaddr.sin_family = AF_INET;
-        servaddr.sin_port = htons(graphite_port);
 
-        // Convert IPv4 and IPv6 addresses from text to binary form
-        if (inet_pton(AF_INET, graphite_server, &servaddr.sin_addr) <= 0) {
-            printf("Error: Invalid address / Address not supported\n");
-            close(graphite_sockfd);
-            graphite_sockfd = -1;
+    free(list_copy);
+    return ret;
+}
+
+// Store a new reading. It only replaces the value in use once it moves more than
+// temp_hysteresis degrees away from it, so that a reading flickering between two
+// integers around the setpoint does not make the fans hunt.
+void set_sensor_temp(struct sensor *s, int temp)
+{
+    if (temp_hysteresis > 0 && temp != 0 && s->temp != 0 && abs(temp - s->temp) <= temp_hysteresis) {
+        ++temp_suppressed;
+        return;
+    }
+    s->temp = temp;
+}
+
+// Compute every sensor's weighted error and combine them into the controller error.
+// Sensors without a reading are left out. Returns the sensor that drives the fans.
+struct sensor *aggregate_error(double *error)
+{
+    struct sensor *worst = NULL;
+    double sum = 0;
+    int n = 0;
+
+    for (int i = 0; i < sensor_count; ++i) {
+        struct sensor *s = &sensors[i];
+        if (s->temp == 0) continue;
+
+        s->error = s->weight * (s->temp + s->offset - (s->setpoint + setpoint_shift));
+        if (!worst || s->error > worst->error) worst = s;
+        sum += s->error;
+        ++n;
+    }
+
+    if (n == 0) *error = -(setpoint + setpoint_shift); // Nothing to go on, same as a 0 degree reading
+    else if (aggregate_mean) *error = sum / n;
+    else *error = worst->error;
+
+    return worst;
+}
+
+// A reading plus its offset, moved onto the global setpoint scale so that the single
+// overheat limit fits drives and the CPU alike. Unlike the error it is not weighted.
+int sensor_level(const struct sensor *s)
+{
+    return s->temp + s->offset - s->setpoint + setpoint;
+}
+
+// Hottest sensor on the global setpoint scale, 0 without any reading
+int hottest_level()
+{
+    int hottest = 0;
+    for (int i = 0; i < sensor_count; ++i) {
+        if (sensors[i].temp != 0 && sensor_level(&sensors[i]) > hottest) hottest = sensor_level(&sensors[i]);
+    }
+    return hottest;
+}
+
+// Small expression language for site-specific sensor fusion and control laws, e.g.
+//   --error_expr="avg(sda, sdb) + 5 - setpoint"
+//   --pwm_expr="if(hour >= 22 || hour < 7, min(pwm, 153), pwm)"
+// Expressions are compiled once at startup into a postfix program over the sensor
+// table and evaluated every cycle on a fixed-size stack, without allocating.
+enum expr_op {
+    OP_CONST, OP_SENSOR, OP_VAR,
+    OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_NEG, OP_NOT,
+    OP_LT, OP_LE, OP_GT, OP_GE, OP_EQ, OP_NE, OP_AND, OP_OR,
+    OP_MIN, OP_MAX, OP_AVG, OP_ABS, OP_CLAMP, OP_IF
+};
+
+struct expr_insn {
+    uint8_t op;
+    uint8_t argc;    // Number of arguments for min/max/avg
+    int16_t index;   // Sensor or variable index
+    double value;    // Constant
+};
+
+#define EXPR_MAX_INSNS 128
+#define EXPR_MAX_STACK 32
+
+struct expr {
+    struct expr_insn code[EXPR_MAX_INSNS];
+    int len;
+};
+
+// Variables that expressions can refer to besides sensor names, updated every cycle
+enum expr_var { VAR_SETPOINT, VAR_ERROR, VAR_MAXTEMP, VAR_PWM, VAR_LOAD, VAR_HOUR, VAR_MINUTE, VAR_MAINT, VAR_POWER, VAR_COUNT };
+static const char *expr_var_names[VAR_COUNT] = { "setpoint", "error", "maxtemp", "pwm", "load", "hour", "minute", "maint", "power" };
+static double expr_vars[VAR_COUNT];
+
+static const char *error_expr_src = NULL; // --error_expr
+static const char *pwm_expr_src = NULL;   // --pwm_expr
+static struct expr error_expr;
+static struct expr pwm_expr;
+static long expr_bench = 0;               // --expr_bench, evaluate this many times and exit
+
+struct expr_parser {
+    const char *src;
+    const char *p;
+    struct expr *e;
+    int depth;       // Current stack depth of the program emitted so far
+    const char *err;
+};
+
+static void expr_skip_space(struct expr_parser *ps)
+{
+    while (*ps->p == ' ' || *ps->p == '\t') ++ps->p;
+}
+
+static bool expr_accept(struct expr_parser *ps, const char *tok)
+{
+    expr_skip_space(ps);
+    size_t n = strlen(tok);
+    if (strncmp(ps->p, tok, n) != 0) return false;
+    ps->p += n;
+    return true;
+}
+
+// Append an instruction, tracking how much stack the program needs
+static void expr_emit(struct expr_parser *ps, uint8_t op, int pops, int16_t index, double value, uint8_t argc)
+{
+    if (ps->err) return;
+    if (ps->e->len >= EXPR_MAX_INSNS) {
+        ps->err = "expression too long";
+        return;
+    }
+
+    struct expr_insn *in = &ps->e->code[ps->e->len++];
+    in->op = op;
+    in->argc = argc;
+    in->index = index;
+    in->value = value;
+
+    ps->depth += 1 - pops;
+    if (ps->depth > EXPR_MAX_STACK) ps->err = "expression nested too deeply";
+}
+
+static void expr_parse_or(struct expr_parser *ps);
+
+static void expr_parse_primary(struct expr_parser *ps)
+{
+    expr_skip_space(ps);
+    if (ps->err) return;
+
+    if (*ps->p == '(') {
+        ++ps->p;
+        expr_parse_or(ps);
+        if (!expr_accept(ps, ")")) ps->err = "expected ')'";
+        return;
+    }
+
+    if ((*ps->p >= '0' && *ps->p <= '9') || *ps->p == '.') {
+        char *end;
+        double v = strtod(ps->p, &end);
+        ps->p = end;
+        expr_emit(ps, OP_CONST, 0, 0, v, 0);
+        return;
+    }
+
+    char name[64];
+    size_t n = 0;
+    while ((*ps->p >= 'a' && *ps->p <= 'z') || (*ps->p >= 'A' && *ps->p <= 'Z') ||
+           (*ps->p >= '0' && *ps->p <= '9') || *ps->p == '_') {
+        if (n < sizeof(name) - 1) name[n++] = *ps->p;
+        ++ps->p;
+    }
+    name[n] = '\0';
+
+    if (n == 0) {
+        ps->err = "unexpected character";
+        return;
+    }
+
+    if (expr_accept(ps, "(")) {
+        static const struct { const char *name; uint8_t op; int minargs; int maxargs; } funcs[] = {
+            { "min", OP_MIN, 1, 255 }, { "max", OP_MAX, 1, 255 }, { "avg", OP_AVG, 1, 255 },
+            { "abs", OP_ABS, 1, 1 }, { "clamp", OP_CLAMP, 3, 3 }, { "if", OP_IF, 3, 3 },
+        };
+
+        int f = -1;
+        for (size_t i = 0; i < sizeof(funcs) / sizeof(funcs[0]); ++i) {
+            if (strcmp(funcs[i].name, name) == 0) f = i;
         }
-        else if (connect(graphite_sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
-            printf("Error: Connection Failed\n");
-            close(graphite_sockfd);
-            graphite_sockfd = -1;
+        if (f < 0) {
+            ps->err = "unknown function";
+            return;
         }
-        else {
-            printf("Connected to Graphite server\n");
+
+        int argc = 0;
+        do {
+            expr_parse_or(ps);
+            ++argc;
+        } while (!ps->err && expr_accept(ps, ","));
+
+        if (!ps->err && !expr_accept(ps, ")")) ps->err = "expected ')'";
+        if (!ps->err && (argc < funcs[f].minargs || argc > funcs[f].maxargs)) ps->err = "wrong number of arguments";
+        expr_emit(ps, funcs[f].op, argc, 0, 0, argc);
+        return;
+    }
+
+    for (int i = 0; i < VAR_COUNT; ++i) {
+        if (strcmp(expr_var_names[i], name) == 0) {
+            expr_emit(ps, OP_VAR, 0, i, 0, 0);
+            return;
         }
     }
 
-    return graphite_sockfd;
-}
+    struct sensor *s = find_sensor(name);
+    if (!s) {
+        ps->err = "unknown sensor or variable";
+        return;
+    }
+    expr_emit(ps, OP_SENSOR, 0, s - sensors, 0, 0);
+}
+
+static void expr_parse_unary(struct expr_parser *ps)
+{
+    if (expr_accept(ps, "-")) {
+        expr_parse_unary(ps);
+        expr_emit(ps, OP_NEG, 1, 0, 0, 0);
+    } else if (expr_accept(ps, "!")) {
+        expr_parse_unary(ps);
+        expr_emit(ps, OP_NOT, 1, 0, 0, 0);
+    } else {
+        expr_parse_primary(ps);
+    }
+}
+
+static void expr_parse_mul(struct expr_parser *ps)
+{
+    expr_parse_unary(ps);
+    while (!ps->err) {
+        if (expr_accept(ps, "*")) { expr_parse_unary(ps); expr_emit(ps, OP_MUL, 2, 0, 0, 0); }
+        else if (expr_accept(ps, "/")) { expr_parse_unary(ps); expr_emit(ps, OP_DIV, 2, 0, 0, 0); }
+        else break;
+    }
+}
+
+static void expr_parse_add(struct expr_parser *ps)
+{
+    expr_parse_mul(ps);
+    while (!ps->err) {
+        if (expr_accept(ps, "+")) { expr_parse_mul(ps); expr_emit(ps, OP_ADD, 2, 0, 0, 0); }
+        else if (expr_accept(ps, "-")) { expr_parse_mul(ps); expr_emit(ps, OP_SUB, 2, 0, 0, 0); }
+        else break;
+    }
+}
+
+static void expr_parse_cmp(struct expr_parser *ps)
+{
+    expr_parse_add(ps);
+    while (!ps->err) {
+        // Two-character operators must be tried first
+        if (expr_accept(ps, "<=")) { expr_parse_add(ps); expr_emit(ps, OP_LE, 2, 0, 0, 0); }
+        else if (expr_accept(ps, ">=")) { expr_parse_add(ps); expr_emit(ps, OP_GE, 2, 0, 0, 0); }
+        else if (expr_accept(ps, "==")) { expr_parse_add(ps); expr_emit(ps, OP_EQ, 2, 0, 0, 0); }
+        else if (expr_accept(ps, "!=")) { expr_parse_add(ps); expr_emit(ps, OP_NE, 2, 0, 0, 0); }
+        else if (expr_accept(ps, "<")) { expr_parse_add(ps); expr_emit(ps, OP_LT, 2, 0, 0, 0); }
+        else if (expr_accept(ps, ">")) { expr_parse_add(ps); expr_emit(ps, OP_GT, 2, 0, 0, 0); }
+        else break;
+    }
+}
+
+static void expr_parse_and(struct expr_parser *ps)
+{
+    expr_parse_cmp(ps);
+    while (!ps->err && expr_accept(ps, "&&")) {
+        expr_parse_cmp(ps);
+        expr_emit(ps, OP_AND, 2, 0, 0, 0);
+    }
+}
+
+static void expr_parse_or(struct expr_parser *ps)
+{
+    expr_parse_and(ps);
+    while (!ps->err && expr_accept(ps, "||")) {
+        expr_parse_and(ps);
+        expr_emit(ps, OP_OR, 2, 0, 0, 0);
+    }
+}
+
+int expr_compile(const char *src, struct expr *e)
+{
+    struct expr_parser ps = { src, src, e, 0, NULL };
+    e->len = 0;
+
+    expr_parse_or(&ps);
+    expr_skip_space(&ps);
+    if (!ps.err && *ps.p != '\0') ps.err = "unexpected trailing input";
+
+    if (ps.err) {
+        printf("Error: Invalid expression '%s': %s at offset %d\n", src, ps.err, (int)(ps.p - src));
+        return -1;
+    }
+    return 0;
+}
+
+// Sensors without a reading evaluate to NaN. min/max/avg skip NaN arguments, everything
+// else propagates it, and callers fall back to the built-in behaviour on a NaN result.
+double expr_eval(const struct expr *e)
+{
+    double stack[EXPR_MAX_STACK];
+    int sp = 0;
+
+    for (int i = 0; i < e->len; ++i) {
+        const struct expr_insn *in = &e->code[i];
+        double a, b;
+
+        switch (in->op) {
+        case OP_CONST: stack[sp++] = in->value; break;
+        case OP_SENSOR: {
+            int temp = sensors[in->index].temp;
+            stack[sp++] = temp != 0 ? temp : __builtin_nan("");
+            break;
+        }
+        case OP_VAR: stack[sp++] = expr_vars[in->index]; break;
+        case OP_NEG: stack[sp - 1] = -stack[sp - 1]; break;
+        case OP_NOT: stack[sp - 1] = !stack[sp - 1]; break;
+        case OP_ABS: stack[sp - 1] = stack[sp - 1] < 0 ? -stack[sp - 1] : stack[sp - 1]; break;
+        case OP_MIN:
+        case OP_MAX:
+        case OP_AVG: {
+            double acc = __builtin_nan("");
+            int n = 0;
+            sp -= in->argc;
+            for (int k = 0; k < in->argc; ++k) {
+                double v = stack[sp + k];
+                if (__builtin_isnan(v)) continue;
+                if (n == 0) acc = v;
+                else if (in->op == OP_MIN) acc = v < acc ? v : acc;
+                else if (in->op == OP_MAX) acc = v > acc ? v : acc;
+                else acc += v;
+                ++n;
+            }
+            stack[sp++] = in->op == OP_AVG && n > 0 ? acc / n : acc;
+            break;
+        }
+        case OP_CLAMP:
+            sp -= 2;
+            a = stack[sp];
+            b = stack[sp + 1];
+            if (stack[sp - 1] < a) stack[sp - 1] = a;
+            else if (stack[sp - 1] > b) stack[sp - 1] = b;
+            break;
+        case OP_IF:
+            sp -= 2;
+            stack[sp - 1] = stack[sp - 1] ? stack[sp] : stack[sp + 1];
+            break;
+        default:
+            b = stack[--sp];
+            a = stack[sp - 1];
+            switch (in->op) {
+            case OP_ADD: a = a + b; break;
+            case OP_SUB: a = a - b; break;
+            case OP_MUL: a = a * b; break;
+            case OP_DIV: a = a / b; break;
+            case OP_LT: a = a < b; break;
+            case OP_LE: a = a <= b; break;
+            case OP_GT: a = a > b; break;
+            case OP_GE: a = a >= b; break;
+            case OP_EQ: a = a == b; break;
+            case OP_NE: a = a != b; break;
+            case OP_AND: a = a && b; break;
+            case OP_OR: a = a || b; break;
+            }
+            stack[sp - 1] = a;
+            break;
+        }
+    }
+
+    return sp > 0 ? stack[0] : __builtin_nan("");
+}
+
+// Time a large number of evaluations, to keep an eye on the cost per cycle
+void expr_benchmark(const char *name, const struct expr *e, long iterations)
+{
+    struct timespec start, end;
+    volatile double sink = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < iterations; ++i) sink = sink + expr_eval(e);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ns = (1000000000.0 * (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)) / iterations;
+    printf("%s: %d instructions, %.1f ns per evaluation\n", name, e->len, ns);
+}
+
+// Fraction of CPU time that was not idle since the previous call, from /proc/stat
+double read_cpu_load()
+{
+    static unsigned long long prev_total = 0, prev_idle = 0;
+    unsigned long long v[8] = { 0 };
+    double load = 0;
+
+    FILE *f = fopen("/proc/stat", "r");
+    if (!f) return 0;
+
+    if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+               &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) == 8) {
+        unsigned long long idle = v[3] + v[4];
+        unsigned long long total = 0;
+        for (int i = 0; i < 8; ++i) total += v[i];
+
+        if (prev_total && total > prev_total) {
+            load = 1.0 - (double)(idle - prev_idle) / (total - prev_total);
+        }
+        prev_total = total;
+        prev_idle = idle;
+    }
+
+    fclose(f);
+    return load;
+}
+
+void print_usage() {
+    printf("Usage:\n"
+           "\n"
+           " fancontrol --drive_list=<drive_list> [--drive_filter=<patterns>] [--debug=<value>] [--setpoint=<value>] [--pwminit=<value>] [--interval=<value>] [--overheat=<value>] [--pwmmin=<value>] [--kp=<value>] [--ki=<value>] [--imax=<value>] [--kd=<value>] [--cpu_avg=<value>] [--sensors=<list>] [--helper=<name>:<command>]... [--helper_timeout=<value>] [--smart_interval=<value>] [--smart_alert=<list>] [--latency_factor=<value>] [--breaker_trips=<value>] [--breaker_slow=<value>] [--breaker_backoff=<value>] [--breaker_margin=<value>] [--breaker_pwm=<value>] [--array_interval=<value>] [--mdstat=<path>] [--zfs_kstat=<path>] [--zfs_busy_mbps=<value>] [--array_check=<dir>] [--maint_delta=<value>] [--maint_pwm=<value>] [--throttle=<cgroup>]... [--throttle_span=<value>] [--throttle_hysteresis=<value>] [--throttle_cpu=<value>] [--throttle_io=<value>] [--throttle_io_start=<value>] [--cgroup_root=<path>] [--rapl_zone=<path>] [--rapl_min=<value>] [--rapl_step=<value>] [--shm=<path>] [--fleet_server=<ip:port>] [--fleet_tcp=<value>] [--fleet_name=<name>] [--fleet_listen=<port>] [--fleet_flush=<value>] [--fleet_bench=<n>] [--mqtt_server=<ip:port>] [--mqtt_topic=<topic>] [--mqtt_discovery=<prefix>] [--mqtt_keepalive=<value>] [--mqtt_user=<name>] [--mqtt_password=<value>] [--mqtt_bench=<value>] [--agentx=<socket>] [--agentx_bench=<value>] [--hook=<event>:<command>]... [--hook_interval=<value>] [--hook_max=<value>] [--hook_timeout=<value>] [--aggregate=<max|mean>] [--error_expr=<expr>] [--pwm_expr=<expr>] [--expr_bench=<n>] [--profile=<spec>]... [--schedule=<list>] [--profile_ramp=<value>] [--control_socket=<path>] [--precool=<m>:<h>] [--precool_lead=<value>] [--precool_delta=<value>] [--precool_dir=<path>] [--slew_up=<value>] [--slew_down=<value>] [--ramp_tick=<value>] [--pwm_deadband=<value>] [--temp_hysteresis=<value>] [--stall_rpm=<value>] [--stall_pwm=<value>] [--stall_time=<value>] [--kick_time=<value>] [--failover_pwm=<value>] [--cascade=<value>] [--fan_rpm_max=<value>] [--rpm_kp=<value>] [--rpm_ki=<value>] [--rpm_deadband=<value>] [--fan_sync=<off|lock|gap>] [--fan_gap_rpm=<value>] [--fan_blades=<value>] [--pwm_freq=<value>] [--calibrate=<value>] [--calibration_file=<path>] [--simulate=<value>] [--sim_duration=<value>] [--sim_ambient=<value>] [--sim_job_watts=<value>] [--sim_stall=<fan>:<s>[:<s>]] [--sim_fail=<sensor>:<s>[:<s>]] [--sim_suspend=<s>:<s>] [--graphite_server=<ip:port>]\n"
+           "\n"
+           "drive_list        A comma-separated list of drive names between quotes e.g. 'sda,sdc',\n"
+           "                  or 'auto' to discover drives and follow hotplug (required)\n"
+           "drive_filter      With drive_list=auto, only use drives whose /dev/disk/by-id\n"
+           "                  name matches one of these comma-separated patterns, e.g.\n"
+           "                  'ata-WDC*,nvme-Samsung*' (optional)\n"
+           "debug             Enable (1) or disable (0) debug logs (default: 0)\n"
+           "setpoint          Target maximum hard drive operating temperature in\n"
+           "                  degrees Celsius (default: 37)\n"
+           "pwminit           Initial PWM value to write (default: 128)\n"
+           "interval          How often we poll for temperatures in seconds (default: 10)\n"
+           "overheat          Overheat temperature threshold in degrees Celsius above \n"
+           "                  which we drive the fans at maximum speed and throttle the\n"
+           "                  throttle cgroups (default: 45)\n"
+           "pwmmin            Never drive the fans below this PWM value (default: 80)\n"
+           "kp                Proportional coefficient (default: 50.0)\n"
+           "ki                Integral coefficient (default: 0.5)\n"
+           "imax              Maximum integral value (default: 255.0)\n"
+           "kd                Derivative coefficient (default: 0.0)\n"
+           "cpu_avg           Number of CPU temperature measurements for rolling average (default: 10)\n"
+           "sensors           Per-sensor overrides as a comma-separated list of\n"
+           "                  <name>:<setpoint>[:<weight>[:<offset>]] where name is a\n"
+           "                  drive from drive_list, a discovered drive, a helper or 'cpu'\n"
+           "                  (default: drives and helpers use setpoint, cpu uses\n"
+           "                  setpoint + 20, weight 1, offset 0)\n"
+           "helper            Sensor read from a long-running command: it gets 'read' on\n"
+           "                  stdin every cycle and answers with a line holding the\n"
+           "                  temperature, e.g. 'ups:/usr/local/bin/ups-temp' (optional,\n"
+           "                  can be repeated)\n"
+           "helper_timeout    Seconds a helper has to answer before it is restarted\n"
+           "                  (default: 2)\n"
+           "smart_interval    Seconds between SMART health reports of each drive, 0 to\n"
+           "                  disable (default: 3600)\n"
+           "smart_alert       Warn when SMART attributes reach a limit, as a comma-separated\n"
+           "                  list of <attribute>:<limit> out of reallocated, pending,\n"
+           "                  crc_errors, power_on_hours, load_cycles and media_errors, 0\n"
+           "                  disables an alert (default: 'reallocated:1,pending:1,\n"
+           "                  crc_errors:1,media_errors:1')\n"
+           "latency_factor    Warn when a drive answers this many times slower than its\n"
+           "                  own average or the other drives' (default: 4.0)\n"
+           "breaker_trips     Failed probes in a row after which a sensor is only retried\n"
+           "                  with an increasing backoff (default: 3)\n"
+           "breaker_slow      Seconds after which a drive probe counts as failed\n"
+           "                  (default: 5.0)\n"
+           "breaker_backoff   Longest backoff in seconds between retries of a failed\n"
+           "                  sensor (default: 600)\n"
+           "breaker_margin    Degrees added to the last reading of a failed sensor\n"
+           "                  (default: 5)\n"
+           "breaker_pwm       Minimum PWM while any sensor has failed (default: 0)\n"
+           "array_interval    Seconds between checks for md resyncs and busy ZFS pools, 0\n"
+           "                  to disable (default: 60)\n"
+           "mdstat            md RAID status file (default: /proc/mdstat)\n"
+           "zfs_kstat         ZFS kstat directory (default: /proc/spl/kstat/zfs)\n"
+           "zfs_busy_mbps     Pool reads in MB/s that make a ZFS pool read-busy, as during\n"
+           "                  a scrub or resilver (default: 100.0)\n"
+           "array_check       Parse the mdstat and txgs captures in this directory (e.g.\n"
+           "                  fixtures/array), check the results and exit\n"
+           "maint_delta       Lower the setpoint by this many degrees during array\n"
+           "                  maintenance (default: 2.0)\n"
+           "maint_pwm         Minimum PWM during array maintenance (default: 0)\n"
+           "throttle          cgroup (relative to cgroup_root) whose CPU and disk I/O are\n"
+           "                  limited above overheat, e.g. 'system.slice/backup.service'\n"
+           "                  (optional, can be repeated)\n"
+           "throttle_span     Degrees above overheat where the limits are strongest\n"
+           "                  (default: 5)\n"
+           "throttle_hysteresis\n"
+           "                  Lift the limits this many degrees below overheat (default: 2)\n"
+           "throttle_cpu      CPU percent left at the strongest limit (default: 10.0)\n"
+           "throttle_io       Read and write MB/s per drive left at the strongest limit\n"
+           "                  (default: 10.0)\n"
+           "throttle_io_start Read and write MB/s per drive as throttling starts\n"
+           "                  (default: 200.0)\n"
+           "cgroup_root       Mount point of the cgroup v2 hierarchy (default: /sys/fs/cgroup)\n"
+           "rapl_zone         RAPL powercap zone of the CPU package, for power metrics\n"
+           "                  (default: /sys/class/powercap/intel-rapl:0)\n"
+           "rapl_min          Lower the CPU power limit towards this many watts while the\n"
+           "                  fans are at their maximum and the CPU is still too hot,\n"
+           "                  0 to never touch it (default: 0)\n"
+           "rapl_step         Watts the CPU power limit moves per cycle (default: 2.0)\n"
+           "shm               Publish temperatures, PWM, fan speeds and PID terms in this\n"
+           "                  shared memory file for local readers, see fancontrol_shm.h,\n"
+           "                  e.g. /dev/shm/fancontrol (optional)\n"
+           "fleet_server      Send readings to a fleet aggregator at <ip:port> (optional)\n"
+           "fleet_tcp         Send them over TCP instead of UDP (default: 0)\n"
+           "fleet_name        Name of this machine in the fleet (default: hostname)\n"
+           "fleet_listen      Run as fleet aggregator on this UDP and TCP port, forwarding\n"
+           "                  to graphite_server instead of controlling fans (optional)\n"
+           "fleet_flush       Seconds between forwards of the aggregator (default: 10)\n"
+           "fleet_bench       Stream from this many simulated agents to an aggregator over\n"
+           "                  loopback, check what arrived and exit\n"
+           "mqtt_server       Publish state to the MQTT broker at <ip:port> (optional)\n"
+           "mqtt_topic        Topic prefix (default: fancontrol/<hostname>)\n"
+           "mqtt_discovery    Home Assistant discovery prefix, empty for none\n"
+           "                  (default: homeassistant)\n"
+           "mqtt_keepalive    MQTT keepalive in seconds (default: 60)\n"
+           "mqtt_user         MQTT user name (optional)\n"
+           "mqtt_password     MQTT password (optional)\n"
+           "mqtt_bench        Run the client against a stand-in broker over loopback, check\n"
+           "                  what it sent and exit (default: 0)\n"
+           "agentx            Serve FANCONTROL-MIB through the AgentX master at this path\n"
+           "                  or <ip:port>, e.g. /var/agentx/master (optional)\n"
+           "agentx_bench      Run the subagent against a stand-in master over TCP and a Unix\n"
+           "                  socket, check its answers and exit (default: 0)\n"
+           "hook              Run a shell command on overheat, stall, sensor or smart events,\n"
+           "                  with the details in FANCONTROL_* variables, can be repeated\n"
+           "                  for different events, e.g. 'overheat:/usr/local/bin/page'\n"
+           "hook_interval     Seconds between commands for the same event and subject\n"
+           "                  (default: 300)\n"
+           "hook_max          Hook commands running at the same time (default: 4)\n"
+           "hook_timeout      Seconds before a hook command is killed (default: 60)\n"
+           "aggregate         Combine sensor errors by acting on the worst one (max)\n"
+           "                  or on their average (mean) (default: max)\n"
+           "error_expr        Expression that computes the controller error instead of\n"
+           "                  the sensor aggregate, e.g. 'avg(sda,sdb) + 5 - setpoint'\n"
+           "                  (optional)\n"
+           "pwm_expr          Expression applied to the PID output, e.g.\n"
+           "                  'if(hour >= 22 || hour < 7, min(pwm, 153), pwm)' (optional)\n"
+           "                  Expressions can use sensor names, setpoint, error, maxtemp,\n"
+           "                  pwm, load (0-1), hour, minute, maint (0-1), power (CPU W),\n"
+           "                  + - * / < <= > >= == != && || ! and min(), max(), avg(),\n"
+           "                  abs(), clamp(x,lo,hi), if(c,a,b)\n"
+           "expr_bench        Time this many evaluations of each expression and exit\n"
+           "profile           Named parameter set <name>:<setpoint>:<pwmmin>:<pwmmax>[:<kp>:<ki>:<kd>],\n"
+           "                  may be repeated. The command line values form profile 'default'\n"
+           "schedule          When to activate profiles as a comma-separated list of\n"
+           "                  HH:MM-HH:MM=<profile>, first match wins (optional)\n"
+           "profile_ramp      Seconds over which a profile switch is ramped in (default: 60)\n"
+           "control_socket    Unix socket accepting commands such as 'profile <name>',\n"
+           "                  'profile auto', 'precool <m> <h>', 'clear_alarm' and 'status'\n"
+           "                  (optional)\n"
+           "precool           Announce a heavy job starting in <m> minutes for <h> hours (optional)\n"
+           "precool_lead      Minutes before an announced job to start cooling (default: 30)\n"
+           "precool_delta     Degrees the setpoint is lowered for announced jobs (default: 3)\n"
+           "precool_dir       Directory watched for job announcements, one file per job\n"
+           "                  containing '<m> <h>' (optional)\n"
+           "slew_up           Max PWM increase per second, 0 for no limit (default: 25)\n"
+           "slew_down         Max PWM decrease per second, 0 for no limit (default: 5)\n"
+           "ramp_tick         Seconds between PWM ramp steps (default: 0.25)\n"
+           "pwm_deadband      Ignore PWM changes smaller than this, except to reach\n"
+           "                  pwmmin or pwmmax (default: 0)\n"
+           "temp_hysteresis   Only accept a new temperature once it is more than this\n"
+           "                  many degrees away from the value in use (default: 0)\n"
+           "stall_rpm         A fan slower than this is stalled, 0 disables stall\n"
+           "                  detection (default: 200)\n"
+           "stall_pwm         Only consider a fan stalled when driven at least at this\n"
+           "                  PWM (default: 60)\n"
+           "stall_time        Seconds a fan must be stalled before it is kick-started (default: 5)\n"
+           "kick_time         Seconds of full duty to restart a stalled fan. A fan that\n"
+           "                  does not restart raises an alarm until 'clear_alarm' (default: 5)\n"
+           "failover_pwm      Minimum PWM of the remaining fan while the other has failed\n"
+           "                  (default: 255)\n"
+           "cascade           Let the temperature loop set a fan speed, and an inner loop\n"
+           "                  on the tachometers adjust the PWM every ramp_tick to reach it\n"
+           "                  (default: 0)\n"
+           "fan_rpm_max       Fan speed at full duty, the temperature loop's output range\n"
+           "                  0-255 maps to 0-fan_rpm_max in cascade mode (default: 1500)\n"
+           "rpm_kp            Inner loop proportional coefficient (default: 0.05)\n"
+           "rpm_ki            Inner loop integral coefficient (default: 0.1)\n"
+           "rpm_deadband      Inner loop leaves the PWM alone within this many RPM of the\n"
+           "                  target (default: 20)\n"
+           "fan_sync          Keep the two fans at the same speed (lock) or at least\n"
+           "                  fan_gap_rpm apart (gap) to avoid an audible beat, shifting PWM\n"
+           "                  between them so that the total stays the same (default: off)\n"
+           "fan_gap_rpm       Minimum speed difference in gap mode (default: 100)\n"
+           "fan_blades        Blades per fan, for the fancontrol.beat_hz metric (default: 7)\n"
+           "pwm_freq          PWM base clock select: 0 187500 Hz, 1 93750 Hz, 2 46875 Hz,\n"
+           "                  3 31250 Hz, 4 23437 Hz, 5 11718 Hz, 6 5859 Hz, 7 2929 Hz\n"
+           "                  (default: chip setting or calibration)\n"
+           "calibrate         Step the fans down at every PWM frequency to find the one\n"
+           "                  where they keep turning slowest, save it with the lowest\n"
+           "                  stable PWM to calibration_file and exit (default: 0)\n"
+           "calibration_file  Calibration applied at startup, unless pwm_freq or pwmmin\n"
+           "                  are given (default: /var/lib/fancontrol/calibration)\n"
+           "simulate          Run against a thermal model instead of the hardware (default: 0)\n"
+           "sim_duration      Simulated seconds to run before printing a summary (default: 0, forever)\n"
+           "sim_ambient       Simulated room temperature (default: 25)\n"
+           "sim_job_watts     Extra heat per drive while an announced job runs (default: 4)\n"
+           "sim_stall         Seize a simulated fan (fan2 or fan3) after <s> seconds,\n"
+           "                  optionally freeing it again after the second <s> (optional)\n"
+           "sim_fail          Fail the probes of a simulated sensor after <s> seconds,\n"
+           "                  optionally recovering after the second <s> (optional)\n"
+           "sim_suspend       Suspend the simulated system after the first <s> seconds for\n"
+           "                  the second <s> seconds (optional)\n"
+           "graphite_server   Graphite server IP address and port in the format <ip:port> (optional)\n");
+}
+
+int connect_to_graphite() {
+    if (!graphite_server) {
+        graphite_sockfd = -1;
+        return -1;
+    }
+
+    // Do not try to reconnect on every call to send_to_graphite()
+    time_t now = time(NULL);
+    if (now - graphite_last_connect_attempt < graphite_connect_timeout) return -1;
+
+    graphite_last_connect_attempt = now;
+    printf("Connecting to Graphite server %s:%d...\n", graphite_server, graphite_port);
+
+    struct sockaddr_in servaddr;
+    graphite_sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (graphite_sockfd < 0) {
+        printf("Error: Could not create socket\n");
+    }
+    else
+    {
+        memset(&servaddr, 0, sizeof(servaddr));
+        servaddr.sin_family = AF_INET;
+        servaddr.sin_port = htons(graphite_port);
+
+        // Convert IPv4 and IPv6 addresses from text to binary form
+        if (inet_pton(AF_INET, graphite_server, &servaddr.sin_addr) <= 0) {
+            printf("Error: Invalid address / Address not supported\n");
+            close(graphite_sockfd);
+            graphite_sockfd = -1;
+        }
+        else if (connect(graphite_sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
+            printf("Error: Connection Failed\n");
+            close(graphite_sockfd);
+            graphite_sockfd = -1;
+        }
+        else {
+            printf("Connected to Graphite server\n");
+        }
+    }
+
+    return graphite_sockfd;
+}
+
+void send_to_graphite(const char *message) {
+    if (graphite_sockfd < 0 && connect_to_graphite() < 0) {
+        return;
+    }
+
+    int ret = send(graphite_sockfd, message, strlen(message), 0);
+    if (ret < 0) {
+        printf("Error: Could not send to Graphite: %s\n", strerror(errno));
+        printf("Closing connection to Graphite server\n");
+        close(graphite_sockfd);
+        graphite_sockfd = -1;
+
+        // Try to reconnect and send again
+        if (connect_to_graphite() > 0) {
+            send(graphite_sockfd, message, strlen(message), 0);
+        }
+    }
+}
+
+int calculate_new_pwm(double error, double timediff, double &integral, double &prev_error) {
+    integral += error * timediff;
+
+    if (integral > imax) integral = imax;
+    else if (integral < -imax) integral = -imax;
+
+    double derivative = (error - prev_error) / timediff;
+    prev_error = error;
+
+    pid_terms[0] = kp * error;
+    pid_terms[1] = ki * integral;
+    pid_terms[2] = kd * derivative;
+
+    // Compute the new PWM
+    double newPWM_double = pwminit + kp * error + ki * integral + kd * derivative;
+
+    if (newPWM_double > pwmceil) newPWM_double = pwmceil;
+    else if (newPWM_double < pwmmin) newPWM_double = pwmmin;
+
+    int newPWM = static_cast<int>(newPWM_double);
+
+    // Send pid values to Graphite
+    if (graphite_server) {
+        char message[256];
+
+        snprintf(message, sizeof(message), "fancontrol.p %f %ld\n", error * kp, time(NULL));
+        send_to_graphite(message);
+
+        snprintf(message, sizeof(message), "fancontrol.i %f %ld\n", integral * ki, time(NULL));
+        send_to_graphite(message);
+
+        snprintf(message, sizeof(message), "fancontrol.d %f %ld\n", derivative * kd, time(NULL));
+        send_to_graphite(message);
+    }
+
+    return newPWM;
+}
+
+// A profile is a named set of controller parameters. Profile 0 is built from the
+// command line, the others from --profile, and they are activated by --schedule
+// or by a "profile <name>" command on the control socket.
+struct profile {
+    char name[32];
+    double setpoint;
+    double pwmmin;
+    double pwmmax;
+    double kp;
+    double ki;
+    double kd;
+};
+
+struct schedule_window {
+    int start;      // Minutes after midnight
+    int end;        // Minutes after midnight, may wrap around
+    int profile;
+};
+
+#define MAX_PROFILES 8
+#define MAX_SCHEDULE 16
+static struct profile profiles[MAX_PROFILES];
+static int profile_count = 0;
+static struct schedule_window schedule[MAX_SCHEDULE];
+static int schedule_count = 0;
+
+static int profile_manual = -1;     // Profile forced over the control socket, -1 follows the schedule
+static int profile_target = 0;      // Profile we are ramping towards
+static struct profile profile_from; // Parameters when the ramp started
+static struct profile profile_active;
+static double profile_ramp_start = 0;
+
+double monotonic_now()
+{
+    if (simulate) return sim_clock;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+// Wall clock time, which follows the simulated clock when simulating
+time_t wall_now()
+{
+    return simulate ? start_time + static_cast<time_t>(sim_clock) : time(NULL);
+}
+
+int find_profile(const char *name)
+{
+    for (int i = 0; i < profile_count; ++i) {
+        if (strcmp(profiles[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+// Parse "<name>:<setpoint>:<pwmmin>:<pwmmax>[:<kp>:<ki>:<kd>]"
+int add_profile(const char *spec)
+{
+    if (profile_count >= MAX_PROFILES) {
+        printf("Error: Too many profiles (max %d)\n", MAX_PROFILES);
+        return -1;
+    }
+
+    struct profile *p = &profiles[profile_count];
+    *p = profiles[0]; // Gains default to the command line values
+    double v[6] = { p->setpoint, p->pwmmin, p->pwmmax, p->kp, p->ki, p->kd };
+
+    const char *colon = strchr(spec, ':');
+    int n = colon ? sscanf(colon + 1, "%lf:%lf:%lf:%lf:%lf:%lf", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5]) : 0;
+    if (n < 3 || colon == spec || (size_t)(colon - spec) >= sizeof(p->name)) {
+        printf("Error: Invalid profile '%s'. Expected <name>:<setpoint>:<pwmmin>:<pwmmax>[:<kp>:<ki>:<kd>]\n", spec);
+        return -1;
+    }
+
+    snprintf(p->name, sizeof(p->name), "%.*s", (int)(colon - spec), spec);
+    p->setpoint = v[0];
+    p->pwmmin = v[1];
+    p->pwmmax = v[2] > pwmmax ? pwmmax : v[2];
+    p->kp = v[3];
+    p->ki = v[4];
+    p->kd = v[5];
+    ++profile_count;
+    return 0;
+}
+
+// Parse "HH:MM-HH:MM=<profile>,..."
+int parse_schedule(const char *spec)
+{
+    char *list_copy = strdup(spec);
+    char *saveptr = NULL;
+    int ret = 0;
+
+    for (char *entry = strtok_r(list_copy, ",", &saveptr); entry; entry = strtok_r(NULL, ",", &saveptr)) {
+        int h1, m1, h2, m2;
+        char name[32];
+
+        if (schedule_count >= MAX_SCHEDULE ||
+            sscanf(entry, "%d:%d-%d:%d=%31s", &h1, &m1, &h2, &m2, name) != 5 ||
+            find_profile(name) < 0) {
+            printf("Error: Invalid schedule entry '%s'\n", entry);
+            ret = -1;
+            break;
+        }
+
+        struct schedule_window *w = &schedule[schedule_count++];
+        w->start = h1 * 60 + m1;
+        w->end = h2 * 60 + m2;
+        w->profile = find_profile(name);
+    }
+
+    free(list_copy);
+    return ret;
+}
+
+// The profile that should be active now: a manual override, else the first matching
+// schedule window, else the command line profile
+int scheduled_profile(time_t now)
+{
+    if (profile_manual >= 0) return profile_manual;
+
+    struct tm local;
+    localtime_r(&now, &local);
+    int minute = local.tm_hour * 60 + local.tm_min;
+
+    for (int i = 0; i < schedule_count; ++i) {
+        const struct schedule_window *w = &schedule[i];
+        bool inside = w->start <= w->end ? (minute >= w->start && minute < w->end)
+                                         : (minute >= w->start || minute < w->end);
+        if (inside) return w->profile;
+    }
+
+    return 0;
+}
+
+// Move the active parameters towards the target profile. Parameters are interpolated
+// over profile_ramp seconds, and the integral is rescaled whenever ki changes so that
+// the integral term, and with it the PWM, does not jump on a switch.
+void update_profile(double now, double &integral)
+{
+    int target = scheduled_profile(wall_now());
+
+    if (target != profile_target) {
+        if (debug) printf("Switching from profile %s to %s\n", profiles[profile_target].name, profiles[target].name);
+        profile_from = profile_active;
+        profile_target = target;
+        profile_ramp_start = now;
+    }
+
+    const struct profile *to = &profiles[profile_target];
+    double f = profile_ramp > 0 ? (now - profile_ramp_start) / profile_ramp : 1.0;
+    if (f > 1.0) f = 1.0;
+
+    double old_ki = profile_active.ki;
+
+    profile_active.setpoint = profile_from.setpoint + f * (to->setpoint - profile_from.setpoint);
+    profile_active.pwmmin = profile_from.pwmmin + f * (to->pwmmin - profile_from.pwmmin);
+    profile_active.pwmmax = profile_from.pwmmax + f * (to->pwmmax - profile_from.pwmmax);
+    profile_active.kp = profile_from.kp + f * (to->kp - profile_from.kp);
+    profile_active.ki = profile_from.ki + f * (to->ki - profile_from.ki);
+    profile_active.kd = profile_from.kd + f * (to->kd - profile_from.kd);
+
+    if (profile_active.ki != 0 && old_ki != profile_active.ki) {
+        integral = integral * old_ki / profile_active.ki;
+    }
+
+    setpoint_shift = profile_active.setpoint - profiles[0].setpoint;
+    pwmmin = static_cast<int>(profile_active.pwmmin);
+    pwmceil = static_cast<int>(profile_active.pwmmax);
+    kp = profile_active.kp;
+    ki = profile_active.ki;
+    kd = profile_active.kd;
+}
+
+// Heavy jobs (scrubs, SMART long tests, backups) announce themselves ahead of time with
+// "precool <start in minutes> <duration in hours>" on the control socket or as a file
+// with the same two numbers in --precool_dir. Starting precool_lead minutes before the
+// job, the setpoint is lowered by up to precool_delta degrees until the job ends, so the
+// drives enter the job cold and the controller has headroom left at its peak.
+struct precool_window {
+    double start;   // Monotonic seconds
+    double end;
+};
+
+#define MAX_PRECOOL 8
+static struct precool_window precool_windows[MAX_PRECOOL];
+static int precool_count = 0;
+
+int add_precool(double now, double start_minutes, double duration_hours)
+{
+    // Forget windows that are over to make room
+    int n = 0;
+    for (int i = 0; i < precool_count; ++i) {
+        if (precool_windows[i].end > now) precool_windows[n++] = precool_windows[i];
+    }
+    precool_count = n;
+
+    if (start_minutes < 0 || duration_hours <= 0 || precool_count >= MAX_PRECOOL) return -1;
+
+    struct precool_window *w = &precool_windows[precool_count++];
+    w->start = now + start_minutes * 60;
+    w->end = w->start + duration_hours * 3600;
+
+    if (debug) printf("Precool: job in %.0f minutes for %.1f hours\n", start_minutes, duration_hours);
+    return 0;
+}
+
+// Setpoint offset (zero or negative) for the announced jobs
+double precool_offset(double now)
+{
+    double offset = 0;
+
+    for (int i = 0; i < precool_count; ++i) {
+        const struct precool_window *w = &precool_windows[i];
+        if (now >= w->end) continue;
+
+        // Ramp the setpoint down over the lead time, then hold it for the job
+        double lead = precool_lead * 60;
+        double f = lead > 0 ? (now - (w->start - lead)) / lead : (now >= w->start ? 1.0 : 0.0);
+        if (f <= 0) continue;
+        if (f > 1) f = 1;
+
+        if (-f * precool_delta < offset) offset = -f * precool_delta;
+    }
+
+    return offset;
+}
+
+bool precool_job_running(double now)
+{
+    for (int i = 0; i < precool_count; ++i) {
+        if (now >= precool_windows[i].start && now < precool_windows[i].end) return true;
+    }
+    return false;
+}
+
+// Pick up request files dropped into precool_dir. Their start time counts from when
+// they were written, and they are removed once read.
+void scan_precool_dir(double now)
+{
+    DIR *dir = opendir(precool_dir);
+    if (!dir) return;
+
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", precool_dir, de->d_name);
+
+        struct stat st;
+        FILE *f = fopen(path, "r");
+        if (!f) continue;
+
+        double start_minutes, duration_hours;
+        if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) &&
+            fscanf(f, "%lf %lf", &start_minutes, &duration_hours) == 2) {
+            start_minutes -= (wall_now() - st.st_mtime) / 60.0;
+            if (start_minutes < 0) start_minutes = 0;
+            if (add_precool(now, start_minutes, duration_hours) < 0) printf("Precool: ignoring request %s\n", path);
+        } else {
+            printf("Precool: invalid request %s, expected <start in minutes> <duration in hours>\n", path);
+        }
+
+        fclose(f);
+        unlink(path);
+    }
+
+    closedir(dir);
+}
+
+// Thermal simulator used with --simulate. The EC is replaced by a register file, and
+// every sensor is a first-order thermal mass heated by its device (plus announced
+// precool jobs) and cooled in proportion to the airflow the two fans deliver. Each fan
+// follows its duty cycle with some inertia and reports its speed in the tachometer
+// registers, and can be seized with --sim_stall. Simulated time runs as fast as the
+// controller can go.
+static double sim_temps[MAX_SENSORS];
+static double sim_fail_at[MAX_SENSORS]; // Probes of a sensor fail from here...
+static double sim_fail_until[MAX_SENSORS]; // ...until here, 0 for good
+static double sim_suspend_at = 0; // Simulated suspend at this time, 0 for none
+static double sim_suspend_for = 0; // Seconds the simulated suspend lasts
+static double sim_peak[MAX_SENSORS];
+static double sim_pwm_sum = 0;
+static int sim_pwm_max = 0;
+static double sim_beat_sum = 0;
+
+struct sim_thermal {
+    double watts;       // Idle heat of the device
+    double capacity;    // J/K
+    double g_still;     // W/K with the fans stopped
+    double g_fan;       // Additional W/K at full airflow
+};
+
+struct sim_fan {
+    double gain;        // Wear and dust, 1 for a new fan
+    double rpm;
+    double stall_at;    // Seized from this simulated time on, 0 never
+    double stall_until; // Turns freely again from here, 0 never
+};
+
+// The second fan has aged a little, so the same duty cycle gives them different speeds
+static struct sim_fan sim_fans[FAN_COUNT] = { { 1.0, 0, 0, 0 }, { 0.93, 0, 0, 0 } };
+const static double sim_fan_rpm_max = 1500;
+// Below this duty the motor does not turn, depending on the PWM base clock
+const static int sim_fan_start_pwm[8] = { 60, 52, 44, 38, 32, 26, 30, 36 };
+
+struct sim_thermal sim_model(const struct sensor *s)
+{
+    if (s->kind == SENSOR_CPU) return (struct sim_thermal){ 12.0, 150.0, 0.3, 0.9 };
+
+    // Bays further from the fans get a little warmer
+    return (struct sim_thermal){ 6.0 + 0.2 * (s - sensors), 600.0, 0.15, 0.6 };
+}
+
+// Speed a fan settles at for a duty cycle
+double sim_fan_rpm(const struct sim_fan *sf, const struct fan *f)
+{
+    int duty = sim_ec[f->pwm_reg];
+    bool seized = sf->stall_at > 0 && sim_clock >= sf->stall_at && (sf->stall_until <= 0 || sim_clock < sf->stall_until);
+    if (seized || duty < sim_fan_start_pwm[(sim_ec[f->freq_reg] >> 4) & 0x07]) return 0;
+    return sf->gain * sim_fan_rpm_max * (0.2 + 0.8 * duty / pwmmax);
+}
+
+void sim_write_tach(const struct fan *f, double rpm)
+{
+    int count = rpm > 0 ? static_cast<int>(1350000 / (2 * rpm)) : 0xffff;
+    if (count > 0xffff) count = 0xffff;
+    sim_ec[f->tach_lsb] = count & 0xff;
+    sim_ec[f->tach_msb] = count >> 8;
+}
+
+// Fraction of full airflow delivered by the fans
+double sim_airflow()
+{
+    double rpm = 0;
+    for (int i = 0; i < FAN_COUNT; ++i) rpm += sim_fans[i].rpm;
+    return rpm / FAN_COUNT / sim_fan_rpm_max;
+}
+
+void sim_init()
+{
+    for (int i = 0; i < FAN_COUNT; ++i) {
+        sim_ec[fans[i].pwm_reg] = pwminit;
+        sim_fans[i].rpm = sim_fan_rpm(&sim_fans[i], &fans[i]);
+        sim_write_tach(&fans[i], sim_fans[i].rpm);
+    }
+
+    // Start every sensor at its steady state for the initial PWM
+    for (int i = 0; i < sensor_count; ++i) {
+        struct sim_thermal m = sim_model(&sensors[i]);
+        sim_temps[i] = sim_peak[i] = sim_ambient + m.watts / (m.g_still + m.g_fan * sim_airflow());
+    }
+}
+
+void sim_advance(double seconds)
+{
+    const double step = 1.0;
+    const double fan_tau = 1.0; // Seconds for a fan to get most of the way to a new speed
+
+    for (double t = 0; t < seconds; t += step) {
+        double dt = seconds - t < step ? seconds - t : step;
+        double job = precool_job_running(sim_clock) ? sim_job_watts : 0;
+
+        for (int i = 0; i < FAN_COUNT; ++i) {
+            struct sim_fan *sf = &sim_fans[i];
+            double f = dt / fan_tau > 1 ? 1 : dt / fan_tau;
+            sf->rpm += f * (sim_fan_rpm(sf, &fans[i]) - sf->rpm);
+            sim_write_tach(&fans[i], sf->rpm);
+        }
+
+        for (int i = 0; i < sensor_count; ++i) {
+            struct sim_thermal m = sim_model(&sensors[i]);
+            double g = m.g_still + m.g_fan * sim_airflow();
+            double heat = m.watts + (sensors[i].kind == SENSOR_CPU ? 2 * job : job);
+
+            sim_temps[i] += dt * (heat - g * (sim_temps[i] - sim_ambient)) / m.capacity;
+            if (sim_temps[i] > sim_peak[i]) sim_peak[i] = sim_temps[i];
+        }
+
+        // A suspend cools everything down to the room and resets the EC to automatic mode
+        if (sim_suspend_at > 0 && sim_clock < sim_suspend_at && sim_clock + dt >= sim_suspend_at) {
+            for (int i = 0; i < sensor_count; ++i) sim_temps[i] = sim_ambient;
+            for (int i = 0; i < FAN_COUNT; ++i) sim_ec[fans[i].pwm_reg] = 0;
+            sim_ec[0x16] = sim_ec[0x17] = 0x80;
+        }
+
+        sim_pwm_sum += dt * sim_ec[fans[0].pwm_reg];
+        sim_beat_sum += dt * fan_beat_hz(sim_fans[0].rpm, sim_fans[1].rpm);
+        sim_clock += dt;
+    }
+
+    if (sim_ec[fans[0].pwm_reg] > sim_pwm_max) sim_pwm_max = sim_ec[fans[0].pwm_reg];
+}
+
+// Parse "<fan>:<seconds>[:<seconds>]"
+int parse_sim_stall(const char *spec)
+{
+    const char *colon = strchr(spec, ':');
+    for (int i = 0; colon && i < FAN_COUNT; ++i) {
+        if (strncmp(spec, fans[i].name, colon - spec) != 0 || fans[i].name[colon - spec] != '\0') continue;
+        if (sscanf(colon + 1, "%lf:%lf", &sim_fans[i].stall_at, &sim_fans[i].stall_until) >= 1) return 0;
+    }
+
+    printf("Invalid sim_stall '%s'. Expected <fan>:<seconds>[:<seconds>]\n", spec);
+    return -1;
+}
+
+int parse_sim_fail(const char *spec)
+{
+    char name[sizeof(sensors[0].name)];
+    const char *colon = strchr(spec, ':');
+    if (colon) {
+        snprintf(name, sizeof(name), "%.*s", static_cast<int>(colon - spec), spec);
+        struct sensor *s = find_sensor(name);
+        int i = s ? static_cast<int>(s - sensors) : 0;
+        if (s && sscanf(colon + 1, "%lf:%lf", &sim_fail_at[i], &sim_fail_until[i]) >= 1) return 0;
+    }
+
+    printf("Invalid sim_fail '%s'. Expected <sensor>:<seconds>[:<seconds>]\n", spec);
+    return -1;
+}
+
+bool sim_failing(const struct sensor *s)
+{
+    int i = static_cast<int>(s - sensors);
+    return sim_fail_at[i] > 0 && sim_clock >= sim_fail_at[i] && (sim_fail_until[i] <= 0 || sim_clock < sim_fail_until[i]);
+}
+
+void sim_report()
+{
+    printf("Simulated %.0f seconds\n", sim_clock);
+    for (int i = 0; i < sensor_count; ++i) {
+        printf("  %-10s peak %.1f°C, final %.1f°C\n", sensors[i].name, sim_peak[i], sim_temps[i]);
+    }
+    printf("  pwm        mean %.1f, max %d\n", sim_clock > 0 ? sim_pwm_sum / sim_clock : 0.0, sim_pwm_max);
+    for (int i = 0; i < FAN_COUNT; ++i) {
+        printf("  %-10s %d RPM at PWM %d%s\n", fans[i].name, fans[i].rpm, fans[i].written,
+               fans[i].alarm ? ", alarm raised" : "");
+    }
+    printf("  beat       mean %.2f Hz\n", sim_clock > 0 ? sim_beat_sum / sim_clock : 0.0);
+    printf("  ec writes  %ld, %ld ramp steps without a change\n", ec_writes, ec_writes_saved);
+    printf("  suppressed %ld PWM updates, %ld readings\n", pwm_suppressed, temp_suppressed);
+}
+
+// SMART health. The pages fetched for the temperature also carry the wear and error
+// counters; every --smart_interval seconds they are decoded, sent to Graphite and
+// checked against the --smart_alert limits. Values are -1 when the drive does not
+// report them (SAS drives and the smartctl fallback report none).
+const char *smart_names[SMART_COUNT] = { "reallocated", "pending", "crc_errors", "power_on_hours", "load_cycles", "media_errors" };
+const int smart_ata_ids[SMART_COUNT] = { 5, 197, 199, 9, 193, -1 };
+
+bool smart_due(const struct sensor *drive)
+{
+    return smart_interval > 0 && monotonic_now() >= drive->smart_at;
+}
+
+void ata_smart_health(const uint8_t *page, struct sensor *drive)
+{
+    for (int k = 0; k < SMART_COUNT; ++k) drive->smart[k] = -1;
+
+    for (int i = 0; i < 30; ++i) {
+        const uint8_t *attr = page + 2 + i * 12;
+        if (attr[0] == 0) continue;
+
+        // 48 bit raw value, little endian
+        long raw = 0;
+        for (int b = 5; b >= 0; --b) raw = (raw << 8) | attr[5 + b];
+
+        for (int k = 0; k < SMART_COUNT; ++k) {
+            if (attr[0] != smart_ata_ids[k]) continue;
+            // Some vendors keep minutes in the upper bytes of the power-on hours
+            drive->smart[k] = k == SMART_POWER_ON_HOURS ? raw & 0xffffffff : raw;
+        }
+    }
+
+    drive->smart_at = monotonic_now() + smart_interval;
+    drive->smart_fresh = true;
+}
+
+void nvme_smart_health(const uint8_t *log, struct sensor *drive)
+{
+    for (int k = 0; k < SMART_COUNT; ++k) drive->smart[k] = -1;
+
+    // 128 bit counters, the low 64 bits are plenty
+    long hours = 0, media = 0;
+    for (int b = 7; b >= 0; --b) {
+        hours = (hours << 8) | log[128 + b];
+        media = (media << 8) | log[160 + b];
+    }
+    drive->smart[SMART_POWER_ON_HOURS] = hours;
+    drive->smart[SMART_MEDIA_ERRORS] = media;
+
+    drive->smart_at = monotonic_now() + smart_interval;
+    drive->smart_fresh = true;
+}
+
+// Parse "<attribute>:<limit>,..."
+int parse_smart_alerts(const char *spec)
+{
+    char *list_copy = strdup(spec);
+    char *saveptr = NULL;
+    int ret = 0;
+
+    for (char *entry = strtok_r(list_copy, ",", &saveptr); entry; entry = strtok_r(NULL, ",", &saveptr)) {
+        char *colon = strchr(entry, ':');
+        int k = 0;
+        if (colon) {
+            *colon = '\0';
+            while (k < SMART_COUNT && strcmp(smart_names[k], entry) != 0) ++k;
+        }
+        if (!colon || k == SMART_COUNT) {
+            printf("Error: Invalid SMART alert '%s'\n", entry);
+            ret = -1;
+            break;
+        }
+        smart_limit[k] = atol(colon + 1);
+    }
+
+    free(list_copy);
+    return ret;
+}
+
+// Export freshly decoded attributes and report limits being crossed, once each way
+void smart_report(struct sensor *drive)
+{
+    for (int k = 0; k < SMART_COUNT; ++k) {
+        long value = drive->smart[k];
+        if (value < 0) continue;
+
+        bool alert = smart_limit[k] > 0 && value >= smart_limit[k];
+        unsigned bit = 1u << k;
+        char subject[112], message[160];
+        snprintf(subject, sizeof(subject), "%s/%s", drive->name, smart_names[k]);
+        snprintf(message, sizeof(message), "Drive /dev/%s has %s at %ld", drive->dev, smart_names[k], value);
+        hook_raise(HOOK_SMART, subject, alert, value, smart_limit[k], message);
+        if (alert && !(drive->smart_alerts & bit)) {
+            printf("Warning: Drive %s (/dev/%s) has %s at %ld (limit %ld)\n",
+                   drive->name, drive->dev, smart_names[k], value, smart_limit[k]);
+            drive->smart_alerts |= bit;
+        } else if (!alert && (drive->smart_alerts & bit)) {
+            printf("Drive %s %s is back at %ld\n", drive->name, smart_names[k], value);
+            drive->smart_alerts &= ~bit;
+        }
+
+        if (debug) printf("SMART: %s %s = %ld\n", drive->name, smart_names[k], value);
+
+        if (graphite_server) {
+            char message[256];
+
+            snprintf(message, sizeof(message), "fancontrol.%.*s.smart.%s %ld %ld\n", SENSOR_NAME_MAX, drive->name, smart_names[k], value, time(NULL));
+            send_to_graphite(message);
+        }
+    }
+
+    if (graphite_server) {
+        char message[256];
+
+        snprintf(message, sizeof(message), "fancontrol.%.*s.smart.alert %d %ld\n", SENSOR_NAME_MAX, drive->name, drive->smart_alerts ? 1 : 0, time(NULL));
+        send_to_graphite(message);
+    }
+
+    drive->smart_fresh = false;
+}
+
+// Probe latency. How long a drive takes to answer its temperature probe is kept in a
+// histogram of power-of-two buckets from 64 µs up, and in a slow moving average that
+// serves as the drive's baseline. A probe counts as an outlier when it takes more than
+// --latency_factor times the drive's own baseline, or times the median baseline of the
+// other drives, and more than 5 ms in any case, so that fast drives do not flap.
+#define LATENCY_MIN_MS 5.0
+
+double latency_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+void record_latency(struct sensor *drive, double seconds)
+{
+    double ms = seconds * 1000;
+    int bucket = 0;
+    for (double limit = 0.064; ms >= limit && bucket < LATENCY_BUCKETS - 1; limit *= 2) ++bucket;
+
+    drive->latency_hist[bucket]++;
+    drive->latency_ms = ms;
+}
+
+// Upper bound of the bucket holding the given fraction of the samples, in ms
+double latency_percentile(const struct sensor *drive, double fraction)
+{
+    unsigned long total = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; ++b) total += drive->latency_hist[b];
+    if (total == 0) return 0;
+
+    unsigned long seen = 0;
+    double limit = 0.064;
+    for (int b = 0; b < LATENCY_BUCKETS - 1; ++b, limit *= 2) {
+        seen += drive->latency_hist[b];
+        if (seen >= fraction * total) return limit;
+    }
+    return limit;
+}
+
+// Median of the other drives' baselines, 0 when fewer than two have one
+double sibling_latency(const struct sensor *drive)
+{
+    double others[MAX_SENSORS];
+    int n = 0;
+
+    for (int i = 0; i < sensor_count; ++i) {
+        const struct sensor *s = &sensors[i];
+        if (s == drive || s->kind != SENSOR_DRIVE || !s->present || s->latency_baseline <= 0) continue;
+
+        // Insertion sort, there are only a handful
+        int j = n++;
+        for (; j > 0 && others[j - 1] > s->latency_baseline; --j) others[j] = others[j - 1];
+        others[j] = s->latency_baseline;
+    }
+
+    if (n < 2) return 0;
+    return n % 2 ? others[n / 2] : (others[n / 2 - 1] + others[n / 2]) / 2;
+}
+
+// Compare the probes of this cycle against the baselines, then fold them into those
+void check_latency_outliers()
+{
+    for (int i = 0; i < sensor_count; ++i) {
+        struct sensor *drive = &sensors[i];
+        if (drive->kind != SENSOR_DRIVE || !drive->present || drive->latency_ms <= 0) continue;
+
+        double siblings = sibling_latency(drive);
+        double ms = drive->latency_ms;
+        bool slow_self = drive->latency_baseline > 0 && ms > latency_factor * drive->latency_baseline;
+        bool slow_siblings = siblings > 0 && ms > latency_factor * siblings;
+        bool outlier = ms > LATENCY_MIN_MS && (slow_self || slow_siblings);
+
+        if (outlier && !drive->latency_outlier) {
+            printf("Warning: Drive %s (/dev/%s) took %.1f ms to answer (own baseline %.1f ms, other drives %.1f ms)\n",
+                   drive->name, drive->dev, ms, drive->latency_baseline, siblings);
+        }
+        drive->latency_outlier = outlier;
+
+        // Outliers stay out of the baseline so that a struggling drive keeps standing out
+        if (drive->latency_baseline <= 0) drive->latency_baseline = ms;
+        else if (!outlier) drive->latency_baseline += 0.05 * (ms - drive->latency_baseline);
+
+        if (debug) printf("Latency: %s %.2f ms, baseline %.2f ms, p99 %.2f ms%s\n", drive->name, ms,
+                          drive->latency_baseline, latency_percentile(drive, 0.99), outlier ? ", outlier" : "");
+
+        if (graphite_server) {
+            char message[256];
+
+            snprintf(message, sizeof(message), "fancontrol.%.*s.latency_ms %.3f %ld\n", SENSOR_NAME_MAX, drive->name, ms, time(NULL));
+            send_to_graphite(message);
+            snprintf(message, sizeof(message), "fancontrol.%.*s.latency_p50 %.3f %ld\n", SENSOR_NAME_MAX, drive->name, latency_percentile(drive, 0.5), time(NULL));
+            send_to_graphite(message);
+            snprintf(message, sizeof(message), "fancontrol.%.*s.latency_p99 %.3f %ld\n", SENSOR_NAME_MAX, drive->name, latency_percentile(drive, 0.99), time(NULL));
+            send_to_graphite(message);
+            snprintf(message, sizeof(message), "fancontrol.%.*s.latency_outlier %d %ld\n", SENSOR_NAME_MAX, drive->name, outlier ? 1 : 0, time(NULL));
+            send_to_graphite(message);
+        }
+
+        drive->latency_ms = 0;
+    }
+}
+
+// Native drive probes. The transport of every drive is detected once and cached in its
+// sensor, then temperatures are read with a single ioctl instead of running smartctl:
+//   ata   libata disks, SMART READ DATA through HDIO_DRIVE_CMD
+//   sat   SATA disks behind a SAS HBA or USB bridge, SMART READ DATA in ATA PASS-THROUGH(16)
+//   scsi  SAS disks, LOG SENSE of the temperature page (0x0D)
+//   nvme  SMART / health log page through the NVMe admin ioctl
+// Drives that cannot be opened (e.g. no permission) fall back to smartctl.
+const char *drive_type_names[] = { "unknown", "smartctl", "ata", "sat", "scsi", "nvme" };
+
+// Issue a SCSI command through SG_IO. Returns the SCSI status (0 good, 2 check
+// condition) or -1 when the command did not reach the device.
+int sg_command(int fd, const uint8_t *cdb, int cdblen, uint8_t *buf, int buflen, uint8_t *sense, int senselen)
+{
+    sg_io_hdr_t io;
+    memset(&io, 0, sizeof(io));
+    io.interface_id = 'S';
+    io.cmd_len = cdblen;
+    io.cmdp = const_cast<uint8_t *>(cdb);
+    io.dxfer_direction = buflen > 0 ? SG_DXFER_FROM_DEV : SG_DXFER_NONE;
+    io.dxferp = buf;
+    io.dxfer_len = buflen;
+    io.sbp = sense;
+    io.mx_sb_len = senselen;
+    io.timeout = 5000; // ms
+
+    if (ioctl(fd, SG_IO, &io) < 0) return -1;
+    if (io.host_status != 0 || (io.driver_status & 0x07) != 0) return -1;
+    return io.status;
+}
+
+// ATA CHECK POWER MODE through HDIO or SAT, so that sleeping disks are left alone.
+// Returns false only when the disk reports standby.
+bool ata_awake(int fd, int type)
+{
+    int count = 0xff;
+
+    if (type == DRIVE_ATA) {
+        uint8_t args[4] = { 0xe5, 0, 0, 0 };
+        if (ioctl(fd, HDIO_DRIVE_CMD, args) == 0) count = args[2];
+    } else {
+        // Non-data protocol with CK_COND set, the count register comes back in the
+        // ATA status return descriptor of the sense data
+        uint8_t cdb[16] = { 0x85, 3 << 1, 0x20, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xe5, 0 };
+        uint8_t sense[32];
+        memset(sense, 0, sizeof(sense));
+        if (sg_command(fd, cdb, sizeof(cdb), NULL, 0, sense, sizeof(sense)) >= 0 &&
+            sense[0] == 0x72 && sense[8] == 0x09) {
+            count = sense[8 + 5];
+        }
+    }
+
+    return count != 0x00 && count != 0x01;
+}
+
+// Read the 512 byte SMART data page of an ATA disk
+bool ata_smart_read(int fd, int type, uint8_t *page)
+{
+    if (type == DRIVE_ATA) {
+        uint8_t args[4 + 512];
+        memset(args, 0, sizeof(args));
+        args[0] = 0xb0; // SMART
+        args[2] = 0xd0; // READ DATA
+        args[3] = 1;
+        if (ioctl(fd, HDIO_DRIVE_CMD, args) != 0) return false;
+        memcpy(page, args + 4, 512);
+        return true;
+    }
+
+    // PIO data-in, transfer length in the count field, in blocks, from the device
+    uint8_t cdb[16] = { 0x85, 4 << 1, 0x0e, 0, 0xd0, 0, 1, 0, 0, 0, 0x4f, 0, 0xc2, 0, 0xb0, 0 };
+    uint8_t sense[32];
+    return sg_command(fd, cdb, sizeof(cdb), page, 512, sense, sizeof(sense)) == 0;
+}
+
+// Temperature from the SMART attribute table: 194, or 190 on disks without it
+int ata_smart_temp(const uint8_t *page)
+{
+    int airflow = 0;
+    for (int i = 0; i < 30; ++i) {
+        const uint8_t *attr = page + 2 + i * 12;
+        if (attr[0] == 194) return attr[5];
+        if (attr[0] == 190) airflow = attr[5];
+    }
+    return airflow;
+}
+
+int scsi_read_temp(int fd)
+{
+    // LOG SENSE, current cumulative values of the temperature page
+    uint8_t buf[64];
+    uint8_t cdb[10] = { 0x4d, 0, 0x40 | 0x0d, 0, 0, 0, 0, 0, sizeof(buf), 0 };
+    uint8_t sense[32];
+    memset(buf, 0, sizeof(buf));
+    if (sg_command(fd, cdb, sizeof(cdb), buf, sizeof(buf), sense, sizeof(sense)) != 0) return -1;
+    if ((buf[0] & 0x3f) != 0x0d) return -1;
+
+    int end = 4 + ((buf[2] << 8) | buf[3]);
+    if (end > static_cast<int>(sizeof(buf))) end = sizeof(buf);
+
+    for (int p = 4; p + 4 <= end; p += 4 + buf[p + 3]) {
+        int code = (buf[p] << 8) | buf[p + 1];
+        // Parameter 0 is the current temperature, 0xff when the sensor is unavailable
+        if (code == 0 && buf[p + 3] >= 2 && p + 6 <= end) return buf[p + 5] == 0xff ? 0 : buf[p + 5];
+    }
+    return -1;
+}
+
+int nvme_read_temp(int fd, uint8_t *log)
+{
+    struct nvme_admin_cmd cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = 0x02; // Get Log Page
+    cmd.nsid = 0xffffffff;
+    cmd.addr = reinterpret_cast<uintptr_t>(log);
+    cmd.data_len = 512;
+    cmd.cdw10 = ((512 / 4 - 1) << 16) | 0x02; // SMART / Health Information
+
+    if (ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd) != 0) return -1;
+
+    // Composite temperature in Kelvin
+    int kelvin = log[1] | (log[2] << 8);
+    return kelvin > 0 ? kelvin - 273 : 0;
+}
+
+int open_drive(const struct sensor *drive)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/dev/%s", drive->dev);
+    return open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+}
+
+// Work out how to talk to a drive
+int detect_drive_type(const struct sensor *drive)
+{
+    int fd = open_drive(drive);
+    if (fd < 0) return DRIVE_SMARTCTL;
+
+    int type = DRIVE_SMARTCTL;
+    if (strncmp(drive->dev, "nvme", 4) == 0) {
+        uint8_t log[512];
+        if (nvme_read_temp(fd, log) >= 0) type = DRIVE_NVME;
+    } else {
+        uint8_t inquiry[36];
+        uint8_t cdb[6] = { 0x12, 0, 0, 0, sizeof(inquiry), 0 };
+        uint8_t sense[32];
+        memset(inquiry, 0, sizeof(inquiry));
+
+        if (sg_command(fd, cdb, sizeof(cdb), inquiry, sizeof(inquiry), sense, sizeof(sense)) == 0) {
+            uint8_t args[4] = { 0xe5, 0, 0, 0 };
+            uint8_t vpd[64];
+            uint8_t vpd_cdb[6] = { 0x12, 1, 0x89, 0, sizeof(vpd), 0 }; // ATA Information VPD page
+            memset(vpd, 0, sizeof(vpd));
+
+            if (memcmp(inquiry + 8, "ATA     ", 8) == 0) {
+                // libata answers HDIO ioctls, SATA disks on a SAS HBA only speak SAT
+                type = ioctl(fd, HDIO_DRIVE_CMD, args) == 0 ? DRIVE_ATA : DRIVE_SAT;
+            } else if (sg_command(fd, vpd_cdb, sizeof(vpd_cdb), vpd, sizeof(vpd), sense, sizeof(sense)) == 0 && vpd[1] == 0x89) {
+                type = DRIVE_SAT;
+            } else {
+                type = DRIVE_SCSI;
+            }
+        }
+    }
+
+    close(fd);
+    return type;
+}
+
+// Returns the drive temperature, 0 when it cannot be read (e.g. the drive is in
+// standby), or -1 when the probe could not be started
+int read_drive_temp(struct sensor *drive)
+{
+    if (simulate) return sim_failing(drive) ? -1 : static_cast<int>(sim_temps[drive - sensors] + 0.5);
+
+    if (drive->type == DRIVE_UNKNOWN) {
+        drive->type = detect_drive_type(drive);
+        printf("Drive /dev/%s (%s) is probed as %s\n", drive->dev, drive->name, drive_type_names[drive->type]);
+    }
+
+    if (drive->type != DRIVE_SMARTCTL) {
+        int fd = open_drive(drive);
+        if (fd < 0) return -1;
+
+        int temp = -1;
+        uint8_t page[512];
+        switch (drive->type) {
+        case DRIVE_ATA:
+        case DRIVE_SAT:
+            if (!ata_awake(fd, drive->type)) temp = 0;
+            else if (ata_smart_read(fd, drive->type, page)) {
+                temp = ata_smart_temp(page);
+                if (smart_due(drive)) ata_smart_health(page, drive);
+            }
+            break;
+        case DRIVE_SCSI:
+            temp = scsi_read_temp(fd);
+            break;
+        case DRIVE_NVME:
+            temp = nvme_read_temp(fd, page);
+            if (temp >= 0 && smart_due(drive)) nvme_smart_health(page, drive);
+            break;
+        }
+
+        close(fd);
+        return temp;
+    }
+
+    char smartcmd[200];
+    char tempstring[20];
+
+    snprintf(smartcmd, sizeof(smartcmd), "smartctl -n standby -A -d sat /dev/%s | grep Temperature_Celsius | awk '{print $10}'", drive->dev);
+
+    FILE *pipe = popen(smartcmd, "r");
+    if (!pipe)
+    {
+        return -1;
+    }
+
+    // This can fail when drives are in standby mode. In this case we will report 0 temperature.
+    int temp = fgets(tempstring, sizeof(tempstring), pipe) ? atoi(tempstring) : 0;
+    pclose(pipe);
+    return temp;
+}
+
+// Returns the CPU package temperature or -1 when it cannot be read
+int read_cpu_temp(const struct sensor *cpu)
+{
+    if (simulate) return static_cast<int>(sim_temps[cpu - sensors] + 0.5);
+
+    FILE *cpupipe = popen("sensors | grep -i 'Package id' | awk -F'[+.°]' '{print $2}'", "r");
+    if (!cpupipe) return -1;
+
+    char cputempstring[10];
+    char *line = fgets(cputempstring, sizeof(cputempstring), cpupipe);
+    pclose(cpupipe);
+    return line ? atoi(cputempstring) : -1;
+}
+
+// Circuit breakers. A sensor whose probe fails (or takes longer than --breaker_slow
+// seconds) is degraded and keeps its last reading. After --breaker_trips failures in a
+// row the breaker opens: the sensor is no longer probed every cycle but retried after
+// a backoff that starts at the poll interval and doubles up to --breaker_backoff
+// seconds. While open the sensor reads as its last good temperature plus
+// --breaker_margin, and the PWM does not go below --breaker_pwm.
+const char *breaker_names[] = { "ok", "degraded", "open" };
+
+bool breaker_allows(const struct sensor *s)
+{
+    return s->breaker != BREAKER_OPEN || monotonic_now() >= s->retry_at;
+}
+
+void breaker_success(struct sensor *s, int temp)
+{
+    if (s->breaker != BREAKER_OK) printf("Sensor %s recovered\n", s->name);
+    if (s->breaker == BREAKER_OPEN) hook_raise(HOOK_SENSOR, s->name, false, 0, breaker_trips, "Sensor recovered");
+    s->breaker = BREAKER_OK;
+    s->failures = 0;
+    s->backoff = 0;
+    if (temp > 0) s->last_good = temp;
+    s->read_at = wall_now();
+}
+
+void breaker_failure(struct sensor *s)
+{
+    ++s->failures;
+
+    if (s->breaker == BREAKER_OPEN) {
+        s->backoff = s->backoff * 2 < breaker_backoff ? s->backoff * 2 : breaker_backoff;
+    } else if (s->failures >= breaker_trips) {
+        printf("Warning: Sensor %s failed %d times, probing it every %d seconds at most\n", s->name, s->failures, interval);
+        s->breaker = BREAKER_OPEN;
+        hook_raise(HOOK_SENSOR, s->name, true, s->failures, breaker_trips, "Sensor probes keep failing");
+        s->backoff = interval;
+    } else {
+        s->breaker = BREAKER_DEGRADED;
+    }
+
+    if (s->breaker == BREAKER_OPEN) {
+        s->retry_at = monotonic_now() + s->backoff;
+        // Assume it is running warmer than when it was last seen
+        if (s->last_good > 0) s->temp = s->last_good + breaker_margin;
+        if (debug) printf("Sensor %s breaker open, retry in %.0f seconds\n", s->name, s->backoff);
+    }
+}
+
+bool breakers_open()
+{
+    for (int i = 0; i < sensor_count; ++i) {
+        if (sensors[i].present && sensors[i].breaker == BREAKER_OPEN) return true;
+    }
+    return false;
+}
+
+void report_breakers()
+{
+    if (!graphite_server) return;
+
+    for (int i = 0; i < sensor_count; ++i) {
+        char message[256];
+
+        snprintf(message, sizeof(message), "fancontrol.%.*s.breaker %d %ld\n", SENSOR_NAME_MAX, sensors[i].name, sensors[i].breaker, time(NULL));
+        send_to_graphite(message);
+    }
+}
+
+// Array maintenance. md resyncs, rebuilds and checks keep every member drive busy for
+// hours, and so do scrubs and resilvers of ZFS pools. /proc/mdstat and the txgs kstat
+// of each pool are re-read every --array_interval seconds through descriptors that
+// stay open. The kstats do not tell a scrub from any other heavy reading, so a pool
+// only counts as read-busy, without progress. While maintenance runs the setpoint is
+// lowered by --maint_delta, the PWM is kept at --maint_pwm or above, and expressions
+// see maint = 1.
+struct array_activity {
+    char name[32];      // md device or ZFS pool
+    char action[16];    // resync, recovery, check, reshape, repair, read-busy, or idle
+    double progress;    // Percent, -1 when unknown
+    double mbps;        // MB/s read by the maintenance
+    bool active;
+    bool pool;          // ZFS pool, judged by its reads alone
+};
+
+#define MAX_ARRAYS 16
+#define MAX_POOLS 8
+static struct array_activity arrays[MAX_ARRAYS];
+static int array_count = 0;
+static bool maint_active = false;
+static double array_scan_at = 0;
+static int mdstat_fd = -1;
+
+struct zfs_pool {
+    char name[32];
+    int txgs_fd;
+    unsigned long last_txg;  // Newest committed txg counted so far
+    double last_scan;
+};
+static struct zfs_pool pools[MAX_POOLS];
+static int pool_count = 0;
+
+// Reads a whole kstat or proc file through a descriptor that stays open
+ssize_t read_proc_fd(int fd, char *buf, size_t len)
+{
+    ssize_t n = pread(fd, buf, len - 1, 0);
+    buf[n > 0 ? n : 0] = '\0';
+    return n;
+}
+
+// Parse /proc/mdstat into the arrays table, returns the number of arrays
+int parse_mdstat(const char *text)
+{
+    static const char *actions[] = { "resync", "recovery", "check", "reshape", "repair" };
+    struct array_activity *a = NULL;
+    int count = 0;
+
+    for (const char *line = text; line && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL) {
+        char name[32];
+        if (strncmp(line, "md", 2) == 0 && sscanf(line, "%31s :", name) == 1 && count < MAX_ARRAYS) {
+            a = &arrays[count++];
+            memset(a, 0, sizeof(*a));
+            snprintf(a->name, sizeof(a->name), "%s", name);
+            snprintf(a->action, sizeof(a->action), "idle");
+            a->progress = -1;
+            continue;
+        }
+        if (!a || (line[0] != ' ' && line[0] != '\t')) continue;
+
+        // "      [=>...]  resync =  8.5% (166034560/1953382464) finish=151.2min speed=196888K/sec"
+        for (size_t i = 0; i < sizeof(actions) / sizeof(actions[0]); ++i) {
+            const char *p = strstr(line, actions[i]);
+            const char *eol = strchr(line, '\n');
+            if (!p || (eol && p > eol)) continue;
+
+            p += strlen(actions[i]);
+            while (*p == ' ') ++p;
+            double progress;
+            // resync=DELAYED and resync=PENDING are waiting, not running
+            if (*p != '=' || sscanf(p + 1, " %lf%%", &progress) != 1) continue;
+
+            snprintf(a->action, sizeof(a->action), "%s", actions[i]);
+            a->progress = progress;
+            a->active = true;
+
+            const char *speed = strstr(p, "speed=");
+            if (speed && (!eol || speed < eol)) a->mbps = atof(speed + 6) / 1024;
+            break;
+        }
+    }
+
+    return count;
+}
+
+// Parse a txgs kstat and return the bytes read by transaction groups committed since
+// the last call. Scrub and resilver reads are issued by the syncing txg.
+unsigned long parse_zfs_txgs(const char *text, unsigned long *last_txg)
+{
+    unsigned long total = 0, newest = *last_txg;
+
+    for (const char *line = text; line && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL) {
+        unsigned long txg, birth, ndirty, nread;
+        char state;
+        // txg birth state ndirty nread nwritten reads writes otime qtime wtime stime
+        if (sscanf(line, "%lu %lu %c %lu %lu", &txg, &birth, &state, &ndirty, &nread) != 5) continue;
+        if (state != 'C' || txg <= *last_txg) continue;
+
+        // The first pass only finds out where the history stands
+        if (*last_txg > 0) total += nread;
+        if (txg > newest) newest = txg;
+    }
+
+    *last_txg = newest;
+    return total;
+}
+
+// Fill in a pool that read bytes in elapsed seconds. It is read-busy from
+// --zfs_busy_mbps on.
+void zfs_pool_activity(struct array_activity *a, const char *name, unsigned long bytes, double elapsed)
+{
+    memset(a, 0, sizeof(*a));
+    snprintf(a->name, sizeof(a->name), "%.*s", static_cast<int>(sizeof(a->name)) - 1, name);
+    a->pool = true;
+    a->progress = -1;
+    a->mbps = bytes > 0 && elapsed > 0 ? bytes / elapsed / 1000000 : 0;
+    a->active = zfs_busy_mbps > 0 && a->mbps >= zfs_busy_mbps;
+    snprintf(a->action, sizeof(a->action), "%s", a->active ? "read-busy" : "idle");
+}
+
+void scan_zfs_pools(double now)
+{
+    DIR *dir = opendir(zfs_kstat_dir);
+    if (dir) {
+        struct dirent *de;
+        while ((de = readdir(dir)) != NULL && pool_count < MAX_POOLS) {
+            if (de->d_name[0] == '.' || strlen(de->d_name) >= sizeof(pools[0].name)) continue;
+
+            bool known = false;
+            for (int i = 0; i < pool_count; ++i) known |= strcmp(pools[i].name, de->d_name) == 0;
+            if (known) continue;
+
+            char path[512];
+            snprintf(path, sizeof(path), "%s/%s/txgs", zfs_kstat_dir, de->d_name);
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (fd < 0) continue;
+
+            struct zfs_pool *pool = &pools[pool_count++];
+            memset(pool, 0, sizeof(*pool));
+            snprintf(pool->name, sizeof(pool->name), "%.*s", static_cast<int>(sizeof(pool->name)) - 1, de->d_name);
+            pool->txgs_fd = fd;
+        }
+        closedir(dir);
+    }
+
+    char buf[16384];
+    for (int i = 0; i < pool_count && array_count < MAX_ARRAYS; ++i) {
+        struct zfs_pool *pool = &pools[i];
+        if (read_proc_fd(pool->txgs_fd, buf, sizeof(buf)) < 0) continue;
+
+        unsigned long bytes = parse_zfs_txgs(buf, &pool->last_txg);
+        zfs_pool_activity(&arrays[array_count++], pool->name, bytes, now - pool->last_scan);
+        pool->last_scan = now;
+    }
+}
+
+void scan_arrays(double now)
+{
+    char buf[16384];
+    array_count = 0;
+
+    if (mdstat_fd < 0) mdstat_fd = open(mdstat_path, O_RDONLY | O_CLOEXEC);
+    if (mdstat_fd >= 0 && read_proc_fd(mdstat_fd, buf, sizeof(buf)) >= 0) array_count = parse_mdstat(buf);
+
+    scan_zfs_pools(now);
+
+    bool active = false;
+    for (int i = 0; i < array_count; ++i) {
+        struct array_activity *a = &arrays[i];
+        active |= a->active;
+
+        if (debug) {
+            if (a->progress >= 0) printf("Array %s: %s, progress %.1f%%, %.1f MB/s\n", a->name, a->action, a->progress, a->mbps);
+            else printf("%s %s: %s, %.1f MB/s\n", a->pool ? "Pool" : "Array", a->name, a->action, a->mbps);
+        }
+
+        if (graphite_server) {
+            char message[256];
+            int name_len = static_cast<int>(sizeof(a->name)) - 1;
+
+            if (a->pool) {
+                snprintf(message, sizeof(message), "fancontrol.pool.%.*s.read_busy %d %ld\n", name_len, a->name, a->active ? 1 : 0, time(NULL));
+                send_to_graphite(message);
+                snprintf(message, sizeof(message), "fancontrol.pool.%.*s.read_mbps %.1f %ld\n", name_len, a->name, a->mbps, time(NULL));
+                send_to_graphite(message);
+                continue;
+            }
+
+            snprintf(message, sizeof(message), "fancontrol.array.%.*s.active %d %ld\n", name_len, a->name, a->active ? 1 : 0, time(NULL));
+            send_to_graphite(message);
+            snprintf(message, sizeof(message), "fancontrol.array.%.*s.mbps %.1f %ld\n", name_len, a->name, a->mbps, time(NULL));
+            send_to_graphite(message);
+            if (a->progress >= 0) {
+                snprintf(message, sizeof(message), "fancontrol.array.%.*s.progress %.1f %ld\n", name_len, a->name, a->progress, time(NULL));
+                send_to_graphite(message);
+            }
+        }
+    }
+
+    if (active != maint_active) {
+        printf(active ? "Array maintenance started, cooling ahead of it\n" : "Array maintenance finished\n");
+        maint_active = active;
+    }
+
+    if (graphite_server) {
+        char message[256];
+
+        snprintf(message, sizeof(message), "fancontrol.maintenance %d %ld\n", maint_active ? 1 : 0, time(NULL));
+        send_to_graphite(message);
+    }
+
+    array_scan_at = now + array_interval;
+}
+
+// Reads a capture of the array check into buf
+int read_capture(const char *dir, const char *name, char *buf, size_t len)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        printf("Error: Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    ssize_t n = read_proc_fd(fd, buf, len);
+    close(fd);
+    return n < 0 ? -1 : 0;
+}
+
+bool array_expect(const struct array_activity *a, const char *name, const char *action, double progress, double mbps)
+{
+    double dp = a->progress - progress, dm = a->mbps - mbps;
+    bool ok = strcmp(a->name, name) == 0 && strcmp(a->action, action) == 0 &&
+              dp > -0.05 && dp < 0.05 && dm > -0.05 && dm < 0.05 &&
+              a->active == (strcmp(action, "idle") != 0);
+    printf("%-4s %s: %s, progress %.1f, %.1f MB/s\n", ok ? "ok" : "FAIL", a->name, a->action, a->progress, a->mbps);
+    return ok;
+}
+
+// Runs the parsers on the captures in dir (fixtures/array in the source tree): an
+// mdstat with a check running next to a delayed resync, and the txgs of a scrubbing
+// pool read 60 seconds apart. Returns 0 when everything parsed as expected.
+int array_selfcheck(const char *dir)
+{
+    char buf[16384];
+    bool ok = true;
+
+    if (read_capture(dir, "mdstat", buf, sizeof(buf)) < 0) return 1;
+    int count = parse_mdstat(buf);
+    ok &= count == 3;
+    if (count == 3) {
+        ok &= array_expect(&arrays[0], "md2", "check", 27.4, 198832 / 1024.0);
+        ok &= array_expect(&arrays[1], "md1", "idle", -1, 0); // resync=DELAYED
+        ok &= array_expect(&arrays[2], "md0", "idle", -1, 0);
+    }
+
+    // The first read only finds the newest committed txg, 102
+    unsigned long last_txg = 0, bytes;
+    struct array_activity pool;
+    if (read_capture(dir, "txgs.before", buf, sizeof(buf)) < 0) return 1;
+    bytes = parse_zfs_txgs(buf, &last_txg);
+    ok &= bytes == 0 && last_txg == 102;
+
+    // txgs 103 to 114 committed since, 10877927424 bytes read
+    if (read_capture(dir, "txgs.after", buf, sizeof(buf)) < 0) return 1;
+    bytes = parse_zfs_txgs(buf, &last_txg);
+    ok &= bytes == 10877927424UL && last_txg == 114;
+    zfs_pool_activity(&pool, "tank", bytes, 60);
+    ok &= array_expect(&pool, "tank", "read-busy", -1, 10877927424 / 60.0 / 1000000);
+
+    // Nothing new committed
+    bytes = parse_zfs_txgs(buf, &last_txg);
+    zfs_pool_activity(&pool, "tank", bytes, 60);
+    ok &= array_expect(&pool, "tank", "idle", -1, 0);
+
+    printf(ok ? "Array captures parsed as expected\n" : "Array captures did not parse as expected\n");
+    return ok ? 0 : 1;
+}
+
+// Thermal throttling. Once the fans are no longer enough and the temperature passes
+// overheat, the cgroups given with --throttle (e.g. system.slice/backup.service) get
+// cpu.max and io.max limits. The limits tighten in steps of a tenth as the temperature
+// climbs through --throttle_span degrees above overheat, from --throttle_io_start down
+// to --throttle_io MB/s per drive and down to --throttle_cpu percent of the machine.
+// They are lifted once the temperature is --throttle_hysteresis degrees below
+// overheat again.
+#define MAX_THROTTLED 8
+static const char *throttled[MAX_THROTTLED];
+static int throttled_count = 0;
+static int throttle_step = -1; // Tenths of the full throttle applied, -1 when not throttling
+
+int add_throttle(const char *cgroup)
+{
+    if (throttled_count >= MAX_THROTTLED) {
+        printf("Error: Too many throttled cgroups (max %d)\n", MAX_THROTTLED);
+        return -1;
+    }
+    throttled[throttled_count++] = cgroup;
+    return 0;
+}
+
+bool write_cgroup_file(const char *cgroup, const char *file, const char *text)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s/%s", cgroup_root, cgroup, file);
+
+    int fd = open(path, O_WRONLY | O_TRUNC | O_CLOEXEC);
+    bool ok = fd >= 0 && write(fd, text, strlen(text)) == static_cast<ssize_t>(strlen(text));
+    if (!ok) printf("Error: Could not write '%s' to %s: %s\n", text, path, strerror(errno));
+    if (fd >= 0) close(fd);
+    return ok;
+}
+
+// Limit every throttled cgroup, step 0 to 10, or lift the limits with step -1
+void apply_throttle(int step)
+{
+    long period = 100000; // µs
+    char text[128];
+
+    if (step < 0) snprintf(text, sizeof(text), "max %ld", period);
+    else {
+        double percent = 100 - step * (100 - throttle_cpu) / 10.0;
+        long quota = static_cast<long>(percent / 100 * sysconf(_SC_NPROCESSORS_ONLN) * period);
+        snprintf(text, sizeof(text), "%ld %ld", quota > 1000 ? quota : 1000, period);
+    }
+
+    long bps = static_cast<long>((throttle_io_start - step * (throttle_io_start - throttle_io) / 10.0) * 1000000);
+
+    for (int i = 0; i < throttled_count; ++i) {
+        write_cgroup_file(throttled[i], "cpu.max", text);
+
+        // io.max takes one device per write
+        for (int j = 0; j < sensor_count; ++j) {
+            struct stat st;
+            char path[64], limit[128];
+            if (sensors[j].kind != SENSOR_DRIVE || !sensors[j].present) continue;
+            snprintf(path, sizeof(path), "/dev/%s", sensors[j].dev);
+            if (stat(path, &st) < 0 || !S_ISBLK(st.st_mode)) continue;
+
+            if (step < 0) snprintf(limit, sizeof(limit), "%u:%u rbps=max wbps=max", major(st.st_rdev), minor(st.st_rdev));
+            else snprintf(limit, sizeof(limit), "%u:%u rbps=%ld wbps=%ld", major(st.st_rdev), minor(st.st_rdev), bps, bps);
+            write_cgroup_file(throttled[i], "io.max", limit);
+        }
+    }
+}
+
+void update_throttle(int temp)
+{
+    if (throttled_count == 0) return;
+
+    int step;
+    if (temp > overheat) {
+        double level = (temp - overheat) / static_cast<double>(throttle_span > 0 ? throttle_span : 1);
+        step = level < 1 ? static_cast<int>(level * 10 + 0.5) : 10;
+    } else if (temp > overheat - throttle_hysteresis && throttle_step >= 0) {
+        step = 0; // Mildest limits until the hysteresis band is left
+    } else {
+        step = -1;
+    }
+
+    if (step != throttle_step) {
+        if (step < 0) printf("Temperature %d is back below overheat, lifting throttles\n", temp);
+        else if (throttle_step < 0) printf("Warning: Temperature %d is above overheat %d, throttling workloads\n", temp, overheat);
+        apply_throttle(step);
+        throttle_step = step;
+    }
+
+    if (graphite_server) {
+        char message[256];
+
+        snprintf(message, sizeof(message), "fancontrol.throttle %d %ld\n", throttle_step < 0 ? 0 : throttle_step * 10, time(NULL));
+        send_to_graphite(message);
+    }
+}
+
+// CPU package power through the RAPL powercap zone in --rapl_zone. Energy and power are
+// read every cycle. With --rapl_min set, the long-term power limit becomes a second
+// actuator: while the fans are at their ceiling and the CPU is still above its
+// setpoint, the limit is lowered by --rapl_step watts per cycle, down to --rapl_min.
+// Once the fans have room again, or the CPU is a degree below its setpoint, it is
+// raised back in the same steps to where it was at startup.
+static int rapl_energy_fd = -1;
+static long rapl_energy_range = 0;  // µJ at which energy_uj wraps
+static long rapl_last_energy = -1;  // µJ
+static double rapl_last_time = 0;
+static double rapl_energy_total = 0; // J since startup
+static double rapl_power = 0;        // W over the last cycle
+static long rapl_limit_orig = 0;     // µW, the limit found at startup
+static long rapl_limit = 0;          // µW, the limit currently set
+
+long read_sysfs_long(const char *zone, const char *file)
+{
+    char path[512], buf[32];
+    snprintf(path, sizeof(path), "%s/%s", zone, file);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = read_proc_fd(fd, buf, sizeof(buf));
+    close(fd);
+    return n > 0 ? atol(buf) : -1;
+}
+
+bool write_rapl_limit(long microwatts)
+{
+    char path[512], text[32];
+    snprintf(path, sizeof(path), "%s/constraint_0_power_limit_uw", rapl_zone);
+    snprintf(text, sizeof(text), "%ld", microwatts);
+
+    int fd = open(path, O_WRONLY | O_TRUNC | O_CLOEXEC);
+    bool ok = fd >= 0 && write(fd, text, strlen(text)) == static_cast<ssize_t>(strlen(text));
+    if (!ok) printf("Error: Could not set the CPU power limit in %s: %s\n", path, strerror(errno));
+    if (fd >= 0) close(fd);
+    if (ok) rapl_limit = microwatts;
+    return ok;
+}
+
+void init_rapl()
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/energy_uj", rapl_zone);
+    rapl_energy_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (rapl_energy_fd < 0) {
+        if (rapl_min > 0) printf("Error: No RAPL energy counter in %s, CPU power is not capped\n", rapl_zone);
+        return;
+    }
+
+    rapl_energy_range = read_sysfs_long(rapl_zone, "max_energy_range_uj");
+    rapl_limit_orig = rapl_limit = read_sysfs_long(rapl_zone, "constraint_0_power_limit_uw");
+    if (debug) printf("RAPL zone %s, power limit %.1f W\n", rapl_zone, rapl_limit / 1000000.0);
+}
+
+void update_rapl(double now, const struct sensor *cpu, bool fans_saturated)
+{
+    if (rapl_energy_fd < 0) return;
+
+    char buf[32];
+    if (read_proc_fd(rapl_energy_fd, buf, sizeof(buf)) <= 0) return;
+    long energy = atol(buf);
+
+    if (rapl_last_energy >= 0 && now > rapl_last_time) {
+        long delta = energy - rapl_last_energy;
+        if (delta < 0) delta += rapl_energy_range; // The counter wrapped
+        rapl_energy_total += delta / 1000000.0;
+        rapl_power = delta / 1000000.0 / (now - rapl_last_time);
+    }
+    rapl_last_energy = energy;
+    rapl_last_time = now;
+
+    if (rapl_min > 0 && rapl_limit_orig > 0) {
+        long step = static_cast<long>(rapl_step * 1000000);
+        long floor = static_cast<long>(rapl_min * 1000000);
+        long target = rapl_limit;
+
+        if (fans_saturated && cpu->temp > 0 && cpu->error > 0) target = rapl_limit - step > floor ? rapl_limit - step : floor;
+        else if (!fans_saturated || cpu->error < -1) target = rapl_limit + step < rapl_limit_orig ? rapl_limit + step : rapl_limit_orig;
+
+        if (target != rapl_limit) {
+            if (rapl_limit == rapl_limit_orig) printf("Warning: Fans are at their limit, capping CPU power\n");
+            if (!write_rapl_limit(target)) rapl_min = 0; // Not allowed, stop trying
+            else if (target == rapl_limit_orig) printf("CPU power limit restored\n");
+        }
+    }
+
+    if (debug) printf("CPU power %.1f W, limit %.1f W\n", rapl_power, rapl_limit / 1000000.0);
+
+    if (graphite_server) {
+        char message[256];
+
+        snprintf(message, sizeof(message), "fancontrol.cpu_power %.2f %ld\n", rapl_power, time(NULL));
+        send_to_graphite(message);
+        snprintf(message, sizeof(message), "fancontrol.cpu_energy %.1f %ld\n", rapl_energy_total, time(NULL));
+        send_to_graphite(message);
+        snprintf(message, sizeof(message), "fancontrol.cpu_power_limit %.1f %ld\n", rapl_limit / 1000000.0, time(NULL));
+        send_to_graphite(message);
+    }
+}
+
+// Live state for local consumers (--shm), see fancontrol_shm.h for the layout and a
+// reader. Written once per cycle under a seqlock, readers never block the daemon.
+static struct fancontrol_shm *shm = NULL;
+
+int open_shm(const char *path)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(struct fancontrol_shm)) < 0) {
+        printf("Error: Could not create %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    void *p = mmap(NULL, sizeof(struct fancontrol_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        printf("Error: Could not map %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    shm = static_cast<struct fancontrol_shm *>(p);
+    memset(shm, 0, sizeof(*shm));
+    shm->size = sizeof(*shm);
+    shm->version = FANCONTROL_SHM_VERSION;
+    __atomic_store_n(&shm->magic, FANCONTROL_SHM_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Snapshot of the live state, for shared memory and SNMP alike
+void fill_state(struct fancontrol_shm *state, int pwm, int maxtemp, double error)
+{
+    state->updated = static_cast<double>(wall_now());
+    state->pwm = pwm;
+    state->maxtemp = maxtemp;
+    state->setpoint = setpoint + setpoint_shift;
+    state->error = error;
+    state->p = pid_terms[0];
+    state->i = pid_terms[1];
+    state->d = pid_terms[2];
+    state->cpu_power = rapl_power;
+    state->throttle = throttle_step < 0 ? 0 : throttle_step * 10;
+    state->maintenance = maint_active ? 1 : 0;
+
+    state->fan_count = FAN_COUNT;
+    for (int i = 0; i < FAN_COUNT; ++i) {
+        struct fancontrol_shm_fan *f = &state->fans[i];
+        snprintf(f->name, sizeof(f->name), "%s", fans[i].name);
+        f->pwm = fans[i].written;
+        f->target = fans[i].target;
+        f->rpm = fans[i].rpm;
+        f->state = fans[i].state;
+        f->alarm = fans[i].alarm ? 1 : 0;
+    }
+
+    state->sensor_count = sensor_count < FANCONTROL_SHM_SENSORS ? sensor_count : FANCONTROL_SHM_SENSORS;
+    for (int i = 0; i < state->sensor_count; ++i) {
+        struct fancontrol_shm_sensor *s = &state->sensors[i];
+        snprintf(s->name, sizeof(s->name), "%.*s", SENSOR_NAME_MAX, sensors[i].name);
+        s->kind = sensors[i].kind;
+        s->present = sensors[i].present ? 1 : 0;
+        s->temp = sensors[i].temp;
+        s->setpoint = sensors[i].setpoint;
+        s->error = sensors[i].error;
+        s->breaker = sensors[i].breaker;
+        s->updated = static_cast<double>(sensors[i].read_at);
+    }
+}
+
+void publish_shm(int pwm, int maxtemp, double error)
+{
+    if (!shm) return;
+
+    uint32_t seq = shm->seq;
+    __atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    fill_state(shm, pwm, maxtemp, error);
+
+    __atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void request_stop(int)
+{
+    stop_requested = 1;
+}
+
+// Helper sensors (--helper=<name>:<command>) for values only scripts can get at, e.g.
+// from a UPS or a vendor tool. The command is started once through /bin/sh and kept
+// running. Every cycle the daemon writes "read\n" to its stdin and expects one line
+// with the temperature in °C on its stdout, or "nan" when it has none. A helper that
+// misses the --helper_timeout deadline is killed, one that exits is restarted, at most
+// once per cycle.
+struct helper {
+    struct sensor *sensor;
+    const char *command;
+    pid_t pid;
+    int to_fd;          // Its stdin
+    int from_fd;        // Its stdout
+    char line[128];     // Reply read so far
+    int line_len;
+    long restarts;
+};
+
+#define MAX_HELPERS 8
+static struct helper helpers[MAX_HELPERS];
+static int helper_count = 0;
+
+int add_helper(const char *spec)
+{
+    const char *colon = strchr(spec, ':');
+    if (!colon || colon == spec || !colon[1]) {
+        printf("Error: Invalid helper '%s', expected <name>:<command>\n", spec);
+        return -1;
+    }
+    if (helper_count >= MAX_HELPERS) {
+        printf("Error: Too many helpers (max %d)\n", MAX_HELPERS);
+        return -1;
+    }
+
+    char name[sizeof(sensors[0].name)];
+    snprintf(name, sizeof(name), "%.*s", static_cast<int>(colon - spec), spec);
+
+    struct helper *h = &helpers[helper_count];
+    h->sensor = add_sensor(name, SENSOR_HELPER, setpoint);
+    if (!h->sensor) return -1;
+    h->command = colon + 1;
+    h->pid = -1;
+    h->to_fd = h->from_fd = -1;
+    helper_count++;
+    return 0;
+}
+
+void stop_helper(struct helper *h)
+{
+    if (h->pid > 0) {
+        kill(h->pid, SIGKILL);
+        waitpid(h->pid, NULL, 0);
+    }
+    if (h->to_fd >= 0) close(h->to_fd);
+    if (h->from_fd >= 0) close(h->from_fd);
+    h->pid = -1;
+    h->to_fd = h->from_fd = -1;
+    h->line_len = 0;
+}
+
+int start_helper(struct helper *h)
+{
+    int in[2], out[2];
+    if (pipe2(in, O_CLOEXEC) < 0) return -1;
+    if (pipe2(out, O_CLOEXEC) < 0) {
+        close(in[0]);
+        close(in[1]);
+        return -1;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+
+    char *argv[] = { const_cast<char *>("sh"), const_cast<char *>("-c"), const_cast<char *>(h->command), NULL };
+    int err = posix_spawn(&h->pid, "/bin/sh", &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(in[0]);
+    close(out[1]);
+
+    if (err != 0) {
+        printf("Error: Could not start helper %s: %s\n", h->sensor->name, strerror(err));
+        close(in[1]);
+        close(out[0]);
+        h->pid = -1;
+        return -1;
+    }
+
+    h->to_fd = in[1];
+    h->from_fd = out[0];
+    h->line_len = 0;
+    if (debug) printf("Started helper %s (pid %d)\n", h->sensor->name, h->pid);
+    return 0;
+}
+
+// One request/reply round trip. Returns the temperature, 0 when the helper has no
+// reading, or -1 when it failed (and has been stopped).
+int read_helper_temp(struct helper *h)
+{
+    if (simulate) return static_cast<int>(sim_temps[h->sensor - sensors] + 0.5);
+
+    if (h->pid < 0) {
+        if (start_helper(h) < 0) return -1;
+        if (h->restarts++ > 0) printf("Restarted helper %s\n", h->sensor->name);
+    }
+
+    if (write(h->to_fd, "read\n", 5) != 5) {
+        printf("Error: Helper %s is not accepting requests\n", h->sensor->name);
+        stop_helper(h);
+        return -1;
+    }
+
+    double deadline = monotonic_now() + helper_timeout;
+    for (;;) {
+        char *newline = static_cast<char *>(memchr(h->line, '\n', h->line_len));
+        if (newline) {
+            *newline = '\0';
+            char *end;
+            double value = strtod(h->line, &end);
+            bool valid = end != h->line && !__builtin_isnan(value);
+
+            // Keep anything after the line for the next round
+            int rest = h->line_len - static_cast<int>(newline + 1 - h->line);
+            memmove(h->line, newline + 1, rest);
+            h->line_len = rest;
+            return valid ? static_cast<int>(value + 0.5) : 0;
+        }
+
+        if (h->line_len >= static_cast<int>(sizeof(h->line)) - 1) {
+            printf("Error: Helper %s sent an overlong line\n", h->sensor->name);
+            break;
+        }
+
+        int timeout = static_cast<int>((deadline - monotonic_now()) * 1000);
+        struct pollfd pfd = { h->from_fd, POLLIN, 0 };
+        if (timeout <= 0 || poll(&pfd, 1, timeout) <= 0) {
+            printf("Error: Helper %s missed its deadline\n", h->sensor->name);
+            break;
+        }
+
+        ssize_t n = read(h->from_fd, h->line + h->line_len, sizeof(h->line) - 1 - h->line_len);
+        if (n <= 0) {
+            printf("Error: Helper %s exited\n", h->sensor->name);
+            break;
+        }
+        h->line_len += n;
+    }
+
+    stop_helper(h);
+    return -1;
+}
+
+// Drive discovery for --drive_list=auto. Every SATA/SAS disk (sdX) and NVMe namespace
+// (nvmeXnY) in /sys/block becomes a sensor named after its /dev/disk/by-id link, which
+// carries model and serial number, so names stay the same when kernel names shuffle.
+// --drive_filter restricts discovery to by-id names matching one of its patterns. A
+// netlink uevent socket reports disks coming and going while the daemon runs.
+bool is_disk_name(const char *dev)
+{
+    int a, b;
+    char end;
+    if (strlen(dev) >= sizeof(sensors[0].dev)) return false;
+    if (strncmp(dev, "sd", 2) == 0) return dev[2] >= 'a' && dev[2] <= 'z' && strspn(dev + 2, "abcdefghijklmnopqrstuvwxyz") == strlen(dev + 2);
+    return sscanf(dev, "nvme%dn%d%c", &a, &b, &end) == 2;
+}
+
+// Find the by-id link of a disk, preferring the bus-specific ones over wwn/eui links.
+// Returns false when udev has not created one (yet).
+bool find_disk_id(const char *dev, char *id, size_t idlen)
+{
+    DIR *dir = opendir("/dev/disk/by-id");
+    if (!dir) return false;
+
+    bool found = false;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.' || strstr(de->d_name, "-part")) continue;
+
+        char path[512], target[512];
+        snprintf(path, sizeof(path), "/dev/disk/by-id/%s", de->d_name);
+        ssize_t n = readlink(path, target, sizeof(target) - 1);
+        if (n <= 0) continue;
+        target[n] = '\0';
+
+        const char *base = strrchr(target, '/');
+        if (strcmp(base ? base + 1 : target, dev) != 0) continue;
+
+        bool preferred = strncmp(de->d_name, "wwn-", 4) != 0 && strncmp(de->d_name, "nvme-eui.", 9) != 0;
+        if (!found || preferred) {
+            snprintf(id, idlen, "%s", de->d_name);
+            found = true;
+            if (preferred) break;
+        }
+    }
+
+    closedir(dir);
+    return found;
+}
+
+bool drive_filter_match(const char *id)
+{
+    if (!drive_filter) return true;
+
+    char *list_copy = strdup(drive_filter);
+    char *saveptr = NULL;
+    bool match = false;
+
+    for (char *pattern = strtok_r(list_copy, ",", &saveptr); pattern && !match; pattern = strtok_r(NULL, ",", &saveptr)) {
+        match = fnmatch(pattern, id, 0) == 0;
+    }
+
+    free(list_copy);
+    return match;
+}
+
+// Metric and expression friendly version of a by-id name
+void sensor_name_from_id(const char *id, char *name, size_t namelen)
+{
+    size_t i = 0;
+    for (; id[i] && i < namelen - 1; ++i) {
+        char c = id[i];
+        bool keep = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+        name[i] = keep ? c : '_';
+    }
+    name[i] = '\0';
+}
+
+// Bring the sensor table in line with the disks present now. Sensors of disks that are
+// gone stay in the table without a reading, so that indices and names are kept and a
+// disk that comes back gets its old sensor.
+void discover_drives()
+{
+    DIR *dir = opendir("/sys/block");
+    if (!dir) return;
+
+    for (int i = 0; i < sensor_count; ++i) {
+        if (sensors[i].kind == SENSOR_DRIVE) sensors[i].present = false;
+    }
+
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (!is_disk_name(de->d_name)) continue;
+
+        char path[512], id[256], name[sizeof(sensors[0].name)];
+        int removable = 0;
+        snprintf(path, sizeof(path), "/sys/block/%s/removable", de->d_name);
+        FILE *f = fopen(path, "r");
+        if (f) {
+            if (fscanf(f, "%d", &removable) != 1) removable = 0;
+            fclose(f);
+        }
+        if (removable) continue;
+
+        // Without a by-id link there is no stable name, fall back to the kernel name
+        if (!find_disk_id(de->d_name, id, sizeof(id))) snprintf(id, sizeof(id), "%s", de->d_name);
+        if (!drive_filter_match(id)) continue;
+        sensor_name_from_id(id, name, sizeof(name));
+
+        struct sensor *s = find_sensor(name);
+        if (!s) {
+            s = add_sensor(name, SENSOR_DRIVE, setpoint);
+            if (!s) break;
+            if (sensor_config) apply_sensor_config(sensor_config, s);
+            printf("Discovered drive /dev/%s as %s\n", de->d_name, name);
+        } else if (!s->present && strcmp(s->dev, de->d_name) != 0) {
+            printf("Drive %s is now /dev/%s\n", name, de->d_name);
+        }
+
+        // A different disk node may sit on a different transport
+        if (strcmp(s->dev, de->d_name) != 0) s->type = DRIVE_UNKNOWN;
+        // is_disk_name() only lets names through that fit
+        snprintf(s->dev, sizeof(s->dev), "%.*s", static_cast<int>(sizeof(s->dev) - 1), de->d_name);
+        s->present = true;
+    }
+
+    closedir(dir);
+
+    for (int i = 0; i < sensor_count; ++i) {
+        struct sensor *s = &sensors[i];
+        if (s->kind != SENSOR_DRIVE || s->present) continue;
+        if (s->temp != 0) printf("Drive %s (/dev/%s) is gone\n", s->name, s->dev);
+        s->temp = 0;
+    }
+}
+
+int open_uevent_socket()
+{
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1; // Kernel uevents
+
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        printf("Error: Could not listen for uevents, drives will not be rediscovered: %s\n", strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Drain pending uevents. A disk being added or removed schedules a rescan a moment
+// later, giving udev time to create the by-id links.
+void handle_uevents(int fd)
+{
+    char buf[4096];
+    ssize_t n;
+
+    while ((n = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+        buf[n] = '\0';
+        const char *action = NULL, *subsystem = NULL, *devtype = NULL, *devname = NULL;
+
+        // "action@devpath" followed by NUL separated KEY=value pairs
+        for (char *p = buf; p < buf + n; p += strlen(p) + 1) {
+            if (strncmp(p, "ACTION=", 7) == 0) action = p + 7;
+            else if (strncmp(p, "SUBSYSTEM=", 10) == 0) subsystem = p + 10;
+            else if (strncmp(p, "DEVTYPE=", 8) == 0) devtype = p + 8;
+            else if (strncmp(p, "DEVNAME=", 8) == 0) devname = p + 8;
+        }
+
+        if (!action || !subsystem || !devtype || !devname) continue;
+        if (strcmp(subsystem, "block") != 0 || strcmp(devtype, "disk") != 0 || !is_disk_name(devname)) continue;
+        if (strcmp(action, "add") != 0 && strcmp(action, "remove") != 0) continue;
+
+        if (debug) printf("uevent: %s /dev/%s\n", action, devname);
+        discover_at = monotonic_now() + 2;
+    }
+}
+
+// Fleet telemetry. An agent (--fleet_server) sends its readings to an aggregator once
+// per cycle in compact binary frames, over UDP or with --fleet_tcp over TCP. The
+// aggregator (--fleet_listen) keeps the latest values of every agent and every
+// --fleet_flush seconds forwards them to Graphite in large batches, together with
+// count/mean/min/max per drive model across the fleet.
+//
+// Frame: 0xfc, type, varint seq, host, then varint n and n entries. A full frame
+// (type 0) carries "varint id, name, model, zigzag value" per entry and defines the
+// ids; a delta frame (type 1) only carries "varint id, zigzag change" for values that
+// changed since frame seq - 1. Strings are a varint length and the bytes. Full frames
+// are sent every FLEET_FULL_EVERY frames, so an aggregator that missed a datagram is
+// back in sync soon. Over TCP every frame is preceded by its varint length.
+#define FLEET_MAGIC 0xfc
+#define FLEET_FULL 0
+#define FLEET_DELTA 1
+#define FLEET_FULL_EVERY 30
+#define FLEET_MAX_VALUES 80
+#define FLEET_FRAME_MAX 16384
+#define FLEET_MAX_AGENTS 4096   // Size of the agent hash table
+#define FLEET_MAX_CLIENTS 2048  // TCP connections to the aggregator
+#define FLEET_MAX_MODELS 64
+
+struct fleet_sample {
+    char name[96];
+    char model[48];
+    int value;
+};
+
+struct fleet_encoder {
+    unsigned long seq;
+    int count;        // Entries in the last full frame
+    int since_full;   // Frames since then
+    int last[FLEET_MAX_VALUES];
+};
+
+struct fleet_agent {
+    char host[64];
+    unsigned long seq;
+    bool synced;      // Deltas can be applied
+    int count;
+    struct fleet_sample *values;
+};
+
+struct fleet_client {
+    int fd;
+    size_t len;
+    uint8_t buf[FLEET_FRAME_MAX + 16];
+};
+
+static struct fleet_encoder fleet_enc;
+static int fleet_sockfd = -1;
+static time_t fleet_last_connect = 0;
+static struct fleet_agent *fleet_agents[FLEET_MAX_AGENTS];
+static int fleet_agent_count = 0;
+static struct fleet_client *fleet_clients[FLEET_MAX_CLIENTS];
+static int fleet_client_count = 0;
+static int fleet_udp_fd = -1;
+static int fleet_tcp_fd = -1;
+static long fleet_frames = 0;     // Frames accepted by the aggregator
+static long fleet_dropped = 0;    // Malformed or out of sync frames
+static long fleet_bytes = 0;
+
+size_t put_varint(uint8_t *p, unsigned long v)
+{
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = static_cast<uint8_t>(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = static_cast<uint8_t>(v);
+    return n;
+}
+
+bool get_varint(const uint8_t **p, const uint8_t *end, unsigned long *v)
+{
+    unsigned long result = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        uint8_t b = *(*p)++;
+        result |= static_cast<unsigned long>(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Small negative changes should stay small on the wire
+unsigned long zigzag(long v) { return (static_cast<unsigned long>(v) << 1) ^ static_cast<unsigned long>(v >> 63); }
+long unzigzag(unsigned long v) { return static_cast<long>(v >> 1) ^ -static_cast<long>(v & 1); }
+
+size_t put_string(uint8_t *p, const char *s)
+{
+    size_t len = strlen(s);
+    size_t n = put_varint(p, len);
+    memcpy(p + n, s, len);
+    return n + len;
+}
+
+bool get_string(const uint8_t **p, const uint8_t *end, char *s, size_t size)
+{
+    unsigned long len;
+    if (!get_varint(p, end, &len) || len > static_cast<unsigned long>(end - *p)) return false;
+    snprintf(s, size, "%.*s", static_cast<int>(len), reinterpret_cast<const char *>(*p));
+    *p += len;
+    return true;
+}
+
+// Encode the samples of one cycle, returns the frame length
+size_t fleet_encode(struct fleet_encoder *e, const char *host, const struct fleet_sample *samples, int count, uint8_t *buf)
+{
+    if (count > FLEET_MAX_VALUES) count = FLEET_MAX_VALUES;
+    bool full = e->seq == 0 || count != e->count || e->since_full >= FLEET_FULL_EVERY;
+
+    size_t n = 0;
+    buf[n++] = FLEET_MAGIC;
+    buf[n++] = full ? FLEET_FULL : FLEET_DELTA;
+    n += put_varint(buf + n, ++e->seq);
+    n += put_string(buf + n, host);
+
+    // The entry count goes in front of the entries, reserve the largest varint for it
+    size_t count_at = n;
+    n += 2;
+    int entries = 0;
+
+    for (int i = 0; i < count; ++i) {
+        if (full) {
+            n += put_varint(buf + n, i);
+            n += put_string(buf + n, samples[i].name);
+            n += put_string(buf + n, samples[i].model);
+            n += put_varint(buf + n, zigzag(samples[i].value));
+        } else if (samples[i].value != e->last[i]) {
+            n += put_varint(buf + n, i);
+            n += put_varint(buf + n, zigzag(samples[i].value - e->last[i]));
+        } else {
+            continue;
+        }
+        e->last[i] = samples[i].value;
+        ++entries;
+    }
+
+    // Two byte varint, so that FLEET_MAX_VALUES always fits
+    buf[count_at] = static_cast<uint8_t>(entries | 0x80);
+    buf[count_at + 1] = static_cast<uint8_t>(entries >> 7);
+
+    e->count = count;
+    e->since_full = full ? 1 : e->since_full + 1;
+    return n;
+}
+
+struct fleet_agent *fleet_find_agent(const char *host, bool create)
+{
+    unsigned long h = 14695981039346656037UL; // FNV-1a
+    for (const char *c = host; *c; ++c) h = (h ^ static_cast<uint8_t>(*c)) * 1099511628211UL;
+
+    for (unsigned long probe = 0; probe < FLEET_MAX_AGENTS; ++probe) {
+        struct fleet_agent **slot = &fleet_agents[(h + probe) % FLEET_MAX_AGENTS];
+        if (*slot && strcmp((*slot)->host, host) == 0) return *slot;
+        if (*slot) continue;
+        if (!create) return NULL;
+
+        *slot = static_cast<struct fleet_agent *>(calloc(1, sizeof(struct fleet_agent)));
+        if (!*slot) return NULL;
+        snprintf((*slot)->host, sizeof((*slot)->host), "%s", host);
+        ++fleet_agent_count;
+        return *slot;
+    }
+    return NULL;
+}
+
+// Apply one frame to the agent table. Returns -1 for frames that are malformed or do
+// not follow on what the agent sent before.
+int fleet_decode(const uint8_t *buf, size_t len)
+{
+    const uint8_t *p = buf, *end = buf + len;
+    unsigned long seq, count;
+    char host[64];
+
+    if (len < 2 || p[0] != FLEET_MAGIC || p[1] > FLEET_DELTA) return -1;
+    bool full = p[1] == FLEET_FULL;
+    p += 2;
+    if (!get_varint(&p, end, &seq) || !get_string(&p, end, host, sizeof(host)) ||
+        !get_varint(&p, end, &count) || count > FLEET_MAX_VALUES) return -1;
+
+    struct fleet_agent *a = fleet_find_agent(host, full);
+    if (!a) return -1;
+
+    if (full) {
+        struct fleet_sample *values = static_cast<struct fleet_sample *>(realloc(a->values, (count ? count : 1) * sizeof(*values)));
+        if (!values) return -1;
+        a->values = values;
+        a->count = static_cast<int>(count);
+        memset(a->values, 0, count * sizeof(*values));
+    } else if (!a->synced || seq != a->seq + 1) {
+        a->synced = false;
+        return -1;
+    }
+
+    unsigned long i;
+    for (i = 0; i < count; ++i) {
+        unsigned long id, value;
+        if (!get_varint(&p, end, &id) || id >= static_cast<unsigned long>(a->count)) break;
+        struct fleet_sample *v = &a->values[id];
+
+        if (full && (!get_string(&p, end, v->name, sizeof(v->name)) || !get_string(&p, end, v->model, sizeof(v->model)))) break;
+        if (!get_varint(&p, end, &value)) break;
+
+        if (full) v->value = static_cast<int>(unzigzag(value));
+        else v->value += static_cast<int>(unzigzag(value));
+    }
+
+    // A truncated frame, or one with bytes after its values, leaves the agent unusable
+    // until its next full frame
+    a->synced = i == count && p == end;
+    a->seq = seq;
+    if (!a->synced) return -1;
+
+    ++fleet_frames;
+    fleet_bytes += len;
+    return 0;
+}
+
+// Model of a drive as its vendor reports it, or the kind of a non-drive value
+void sensor_model(const struct sensor *s, char *model, size_t size)
+{
+    snprintf(model, size, "%s", s->kind == SENSOR_CPU ? "cpu" : s->kind == SENSOR_HELPER ? "helper" : "drive");
+    if (s->kind != SENSOR_DRIVE || simulate) return;
+
+    char path[128], buf[64];
+    snprintf(path, sizeof(path), "/sys/block/%s/device/model", s->dev);
+    FILE *f = fopen(path, "r");
+    if (!f) return;
+    if (fgets(buf, sizeof(buf), f)) {
+        char name[64];
+        // Trailing blanks are padding, everything else becomes part of a metric name
+        size_t len = strlen(buf);
+        while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == ' ')) buf[--len] = '\0';
+        sensor_name_from_id(buf, name, sizeof(name));
+        if (name[0]) snprintf(model, size, "%s", name);
+    }
+    fclose(f);
+}
+
+int connect_to_fleet()
+{
+    time_t now = time(NULL);
+    if (now - fleet_last_connect < graphite_connect_timeout) return -1;
+    fleet_last_connect = now;
+
+    char host[64];
+    const char *colon = strrchr(fleet_server, ':');
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    snprintf(host, sizeof(host), "%.*s", colon ? static_cast<int>(colon - fleet_server) : 0, fleet_server);
+    if (!colon || inet_pton(AF_INET, host, &addr.sin_addr) <= 0) {
+        printf("Error: Invalid fleet server %s, expected <ip:port>\n", fleet_server);
+        return -1;
+    }
+    addr.sin_port = htons(atoi(colon + 1));
+
+    fleet_sockfd = socket(AF_INET, (fleet_tcp ? SOCK_STREAM : SOCK_DGRAM) | SOCK_CLOEXEC, 0);
+    if (fleet_sockfd < 0 || connect(fleet_sockfd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+        printf("Error: Could not connect to fleet server %s: %s\n", fleet_server, strerror(errno));
+        if (fleet_sockfd >= 0) close(fleet_sockfd);
+        fleet_sockfd = -1;
+        return -1;
+    }
+
+    // A new connection starts with a full frame
+    fleet_enc.seq = 0;
+    return fleet_sockfd;
+}
+
+// Send the readings of this cycle to the aggregator
+void fleet_publish(int pwm)
+{
+    static struct fleet_sample samples[FLEET_MAX_VALUES];
+    static uint8_t frame[FLEET_FRAME_MAX + 8];
+    int count = 0;
+
+    if (fleet_sockfd < 0 && connect_to_fleet() < 0) return;
+
+    // Names and models only travel in full frames, the same test as fleet_encode()
+    int drives = sensor_count < FLEET_MAX_VALUES - FAN_COUNT - 1 ? sensor_count : FLEET_MAX_VALUES - FAN_COUNT - 1;
+    bool full = fleet_enc.seq == 0 || drives + 1 + FAN_COUNT != fleet_enc.count || fleet_enc.since_full >= FLEET_FULL_EVERY;
+    for (int i = 0; i < drives; ++i) {
+        struct fleet_sample *s = &samples[count++];
+        if (full) {
+            snprintf(s->name, sizeof(s->name), "%.*s", SENSOR_NAME_MAX, sensors[i].name);
+            sensor_model(&sensors[i], s->model, sizeof(s->model));
+        }
+        s->value = sensors[i].temp;
+    }
+
+    snprintf(samples[count].name, sizeof(samples[count].name), "pwm");
+    snprintf(samples[count].model, sizeof(samples[count].model), "pwm");
+    samples[count++].value = pwm;
+    for (int i = 0; i < FAN_COUNT; ++i, ++count) {
+        snprintf(samples[count].name, sizeof(samples[count].name), "%s_rpm", fans[i].name);
+        snprintf(samples[count].model, sizeof(samples[count].model), "fan_rpm");
+        samples[count].value = fans[i].rpm;
+    }
+
+    // Room in front for the TCP length prefix
+    uint8_t *body = frame + 4;
+    size_t len = fleet_encode(&fleet_enc, fleet_name, samples, count, body);
+    uint8_t *out = body;
+    if (fleet_tcp) {
+        uint8_t prefix[4];
+        size_t n = put_varint(prefix, len);
+        out = body - n;
+        memcpy(out, prefix, n);
+        len += n;
+    }
+
+    if (send(fleet_sockfd, out, len, MSG_NOSIGNAL) < 0) {
+        if (debug) printf("Fleet server: %s\n", strerror(errno));
+        close(fleet_sockfd);
+        fleet_sockfd = -1;
+    }
+}
+
+// Graphite lines go out in batches of up to FLEET_FRAME_MAX bytes
+static char fleet_batch[FLEET_FRAME_MAX];
+static size_t fleet_batch_len = 0;
+
+void fleet_batch_flush()
+{
+    if (fleet_batch_len == 0) return;
+    if (graphite_server) send_to_graphite(fleet_batch);
+    fleet_batch_len = 0;
+}
+
+void fleet_batch_add(const char *line)
+{
+    size_t len = strlen(line);
+    if (fleet_batch_len + len + 1 > sizeof(fleet_batch)) fleet_batch_flush();
+    memcpy(fleet_batch + fleet_batch_len, line, len + 1);
+    fleet_batch_len += len;
+}
+
+struct fleet_model_stats {
+    char model[48];
+    long count;
+    double sum;
+    int min, max;
+};
+
+// Per model statistics over the latest value of every agent, readings of 0 excluded
+int fleet_stats(struct fleet_model_stats *stats)
+{
+    int models = 0;
+
+    for (int h = 0; h < FLEET_MAX_AGENTS; ++h) {
+        struct fleet_agent *a = fleet_agents[h];
+        if (!a) continue;
+
+        for (int i = 0; i < a->count; ++i) {
+            const struct fleet_sample *v = &a->values[i];
+            if (v->value == 0) continue;
+
+            int m = 0;
+            while (m < models && strcmp(stats[m].model, v->model) != 0) ++m;
+            if (m == models) {
+                if (models == FLEET_MAX_MODELS) continue;
+                memset(&stats[m], 0, sizeof(stats[m]));
+                snprintf(stats[m].model, sizeof(stats[m].model), "%s", v->model);
+                stats[m].min = stats[m].max = v->value;
+                ++models;
+            }
+
+            struct fleet_model_stats *s = &stats[m];
+            ++s->count;
+            s->sum += v->value;
+            if (v->value < s->min) s->min = v->value;
+            if (v->value > s->max) s->max = v->value;
+        }
+    }
+    return models;
+}
+
+void fleet_flush_graphite()
+{
+    static struct fleet_model_stats stats[FLEET_MAX_MODELS];
+    char line[256];
+    long now = time(NULL);
+
+    for (int h = 0; h < FLEET_MAX_AGENTS; ++h) {
+        struct fleet_agent *a = fleet_agents[h];
+        if (!a) continue;
+        for (int i = 0; i < a->count; ++i) {
+            snprintf(line, sizeof(line), "fancontrol.%s.%s %d %ld\n", a->host, a->values[i].name, a->values[i].value, now);
+            fleet_batch_add(line);
+        }
+    }
+
+    int models = fleet_stats(stats);
+    int model_len = static_cast<int>(sizeof(stats[0].model)) - 1;
+    for (int m = 0; m < models; ++m) {
+        struct fleet_model_stats *s = &stats[m];
+        if (debug) printf("Fleet %s: %ld values, mean %.1f, min %d, max %d\n", s->model, s->count, s->sum / s->count, s->min, s->max);
+        snprintf(line, sizeof(line), "fleet.%.*s.count %ld %ld\n", model_len, s->model, s->count, now);
+        fleet_batch_add(line);
+        snprintf(line, sizeof(line), "fleet.%.*s.mean %.2f %ld\n", model_len, s->model, s->sum / s->count, now);
+        fleet_batch_add(line);
+        snprintf(line, sizeof(line), "fleet.%.*s.min %d %ld\n", model_len, s->model, s->min, now);
+        fleet_batch_add(line);
+        snprintf(line, sizeof(line), "fleet.%.*s.max %d %ld\n", model_len, s->model, s->max, now);
+        fleet_batch_add(line);
+    }
+
+    snprintf(line, sizeof(line), "fleet.agents %d %ld\nfleet.frames %ld %ld\nfleet.dropped %ld %ld\n",
+             fleet_agent_count, now, fleet_frames, now, fleet_dropped, now);
+    fleet_batch_add(line);
+    fleet_batch_flush();
+}
+
+// UDP and TCP on the same port, returns the port or -1
+int fleet_open_listeners(const char *address, int port)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, address, &addr.sin_addr);
+
+    int one = 1;
+    fleet_tcp_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fleet_tcp_fd < 0 || setsockopt(fleet_tcp_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        bind(fleet_tcp_fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0 || listen(fleet_tcp_fd, 128) < 0 ||
+        getsockname(fleet_tcp_fd, reinterpret_cast<struct sockaddr *>(&addr), &addrlen) < 0) {
+        printf("Error: Could not listen on TCP port %d: %s\n", port, strerror(errno));
+        return -1;
+    }
+
+    // An ephemeral TCP port is used for UDP as well
+    fleet_udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int rcvbuf = 4 << 20;
+    setsockopt(fleet_udp_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    if (fleet_udp_fd < 0 || bind(fleet_udp_fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+        printf("Error: Could not listen on UDP port %d: %s\n", ntohs(addr.sin_port), strerror(errno));
+        return -1;
+    }
+
+    return ntohs(addr.sin_port);
+}
+
+void fleet_read_client(int c)
+{
+    struct fleet_client *client = fleet_clients[c];
+    ssize_t n = recv(client->fd, client->buf + client->len, sizeof(client->buf) - client->len, 0);
+
+    if (n > 0) {
+        client->len += n;
+        for (;;) {
+            const uint8_t *p = client->buf;
+            unsigned long frame_len;
+            if (!get_varint(&p, client->buf + client->len, &frame_len)) break;
+            if (frame_len > FLEET_FRAME_MAX) {
+                n = 0; // Garbage, drop the connection
+                break;
+            }
+            size_t header = p - client->buf;
+            if (client->len < header + frame_len) break;
+
+            if (fleet_decode(p, frame_len) < 0) ++fleet_dropped;
+            client->len -= header + frame_len;
+            memmove(client->buf, client->buf + header + frame_len, client->len);
+        }
+    }
+
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        close(client->fd);
+        free(client);
+        fleet_clients[c] = fleet_clients[--fleet_client_count];
+    }
+}
+
+// Handle whatever arrived within timeout_ms
+void fleet_poll(int timeout_ms)
+{
+    static struct pollfd pfds[FLEET_MAX_CLIENTS + 2];
+    int nfds = 0;
+
+    pfds[nfds++] = (struct pollfd){ fleet_udp_fd, POLLIN, 0 };
+    pfds[nfds++] = (struct pollfd){ fleet_tcp_fd, POLLIN, 0 };
+    for (int c = 0; c < fleet_client_count; ++c) pfds[nfds++] = (struct pollfd){ fleet_clients[c]->fd, POLLIN, 0 };
+    int clients = fleet_client_count;
+
+    if (poll(pfds, nfds, timeout_ms) <= 0) return;
+
+    if (pfds[0].revents & POLLIN) {
+        uint8_t buf[FLEET_FRAME_MAX];
+        ssize_t n;
+        while ((n = recv(fleet_udp_fd, buf, sizeof(buf), 0)) > 0) {
+            if (fleet_decode(buf, n) < 0) ++fleet_dropped;
+        }
+    }
+
+    // Back to front, a closed client is replaced by the last one
+    for (int c = clients - 1; c >= 0; --c) {
+        if (pfds[2 + c].revents & (POLLIN | POLLHUP | POLLERR)) fleet_read_client(c);
+    }
+
+    if (pfds[1].revents & POLLIN) {
+        int fd;
+        while ((fd = accept4(fleet_tcp_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+            struct fleet_client *client = fleet_client_count < FLEET_MAX_CLIENTS ?
+                static_cast<struct fleet_client *>(malloc(sizeof(struct fleet_client))) : NULL;
+            if (!client) {
+                close(fd);
+                continue;
+            }
+            client->fd = fd;
+            client->len = 0;
+            fleet_clients[fleet_client_count++] = client;
+        }
+    }
+}
+
+// Aggregator mode, runs until SIGTERM
+int run_aggregator()
+{
+    int port = fleet_open_listeners("0.0.0.0", fleet_listen);
+    if (port < 0) return 1;
+    printf("Aggregating fleet telemetry on port %d\n", port);
+
+    struct sigaction stop_action;
+    memset(&stop_action, 0, sizeof(stop_action));
+    stop_action.sa_handler = request_stop;
+    sigaction(SIGTERM, &stop_action, NULL);
+    sigaction(SIGINT, &stop_action, NULL);
+
+    graphite_sockfd = graphite_server ? connect_to_graphite() : -1;
+    double flush_at = monotonic_now() + fleet_flush;
+
+    while (!stop_requested) {
+        double wait = flush_at - monotonic_now();
+        fleet_poll(wait > 0 ? static_cast<int>(wait * 1000) + 1 : 0);
+
+        if (monotonic_now() >= flush_at) {
+            fleet_flush_graphite();
+            flush_at += fleet_flush;
+        }
+    }
+    return 0;
+}
+
+// Loopback test: this many simulated agents with six drives each stream to an
+// aggregator in the same process, which must end up with exactly their values
+int fleet_benchmark(int agents)
+{
+    static const char *models[] = { "WDC_WD40EFRX_68N32N0", "ST4000VN008_2DR166", "TOSHIBA_HDWG440" };
+    const int drives = 6, count = drives + 1 + FAN_COUNT, rounds = 60;
+
+    // Each agent needs a socket, and over TCP the aggregator one more
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    int port = fleet_open_listeners("127.0.0.1", 0);
+    if (port < 0) return 1;
+
+    struct fleet_encoder *enc = static_cast<struct fleet_encoder *>(calloc(agents, sizeof(*enc)));
+    struct fleet_sample *samples = static_cast<struct fleet_sample *>(calloc(static_cast<size_t>(agents) * count, sizeof(*samples)));
+    int *fds = static_cast<int *>(malloc(agents * sizeof(int)));
+    if (!enc || !samples || !fds) return 1;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+
+    for (int a = 0; a < agents; ++a) {
+        fds[a] = socket(AF_INET, fleet_tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+        if (fds[a] < 0 || connect(fds[a], reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+            printf("Error: Agent %d could not connect: %s\n", a, strerror(errno));
+            return 1;
+        }
+        if (fleet_tcp && a % 64 == 63) fleet_poll(0); // Keep the accept backlog short
+
+        for (int i = 0; i < count; ++i) {
+            struct fleet_sample *s = &samples[a * count + i];
+            if (i < drives) {
+                snprintf(s->name, sizeof(s->name), "bay%d", i);
+                snprintf(s->model, sizeof(s->model), "%s", models[(a + i) % 3]);
+                s->value = 30 + (a + 3 * i) % 12;
+            } else if (i == drives) {
+                snprintf(s->name, sizeof(s->name), "pwm");
+                snprintf(s->model, sizeof(s->model), "pwm");
+                s->value = 128;
+            } else {
+                snprintf(s->name, sizeof(s->name), "fan%d_rpm", i - drives + 2);
+                snprintf(s->model, sizeof(s->model), "fan_rpm");
+                s->value = 900;
+            }
+        }
+    }
+
+    uint8_t frame[FLEET_FRAME_MAX + 8];
+    long sent = 0, sent_bytes = 0, text_bytes = 0;
+    unsigned int rng = 1;
+    double start = latency_clock();
+
+    for (int r = 0; r < rounds; ++r) {
+        for (int a = 0; a < agents; ++a) {
+            char host[64];
+            snprintf(host, sizeof(host), "nas%04d", a);
+
+            // Temperatures drift by a degree now and then, fans and PWM follow
+            for (int i = 0; i < count; ++i) {
+                struct fleet_sample *s = &samples[a * count + i];
+                rng = rng * 1103515245 + 12345;
+                int step = (rng >> 16) % 8;
+                if (i < drives) s->value += step == 0 ? 1 : step == 1 ? -1 : 0;
+                else if (i == drives) s->value += step == 0 ? 5 : step == 1 ? -5 : 0;
+                else s->value += step < 2 ? static_cast<int>(rng >> 20) % 41 - 20 : 0;
+
+                char line[256];
+                text_bytes += snprintf(line, sizeof(line), "fancontrol.%s.%s %d %ld\n", host, s->name, s->value, time(NULL));
+            }
+
+            uint8_t *body = frame + 4;
+            size_t len = fleet_encode(&enc[a], host, &samples[a * count], count, body);
+            uint8_t *out = body;
+            if (fleet_tcp) {
+                uint8_t prefix[4];
+                size_t n = put_varint(prefix, len);
+                out = body - n;
+                memcpy(out, prefix, n);
+                len += n;
+            }
+            if (send(fds[a], out, len, 0) == static_cast<ssize_t>(len)) {
+                ++sent;
+                sent_bytes += len;
+            }
+
+            // Drain often enough that the socket buffers never overflow
+            if (a % 50 == 49) fleet_poll(0);
+        }
+        fleet_poll(0);
+    }
+
+    // Let the last frames arrive
+    for (int i = 0; i < 20 && fleet_frames < sent; ++i) fleet_poll(10);
+    double elapsed = latency_clock() - start;
+
+    long mismatches = 0;
+    for (int a = 0; a < agents; ++a) {
+        char host[64];
+        snprintf(host, sizeof(host), "nas%04d", a);
+        struct fleet_agent *agent = fleet_find_agent(host, false);
+        for (int i = 0; i < count; ++i) {
+            const struct fleet_sample *s = &samples[a * count + i];
+            if (!agent || agent->count != count || agent->values[i].value != s->value ||
+                strcmp(agent->values[i].name, s->name) != 0 || strcmp(agent->values[i].model, s->model) != 0) ++mismatches;
+        }
+    }
+
+    static struct fleet_model_stats stats[FLEET_MAX_MODELS];
+    int nmodels = fleet_stats(stats);
+    for (int m = 0; m < nmodels; ++m) {
+        printf("  %-22s %6ld values, mean %7.1f, min %4d, max %4d\n", stats[m].model, stats[m].count,
+               stats[m].sum / stats[m].count, stats[m].min, stats[m].max);
+    }
+
+    printf("Fleet loopback over %s: %d agents, %d rounds, %ld frames sent, %ld received, %ld dropped\n",
+           fleet_tcp ? "TCP" : "UDP", agents, rounds, sent, fleet_frames, fleet_dropped);
+    printf("  %.1f bytes per frame (%.1f as Graphite text), %.0f frames/s, %ld values differ\n",
+           sent ? static_cast<double>(sent_bytes) / sent : 0.0, sent ? static_cast<double>(text_bytes) / sent : 0.0,
+           elapsed > 0 ? fleet_frames / elapsed : 0.0, mismatches);
+
+    for (int a = 0; a < agents; ++a) close(fds[a]);
+    free(fds);
+    free(samples);
+    free(enc);
+    return mismatches == 0 && fleet_agent_count == agents ? 0 : 1;
+}
+
+// MQTT (--mqtt_server), for Home Assistant and similar. A minimal MQTT 3.1.1 client
+// that only publishes, at QoS 0: every cycle one retained JSON document with all
+// readings goes to <mqtt_topic>/state, and once per connection a retained discovery
+// config per value goes to <mqtt_discovery>/sensor/..., so that Home Assistant creates
+// the entities by itself. <mqtt_topic>/status is "online", or "offline" through the
+// will when the daemon goes away. The socket is non-blocking and serviced from the
+// idle loop: connecting, reconnecting and keepalive never hold up the control loop,
+// and state that cannot be sent right away is dropped, the next cycle replaces it.
+#define MQTT_TIMEOUT 10      // Seconds to connect and get the CONNACK
+#define MQTT_BACKOFF_MAX 60  // Longest wait in seconds between connection attempts
+
+enum mqtt_state { MQTT_IDLE, MQTT_CONNECTING, MQTT_HANDSHAKE, MQTT_UP };
+
+static int mqtt_sockfd = -1;
+static int mqtt_state = MQTT_IDLE;
+static double mqtt_since = 0;      // Start of the current connection attempt
+static double mqtt_retry_at = 0;   // Next connection attempt
+static double mqtt_backoff = 1;
+static double mqtt_last_sent = 0;  // Keepalive is measured from the last packet sent
+static double mqtt_ping_at = 0;    // PINGREQ without answer, 0 for none
+static double mqtt_wake_at = 0;    // Next timer check from the idle loop
+static uint8_t mqtt_out[65536];
+static size_t mqtt_out_len = 0;
+static uint8_t mqtt_in[512];
+static size_t mqtt_in_len = 0;
+static int mqtt_announced = -1;    // Sensors with a discovery config, -1 before pwm and fans
+static long mqtt_dropped = 0;      // Publishes that did not fit in the output buffer
+static char mqtt_node[sizeof("fancontrol_") + 63]; // Client id and Home Assistant device id, from the hostname
+
+size_t mqtt_put_string(uint8_t *p, const char *s)
+{
+    size_t len = strlen(s);
+    p[0] = static_cast<uint8_t>(len >> 8);
+    p[1] = static_cast<uint8_t>(len);
+    memcpy(p + 2, s, len);
+    return len + 2;
+}
+
+void mqtt_drop(const char *reason)
+{
+    printf("MQTT broker %s: %s, retrying in %.0f s\n", mqtt_server, reason, mqtt_backoff);
+    if (mqtt_sockfd >= 0) close(mqtt_sockfd);
+    mqtt_sockfd = -1;
+    mqtt_state = MQTT_IDLE;
+    mqtt_retry_at = latency_clock() + mqtt_backoff;
+    mqtt_backoff = mqtt_backoff * 2 < MQTT_BACKOFF_MAX ? mqtt_backoff * 2 : MQTT_BACKOFF_MAX;
+}
+
+// Queue a QoS 0 PUBLISH, -1 when there is no room
+int mqtt_publish(const char *topic, const char *payload, bool retain)
+{
+    size_t tlen = strlen(topic), plen = strlen(payload);
+    size_t remaining = 2 + tlen + plen;
+    if (mqtt_out_len + 5 + remaining > sizeof(mqtt_out)) {
+        ++mqtt_dropped;
+        return -1;
+    }
+
+    uint8_t *p = mqtt_out + mqtt_out_len;
+    size_t n = 0;
+    p[n++] = retain ? 0x31 : 0x30;
+    n += put_varint(p + n, remaining); // The remaining length is a varint as well
+    n += mqtt_put_string(p + n, topic);
+    memcpy(p + n, payload, plen);
+    mqtt_out_len += n + plen;
+    return 0;
+}
+
+void mqtt_send_connect()
+{
+    char will_topic[160];
+    snprintf(will_topic, sizeof(will_topic), "%s/status", mqtt_topic);
+
+    uint8_t body[512];
+    size_t n = 0;
+    n += mqtt_put_string(body + n, "MQTT");
+    body[n++] = 4; // 3.1.1
+    // Clean session, retained will, user name and password when given
+    body[n++] = 0x02 | 0x04 | 0x20 | (mqtt_user ? 0x80 : 0) | (mqtt_user && mqtt_password ? 0x40 : 0);
+    body[n++] = static_cast<uint8_t>(mqtt_keepalive >> 8);
+    body[n++] = static_cast<uint8_t>(mqtt_keepalive);
+    n += mqtt_put_string(body + n, mqtt_node);
+    n += mqtt_put_string(body + n, will_topic);
+    n += mqtt_put_string(body + n, "offline");
+    if (mqtt_user) n += mqtt_put_string(body + n, mqtt_user);
+    if (mqtt_user && mqtt_password) n += mqtt_put_string(body + n, mqtt_password);
+
+    // A new connection starts with an empty buffer
+    mqtt_out_len = 0;
+    mqtt_out[mqtt_out_len++] = 0x10;
+    mqtt_out_len += put_varint(mqtt_out + mqtt_out_len, n);
+    memcpy(mqtt_out + mqtt_out_len, body, n);
+    mqtt_out_len += n;
+    mqtt_in_len = 0;
+}
+
+void mqtt_connect(double now)
+{
+    char host[64];
+    const char *colon = strrchr(mqtt_server, ':');
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(colon ? atoi(colon + 1) : 1883);
+    snprintf(host, sizeof(host), "%.*s", colon ? static_cast<int>(colon - mqtt_server) : static_cast<int>(strlen(mqtt_server)), mqtt_server);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) <= 0) {
+        mqtt_drop("invalid address, expected <ip:port>");
+        return;
+    }
+
+    mqtt_sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (mqtt_sockfd < 0) {
+        mqtt_drop(strerror(errno));
+        return;
+    }
+
+    mqtt_since = now;
+    if (connect(mqtt_sockfd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == 0) {
+        mqtt_send_connect();
+        mqtt_state = MQTT_HANDSHAKE;
+    } else if (errno == EINPROGRESS) {
+        mqtt_state = MQTT_CONNECTING;
+    } else {
+        mqtt_drop(strerror(errno));
+    }
+}
+
+// Handle the packets a publisher gets: CONNACK and PINGRESP
+void mqtt_receive()
+{
+    ssize_t n;
+    while ((n = recv(mqtt_sockfd, mqtt_in + mqtt_in_len, sizeof(mqtt_in) - mqtt_in_len, MSG_DONTWAIT)) > 0) {
+        mqtt_in_len += n;
+
+        for (;;) {
+            const uint8_t *p = mqtt_in + 1;
+            unsigned long len;
+            if (mqtt_in_len < 2 || !get_varint(&p, mqtt_in + mqtt_in_len, &len)) break;
+            size_t total = (p - mqtt_in) + len;
+            if (total > sizeof(mqtt_in)) {
+                mqtt_drop("unexpected packet");
+                return;
+            }
+            if (mqtt_in_len < total) break;
+
+            uint8_t type = mqtt_in[0] >> 4;
+            if (type == 2 && len >= 2) {
+                if (p[1] != 0) {
+                    char reason[48];
+                    snprintf(reason, sizeof(reason), "connection refused (code %d)", p[1]);
+                    mqtt_drop(reason);
+                    return;
+                }
+                if (debug) printf("Connected to MQTT broker %s\n", mqtt_server);
+                mqtt_state = MQTT_UP;
+                mqtt_backoff = 1;
+                mqtt_ping_at = 0;
+                mqtt_announced = -1;
+
+                char topic[160];
+                snprintf(topic, sizeof(topic), "%s/status", mqtt_topic);
+                mqtt_publish(topic, "online", true);
+            } else if (type == 13) {
+                mqtt_ping_at = 0;
+            }
+
+            mqtt_in_len -= total;
+            memmove(mqtt_in, mqtt_in + total, mqtt_in_len);
+        }
+    }
+
+    if (n == 0) mqtt_drop("connection closed");
+    else if (errno != EAGAIN && errno != EINTR) mqtt_drop(strerror(errno));
+}
+
+void mqtt_flush(double now)
+{
+    while (mqtt_sockfd >= 0 && mqtt_state >= MQTT_HANDSHAKE && mqtt_out_len > 0) {
+        ssize_t n = send(mqtt_sockfd, mqtt_out, mqtt_out_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EINTR) mqtt_drop(strerror(errno));
+            return;
+        }
+        mqtt_out_len -= n;
+        memmove(mqtt_out, mqtt_out + n, mqtt_out_len);
+        mqtt_last_sent = now;
+    }
+}
+
+// Advance the connection as far as possible without blocking
+void mqtt_service()
+{
+    double now = latency_clock();
+    mqtt_wake_at = now + 1;
+
+    if (mqtt_state == MQTT_IDLE) {
+        if (now < mqtt_retry_at) return;
+        mqtt_connect(now);
+    }
+
+    if (mqtt_state == MQTT_CONNECTING) {
+        struct pollfd pfd = { mqtt_sockfd, POLLOUT, 0 };
+        if (poll(&pfd, 1, 0) <= 0) {
+            if (now - mqtt_since > MQTT_TIMEOUT) mqtt_drop("connection timed out");
+            return;
+        }
+
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(mqtt_sockfd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            mqtt_drop(strerror(err));
+            return;
+        }
+        mqtt_send_connect();
+        mqtt_state = MQTT_HANDSHAKE;
+    }
+
+    if (mqtt_state >= MQTT_HANDSHAKE) mqtt_receive();
+
+    if (mqtt_state == MQTT_HANDSHAKE && now - mqtt_since > MQTT_TIMEOUT) {
+        mqtt_drop("no CONNACK");
+    } else if (mqtt_state == MQTT_UP && mqtt_keepalive > 0) {
+        if (mqtt_ping_at > 0 && now - mqtt_ping_at > mqtt_keepalive) {
+            mqtt_drop("no PINGRESP");
+        } else if (mqtt_ping_at == 0 && now - mqtt_last_sent >= mqtt_keepalive / 2.0 && mqtt_out_len + 2 <= sizeof(mqtt_out)) {
+            mqtt_out[mqtt_out_len++] = 0xc0;
+            mqtt_out[mqtt_out_len++] = 0;
+            mqtt_ping_at = now;
+        }
+    }
+
+    mqtt_flush(now);
+}
+
+// Copy s into out as the inside of a JSON string
+void json_escape(const char *s, char *out, size_t size)
+{
+    size_t n = 0;
+    for (; *s && n + 7 < size; ++s) {
+        unsigned char c = static_cast<unsigned char>(*s);
+        if (c == '"' || c == '\\') {
+            out[n++] = '\\';
+            out[n++] = static_cast<char>(c);
+        } else if (c < 0x20) {
+            n += snprintf(out + n, size - n, "\\u%04x", c);
+        } else {
+            out[n++] = static_cast<char>(c);
+        }
+    }
+    out[n] = '\0';
+}
+
+// Retained Home Assistant discovery config for one value of the state document. key
+// must be a valid identifier, it is used in the topic, the unique id and the template.
+void mqtt_announce(const char *key, const char *name, const char *unit, const char *device_class)
+{
+    char topic[256], payload[1024], extra[128] = "", label[256];
+
+    if (unit) snprintf(extra, sizeof(extra), ",\"unit_of_measurement\":\"%s\"", unit);
+    if (device_class) snprintf(extra + strlen(extra), sizeof(extra) - strlen(extra), ",\"device_class\":\"%s\"", device_class);
+
+    json_escape(name, label, sizeof(label));
+    snprintf(topic, sizeof(topic), "%s/sensor/%s/%s/config", mqtt_discovery, mqtt_node, key);
+    snprintf(payload, sizeof(payload),
+             "{\"name\":\"%s\",\"unique_id\":\"%s_%s\",\"state_topic\":\"%s/state\","
+             "\"value_template\":\"{{ value_json.%s }}\",\"state_class\":\"measurement\"%s,"
+             "\"availability_topic\":\"%s/status\",\"device\":{\"identifiers\":[\"%s\"],"
+             "\"name\":\"%s\",\"manufacturer\":\"TerraMaster\",\"model\":\"IT8613E fan control\"}}",
+             label, mqtt_node, key, mqtt_topic, key, extra, mqtt_topic, mqtt_node, mqtt_node);
+    mqtt_publish(topic, payload, true);
+}
+
+// Publish the readings of this cycle, and discovery configs for new values
+void mqtt_publish_state(int pwm, int maxtemp)
+{
+    mqtt_service();
+    if (mqtt_state != MQTT_UP) return;
+
+    if (mqtt_discovery[0]) {
+        char key[SENSOR_NAME_MAX + 1], name[128];
+        if (mqtt_announced < 0) {
+            mqtt_announce("pwm", "Fan PWM", NULL, NULL);
+            mqtt_announce("maxtemp", "Hottest temperature", "°C", "temperature");
+            for (int i = 0; i < FAN_COUNT; ++i) {
+                snprintf(key, sizeof(key), "%s_rpm", fans[i].name);
+                snprintf(name, sizeof(name), "%s speed", fans[i].name);
+                mqtt_announce(key, name, "rpm", NULL);
+            }
+            mqtt_announced = 0;
+        }
+        // Discovered drives come later. Helper names may hold any character, the key
+        // keeps letters, digits and underscores like the node id.
+        for (; mqtt_announced < sensor_count; ++mqtt_announced) {
+            sensor_name_from_id(sensors[mqtt_announced].name, key, sizeof(key));
+            snprintf(name, sizeof(name), "%.*s temperature", SENSOR_NAME_MAX, sensors[mqtt_announced].name);
+            mqtt_announce(key, name, "°C", "temperature");
+        }
+    }
+
+    char state[8192], topic[160], key[SENSOR_NAME_MAX + 1];
+    int n = snprintf(state, sizeof(state), "{\"pwm\":%d,\"maxtemp\":%d", pwm, maxtemp);
+    for (int i = 0; i < FAN_COUNT && n < static_cast<int>(sizeof(state)); ++i)
+        n += snprintf(state + n, sizeof(state) - n, ",\"%s_rpm\":%d", fans[i].name, fans[i].rpm);
+    for (int i = 0; i < sensor_count && n < static_cast<int>(sizeof(state)); ++i) {
+        // Sensors without a reading are unknown, not 0 °C
+        sensor_name_from_id(sensors[i].name, key, sizeof(key));
+        if (sensors[i].present && sensors[i].temp > 0)
+            n += snprintf(state + n, sizeof(state) - n, ",\"%s\":%d", key, sensors[i].temp);
+        else
+            n += snprintf(state + n, sizeof(state) - n, ",\"%s\":null", key);
+    }
+    if (n < static_cast<int>(sizeof(state)) - 1) {
+        snprintf(state + n, sizeof(state) - n, "}");
+        snprintf(topic, sizeof(topic), "%s/state", mqtt_topic);
+        mqtt_publish(topic, state, true);
+    }
+
+    mqtt_flush(latency_clock());
+}
+
+// Say goodbye, so that the broker does not publish the will
+void mqtt_disconnect()
+{
+    if (mqtt_state == MQTT_UP) {
+        char topic[160];
+        snprintf(topic, sizeof(topic), "%s/status", mqtt_topic);
+        mqtt_publish(topic, "offline", true);
+        if (mqtt_out_len + 2 <= sizeof(mqtt_out)) {
+            mqtt_out[mqtt_out_len++] = 0xe0;
+            mqtt_out[mqtt_out_len++] = 0;
+        }
+        mqtt_flush(latency_clock());
+    }
+    if (mqtt_sockfd >= 0) close(mqtt_sockfd);
+    mqtt_sockfd = -1;
+    mqtt_state = MQTT_IDLE;
+}
+
+// Loopback test (--mqtt_bench): a stand-in broker in the same process takes three
+// connections from the client. It checks every CONNECT, that status, discovery and
+// state are retained, that the discovery configs arrive once per connection, and it
+// answers PINGREQs. It closes the first connection and refuses the second, and the
+// client must wait out its backoff before each reconnect.
+struct mqtt_bench_broker {
+    int listen_fd, fd;
+    uint8_t in[65536];
+    size_t in_len;
+    bool refuse;           // Answer the next CONNECT with "not authorized"
+    double dropped_at;     // The broker last closed or refused the client
+    double waited;         // From then to the last accepted connection
+    int connects, closes;  // Over the whole test
+    int online, offline, discovery, states, pings, disconnects; // On this connection
+    int helpers;           // Discovery configs of gpu-0 and a"b with a clean key
+    int failures;
+};
+
+bool mqtt_get_string(const uint8_t **p, const uint8_t *end, char *s, size_t size)
+{
+    if (end - *p < 2) return false;
+    size_t len = ((*p)[0] << 8) | (*p)[1];
+    if (static_cast<size_t>(end - *p) < 2 + len || len >= size) return false;
+    memcpy(s, *p + 2, len);
+    s[len] = '\0';
+    *p += 2 + len;
+    return true;
+}
+
+// Strings, escapes and nesting of a JSON document are well formed
+bool mqtt_bench_json(const char *s)
+{
+    int depth = 0;
+    bool in_string = false;
+    for (; *s; ++s) {
+        if (in_string) {
+            if (static_cast<unsigned char>(*s) < 0x20) return false;
+            if (*s == '\\') {
+                if (!*++s) return false;
+            } else if (*s == '"') {
+                in_string = false;
+            }
+        } else if (*s == '"') {
+            in_string = true;
+        } else if (*s == '{' || *s == '[') {
+            ++depth;
+        } else if ((*s == '}' || *s == ']') && --depth < 0) {
+            return false;
+        }
+    }
+    return depth == 0 && !in_string;
+}
+
+void mqtt_bench_expect(struct mqtt_bench_broker *b, bool ok, const char *what)
+{
+    printf("%-4s %s\n", ok ? "ok" : "FAIL", what);
+    if (!ok) ++b->failures;
+}
+
+// A CONNECT must carry the settings of the client, with a retained "offline" will
+void mqtt_bench_connect(struct mqtt_bench_broker *b, const uint8_t *p, const uint8_t *end)
+{
+    char protocol[8], client[80], will_topic[160], will[16], user[64], password[64], status[160];
+    snprintf(status, sizeof(status), "%s/status", mqtt_topic);
+
+    bool ok = mqtt_get_string(&p, end, protocol, sizeof(protocol)) && strcmp(protocol, "MQTT") == 0 && end - p >= 4 && p[0] == 4;
+    // Clean session, will, will retain, password and user name
+    mqtt_bench_expect(b, ok && p[1] == (0x02 | 0x04 | 0x20 | 0x40 | 0x80), "CONNECT is MQTT 3.1.1 with flags 0xe6");
+    if (!ok) return;
+    mqtt_bench_expect(b, ((p[2] << 8) | p[3]) == mqtt_keepalive, "CONNECT keepalive");
+    p += 4;
+
+    ok = mqtt_get_string(&p, end, client, sizeof(client)) && strcmp(client, mqtt_node) == 0;
+    mqtt_bench_expect(b, ok, "CONNECT client id");
+    ok = mqtt_get_string(&p, end, will_topic, sizeof(will_topic)) && strcmp(will_topic, status) == 0 &&
+         mqtt_get_string(&p, end, will, sizeof(will)) && strcmp(will, "offline") == 0;
+    mqtt_bench_expect(b, ok, "CONNECT will is \"offline\" on <topic>/status");
+    ok = mqtt_get_string(&p, end, user, sizeof(user)) && strcmp(user, mqtt_user) == 0 &&
+         mqtt_get_string(&p, end, password, sizeof(password)) && strcmp(password, mqtt_password) == 0 && p == end;
+    mqtt_bench_expect(b, ok, "CONNECT user name and password");
+}
+
+void mqtt_bench_publish(struct mqtt_bench_broker *b, uint8_t flags, const uint8_t *p, const uint8_t *end)
+{
+    char topic[256], prefix[256], payload[1024], expect[256], what[300], key[64];
+    if (!mqtt_get_string(&p, end, topic, sizeof(topic))) {
+        mqtt_bench_expect(b, false, "PUBLISH topic");
+        return;
+    }
+    snprintf(payload, sizeof(payload), "%.*s", static_cast<int>(end - p), reinterpret_cast<const char *>(p));
+    size_t tlen = strlen(topic);
+
+    if (!(flags & 1)) {
+        snprintf(what, sizeof(what), "PUBLISH to %s is retained", topic);
+        mqtt_bench_expect(b, false, what);
+    }
+
+    snprintf(prefix, sizeof(prefix), "%s/sensor/%s/", mqtt_discovery, mqtt_node);
+    snprintf(expect, sizeof(expect), "\"state_topic\":\"%s/state\"", mqtt_topic);
+    if (strncmp(topic, mqtt_topic, strlen(mqtt_topic)) == 0 && strcmp(topic + strlen(mqtt_topic), "/status") == 0) {
+        if (strcmp(payload, "online") == 0) ++b->online;
+        else if (strcmp(payload, "offline") == 0) ++b->offline;
+        else mqtt_bench_expect(b, false, "status is \"online\" or \"offline\"");
+    } else if (strncmp(topic, mqtt_topic, strlen(mqtt_topic)) == 0 && strcmp(topic + strlen(mqtt_topic), "/state") == 0) {
+        bool helpers = strstr(payload, ",\"gpu_0\":") && strstr(payload, ",\"a_b\":");
+        if (payload[0] == '{' && mqtt_bench_json(payload) && helpers) ++b->states;
+        else mqtt_bench_expect(b, false, "state is a JSON object keyed by clean sensor names");
+    } else if (mqtt_discovery[0] && strncmp(topic, prefix, strlen(prefix)) == 0 && tlen > 7 && strcmp(topic + tlen - 7, "/config") == 0) {
+        if (strstr(payload, expect) && mqtt_bench_json(payload)) ++b->discovery;
+        else mqtt_bench_expect(b, false, "discovery config is JSON and points at <topic>/state");
+
+        // The helpers: key in the topic, unique id and template, the name escaped
+        static const char *helpers[][2] = { { "gpu_0", "gpu-0 temperature" }, { "a_b", "a\\\"b temperature" } };
+        for (int i = 0; i < 2; ++i) {
+            snprintf(key, sizeof(key), "/%s/config", helpers[i][0]);
+            if (strcmp(topic + tlen - strlen(key), key) != 0) continue;
+            snprintf(expect, sizeof(expect), "{\"name\":\"%s\",\"unique_id\":\"%s_%s\"", helpers[i][1], mqtt_node, helpers[i][0]);
+            snprintf(what, sizeof(what), "\"{{ value_json.%s }}\"", helpers[i][0]);
+            if (strncmp(payload, expect, strlen(expect)) == 0 && strstr(payload, what)) ++b->helpers;
+        }
+    } else {
+        snprintf(what, sizeof(what), "PUBLISH to %s is expected", topic);
+        mqtt_bench_expect(b, false, what);
+    }
+}
+
+// Accept the client, read what it sent, and answer CONNECT and PINGREQ
+void mqtt_bench_serve(struct mqtt_bench_broker *b)
+{
+    if (b->fd < 0) {
+        b->fd = accept4(b->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (b->fd < 0) return;
+        b->waited = latency_clock() - b->dropped_at;
+        b->in_len = 0;
+        b->online = b->offline = b->discovery = b->states = b->pings = b->disconnects = b->helpers = 0;
+        ++b->connects;
+    }
+
+    ssize_t n;
+    while ((n = recv(b->fd, b->in + b->in_len, sizeof(b->in) - b->in_len, MSG_DONTWAIT)) > 0) b->in_len += n;
+
+    for (;;) {
+        const uint8_t *p = b->in + 1;
+        unsigned long len;
+        if (b->in_len < 2 || !get_varint(&p, b->in + b->in_len, &len)) break;
+        size_t total = (p - b->in) + len;
+        if (b->in_len < total) break;
+
+        uint8_t type = b->in[0] >> 4;
+        if (type == 1) {
+            mqtt_bench_connect(b, p, b->in + total);
+            uint8_t connack[4] = { 0x20, 2, 0, static_cast<uint8_t>(b->refuse ? 5 : 0) };
+            send(b->fd, connack, sizeof(connack), MSG_NOSIGNAL);
+            if (b->refuse) b->dropped_at = latency_clock();
+        } else if (type == 3) {
+            mqtt_bench_publish(b, b->in[0] & 0x0f, p, b->in + total);
+        } else if (type == 12) {
+            uint8_t pingresp[2] = { 0xd0, 0 };
+            send(b->fd, pingresp, sizeof(pingresp), MSG_NOSIGNAL);
+            ++b->pings;
+        } else if (type == 14) {
+            ++b->disconnects;
+        } else {
+            mqtt_bench_expect(b, false, "only CONNECT, PUBLISH, PINGREQ and DISCONNECT are sent");
+        }
+
+        b->in_len -= total;
+        memmove(b->in, b->in + total, b->in_len);
+    }
+
+    if (n == 0) {
+        close(b->fd);
+        b->fd = -1;
+        ++b->closes;
+    }
+}
+
+// Run client and broker until *counter reaches target, false after seconds
+bool mqtt_bench_run(struct mqtt_bench_broker *b, const int *counter, int target, double seconds)
+{
+    double until = latency_clock() + seconds;
+    while (*counter < target) {
+        if (latency_clock() > until) return false;
+        mqtt_service();
+        mqtt_bench_serve(b);
+        poll(NULL, 0, 5);
+    }
+    return true;
+}
+
+void mqtt_bench_cycle(struct mqtt_bench_broker *b, int cycles)
+{
+    int states = b->states + cycles;
+    for (int i = 0; i < cycles; ++i) mqtt_publish_state(128, 40);
+    mqtt_bench_run(b, &b->states, states, 2);
+}
+
+int mqtt_benchmark()
+{
+    static struct mqtt_bench_broker b;
+    static char server[32];
+    char what[128];
+
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    b.fd = -1;
+    b.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (b.listen_fd < 0 || bind(b.listen_fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0 ||
+        listen(b.listen_fd, 4) < 0 || getsockname(b.listen_fd, reinterpret_cast<struct sockaddr *>(&addr), &addrlen) < 0) {
+        printf("Error: Could not listen on loopback: %s\n", strerror(errno));
+        return 1;
+    }
+
+    // The test needs a short keepalive and credentials to check
+    snprintf(server, sizeof(server), "127.0.0.1:%d", ntohs(addr.sin_port));
+    mqtt_server = server;
+    snprintf(mqtt_node, sizeof(mqtt_node), "fancontrol_bench");
+    if (!mqtt_topic) mqtt_topic = "fancontrol/bench";
+    if (!mqtt_user) mqtt_user = "fancontrol";
+    if (!mqtt_password) mqtt_password = "bench";
+    mqtt_keepalive = 1;
+    for (int i = 0; i < 4; ++i) {
+        char name[16];
+        snprintf(name, sizeof(name), "bay%d", i);
+        struct sensor *s = add_sensor(name, SENSOR_DRIVE, setpoint);
+        if (!s) return 1;
+        s->temp = 35 + i;
+    }
+    // Helper names are not restricted, they must not break JSON or templates
+    add_sensor("gpu-0", SENSOR_HELPER, setpoint)->temp = 50;
+    add_sensor("a\"b", SENSOR_HELPER, setpoint)->temp = 45;
+
+    // 1: three cycles, a drive that shows up later, two pings, then the broker hangs up
+    mqtt_bench_expect(&b, mqtt_bench_run(&b, &mqtt_state, MQTT_UP, 2), "connection 1 is up");
+    mqtt_bench_cycle(&b, 3);
+    add_sensor("bay4", SENSOR_DRIVE, setpoint)->temp = 39;
+    mqtt_bench_cycle(&b, 1);
+    int announced = mqtt_discovery[0] ? 2 + FAN_COUNT + sensor_count : 0;
+    snprintf(what, sizeof(what), "%d discovery configs, one per value, the late drive included", announced);
+    mqtt_bench_expect(&b, b.online == 1 && b.states == 4 && b.discovery == announced, what);
+    mqtt_bench_expect(&b, b.helpers == 2, "helpers gpu-0 and a\"b keyed gpu_0 and a_b, names escaped");
+    mqtt_bench_expect(&b, mqtt_bench_run(&b, &b.pings, 2, 3 * mqtt_keepalive), "PINGREQ when idle, again after the PINGRESP");
+    close(b.fd);
+    b.fd = -1;
+    b.dropped_at = latency_clock();
+
+    // 2: refused, after the backoff of 1 s
+    b.refuse = true;
+    mqtt_bench_run(&b, &b.connects, 2, 3);
+    snprintf(what, sizeof(what), "reconnect after %.2f s, backoff 1 s", b.waited);
+    mqtt_bench_expect(&b, b.connects == 2 && b.waited >= 1 && b.waited < 1.5, what);
+    mqtt_bench_run(&b, &b.closes, 1, 2);
+    mqtt_bench_expect(&b, b.closes == 1 && mqtt_state == MQTT_IDLE, "refused connection given up");
+
+    // 3: accepted after twice the backoff, announces everything again, says goodbye
+    b.refuse = false;
+    mqtt_bench_run(&b, &b.connects, 3, 4);
+    snprintf(what, sizeof(what), "reconnect after %.2f s, backoff 2 s", b.waited);
+    mqtt_bench_expect(&b, b.connects == 3 && b.waited >= 2 && b.waited < 2.5, what);
+    mqtt_bench_run(&b, &mqtt_state, MQTT_UP, 2);
+    mqtt_bench_cycle(&b, 2);
+    snprintf(what, sizeof(what), "%d discovery configs again on the new connection", announced);
+    mqtt_bench_expect(&b, b.online == 1 && b.states == 2 && b.discovery == announced && b.helpers == 2, what);
+    mqtt_disconnect();
+    mqtt_bench_run(&b, &b.closes, 2, 2);
+    mqtt_bench_expect(&b, b.offline == 1 && b.disconnects == 1, "\"offline\" and DISCONNECT when stopping");
+
+    printf("MQTT loopback: %d connections, %ld publishes dropped, %d failed checks\n", b.connects, mqtt_dropped, b.failures);
+    close(b.listen_fd);
+    return b.failures == 0 && mqtt_dropped == 0 ? 0 : 1;
+}
+
+// SNMP (--agentx), as an AgentX subagent (RFC 2741) of the local snmpd, which needs
+// "master agentx" in snmpd.conf. The daemon registers FANCONTROL-MIB and answers Get,
+// GetNext and GetBulk from a snapshot taken once per cycle, so SNMP walks never touch
+// the drives or the EC. The MIB has controller scalars, a sensor table and a fan table:
+//
+//   .1.3.6.1.4.1.8072.9999.9999.8613.1.<n>.0          pwm, maxtemp, setpoint, ...
+//   .1.3.6.1.4.1.8072.9999.9999.8613.2.1.<col>.<i>    sensor i (from 1)
+//   .1.3.6.1.4.1.8072.9999.9999.8613.3.1.<col>.<i>    fan i
+//
+// FANCONTROL-MIB.txt describes the columns. The subtree sits in Net-SNMP's playpen
+// for local experiments, the same OIDs are served on every box. Like the MQTT client,
+// the socket is non-blocking and connecting, opening and registering are driven from
+// the idle loop.
+#define AGENTX_TIMEOUT 10    // Seconds to connect, open and register
+#define AGENTX_OID_MAX 16
+#define AGENTX_HEADER 20
+#define AGENTX_NETWORK_BYTE_ORDER 0x10
+#define AGENTX_NON_DEFAULT_CONTEXT 0x08
+
+enum agentx_pdu { AGENTX_OPEN = 1, AGENTX_CLOSE, AGENTX_REGISTER, AGENTX_UNREGISTER, AGENTX_GET, AGENTX_GETNEXT,
+                  AGENTX_GETBULK, AGENTX_TESTSET, AGENTX_COMMITSET, AGENTX_UNDOSET, AGENTX_CLEANUPSET,
+                  AGENTX_RESPONSE = 18 };
+enum agentx_type { AGENTX_INTEGER = 2, AGENTX_OCTETS = 4, AGENTX_GAUGE = 66, AGENTX_NO_SUCH_OBJECT = 128,
+                   AGENTX_NO_SUCH_INSTANCE = 129, AGENTX_END_OF_MIB = 130 };
+enum agentx_state { AGENTX_IDLE, AGENTX_CONNECTING, AGENTX_OPENING, AGENTX_REGISTERING, AGENTX_UP };
+
+struct agentx_object {
+    uint32_t oid[AGENTX_OID_MAX];
+    int len;
+    int type;
+    long value;
+    const char *str;
+};
+
+static const uint32_t agentx_base[] = { 1, 3, 6, 1, 4, 1, 8072, 9999, 9999, 8613 };
+#define AGENTX_BASE_LEN 10
+
+static int agentx_sockfd = -1;
+static int agentx_state = AGENTX_IDLE;
+static uint32_t agentx_session = 0;
+static uint32_t agentx_packet = 0;     // Id of our last Open or Register
+static double agentx_since = 0;      // Start of the current connection attempt
+static double agentx_retry_at = 0;
+static double agentx_backoff = 1;
+static double agentx_wake_at = 0;    // Next timer check from the idle loop
+static double agentx_started = 0;
+static struct fancontrol_shm agentx_snapshot;
+static struct agentx_object agentx_objects[16 + FANCONTROL_SHM_SENSORS * 8 + FANCONTROL_SHM_FANS * 8];
+static int agentx_object_count = 0;    // Sorted by OID
+static uint8_t agentx_in[65536];
+static size_t agentx_in_len = 0;
+static uint8_t agentx_out[65536];
+
+void agentx_add(int group, int column, int index, int type, long value, const char *str)
+{
+    struct agentx_object *o = &agentx_objects[agentx_object_count++];
+    memcpy(o->oid, agentx_base, sizeof(agentx_base));
+    o->len = AGENTX_BASE_LEN;
+    o->oid[o->len++] = group;
+    if (group > 1) o->oid[o->len++] = 1; // Table entry
+    o->oid[o->len++] = column;
+    o->oid[o->len++] = index;
+    o->type = type;
+    o->value = value;
+    o->str = str;
+}
+
+// Take the snapshot and lay it out in OID order: scalars, then the tables column by column
+void agentx_update(int pwm, int maxtemp, double error)
+{
+    struct fancontrol_shm *s = &agentx_snapshot;
+    fill_state(s, pwm, maxtemp, error);
+
+    agentx_object_count = 0;
+    agentx_add(1, 1, 0, AGENTX_INTEGER, s->pwm, NULL);
+    agentx_add(1, 2, 0, AGENTX_INTEGER, s->maxtemp, NULL);
+    agentx_add(1, 3, 0, AGENTX_INTEGER, static_cast<long>(s->setpoint * 10 + (s->setpoint < 0 ? -0.5 : 0.5)), NULL);
+    agentx_add(1, 4, 0, AGENTX_GAUGE, s->throttle, NULL);
+    agentx_add(1, 5, 0, AGENTX_INTEGER, s->maintenance ? 1 : 2, NULL);
+    agentx_add(1, 6, 0, AGENTX_GAUGE, static_cast<long>(s->cpu_power * 1000), NULL);
+    agentx_add(1, 7, 0, AGENTX_INTEGER, s->sensor_count, NULL);
+    agentx_add(1, 8, 0, AGENTX_INTEGER, s->fan_count, NULL);
+    agentx_add(1, 9, 0, AGENTX_INTEGER, static_cast<long>(s->updated), NULL);
+
+    for (int col = 2; col <= 8; ++col) {
+        for (int i = 0; i < s->sensor_count; ++i) {
+            const struct fancontrol_shm_sensor *v = &s->sensors[i];
+            long values[9] = { 0, 0, 0, v->kind + 1, v->temp, v->setpoint, v->present ? 1 : 2, v->breaker + 1,
+                               static_cast<long>(v->updated) };
+            agentx_add(2, col, i + 1, col == 2 ? AGENTX_OCTETS : AGENTX_INTEGER, values[col], v->name);
+        }
+    }
+
+    for (int col = 2; col <= 7; ++col) {
+        for (int i = 0; i < s->fan_count; ++i) {
+            const struct fancontrol_shm_fan *v = &s->fans[i];
+            long values[8] = { 0, 0, 0, v->pwm, v->target, v->rpm, v->state + 1, v->alarm ? 1 : 2 };
+            agentx_add(3, col, i + 1, col == 2 ? AGENTX_OCTETS : col == 5 ? AGENTX_GAUGE : AGENTX_INTEGER, values[col], v->name);
+        }
+    }
+}
+
+int oid_compare(const uint32_t *a, int alen, const uint32_t *b, int blen)
+{
+    for (int i = 0; i < alen && i < blen; ++i) {
+        if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+    }
+    return alen == blen ? 0 : alen < blen ? -1 : 1;
+}
+
+uint32_t agentx_get32(const uint8_t *p, bool be)
+{
+    return be ? (static_cast<uint32_t>(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3])
+              : (static_cast<uint32_t>(p[3]) << 24 | p[2] << 16 | p[1] << 8 | p[0]);
+}
+
+void agentx_put32(uint8_t *p, uint32_t v)
+{
+    p[0] = static_cast<uint8_t>(v >> 24);
+    p[1] = static_cast<uint8_t>(v >> 16);
+    p[2] = static_cast<uint8_t>(v >> 8);
+    p[3] = static_cast<uint8_t>(v);
+}
+
+// Returns the encoded length, 0 when the OID is malformed
+size_t agentx_get_oid(const uint8_t *p, const uint8_t *end, bool be, uint32_t *oid, int *len, bool *include)
+{
+    if (end - p < 4) return 0;
+    int n = p[0], prefix = p[1];
+    if (include) *include = p[2] != 0;
+    if (end - p < 4 + 4 * n || n + (prefix ? 5 : 0) > AGENTX_OID_MAX) return 0;
+
+    *len = 0;
+    if (prefix) {
+        const uint32_t internet[] = { 1, 3, 6, 1 };
+        memcpy(oid, internet, sizeof(internet));
+        oid[4] = prefix;
+        *len = 5;
+    }
+    for (int i = 0; i < n; ++i) oid[(*len)++] = agentx_get32(p + 4 + 4 * i, be);
+    return 4 + 4 * n;
+}
+
+size_t agentx_put_oid(uint8_t *p, const uint32_t *oid, int len)
+{
+    p[0] = static_cast<uint8_t>(len);
+    p[1] = p[2] = p[3] = 0;
+    for (int i = 0; i < len; ++i) agentx_put32(p + 4 + 4 * i, oid[i]);
+    return 4 + 4 * len;
+}
+
+size_t agentx_put_octets(uint8_t *p, const char *s, size_t len)
+{
+    agentx_put32(p, static_cast<uint32_t>(len));
+    memcpy(p + 4, s, len);
+    while (len % 4) p[4 + len++] = 0;
+    return 4 + len;
+}
+
+size_t agentx_put_header(uint8_t *p, int type, uint32_t session, uint32_t transaction, uint32_t packet)
+{
+    memset(p, 0, AGENTX_HEADER);
+    p[0] = 1;
+    p[1] = static_cast<uint8_t>(type);
+    p[2] = AGENTX_NETWORK_BYTE_ORDER;
+    agentx_put32(p + 4, session);
+    agentx_put32(p + 8, transaction);
+    agentx_put32(p + 12, packet);
+    return AGENTX_HEADER;
+}
+
+// Set the payload length and send, a local snmpd is always ready to read
+void agentx_send(size_t len)
+{
+    agentx_put32(agentx_out + 16, static_cast<uint32_t>(len - AGENTX_HEADER));
+    if (send(agentx_sockfd, agentx_out, len, MSG_DONTWAIT | MSG_NOSIGNAL) != static_cast<ssize_t>(len) && debug)
+        printf("AgentX: could not send %zu bytes\n", len);
+}
+
+size_t agentx_put_varbind(uint8_t *p, const uint32_t *oid, int len, const struct agentx_object *o, int exception)
+{
+    size_t n = 0;
+    int type = o ? o->type : exception;
+    p[n++] = static_cast<uint8_t>(type >> 8);
+    p[n++] = static_cast<uint8_t>(type);
+    p[n++] = 0;
+    p[n++] = 0;
+    n += o ? agentx_put_oid(p + n, o->oid, o->len) : agentx_put_oid(p + n, oid, len);
+
+    if (type == AGENTX_OCTETS) {
+        n += agentx_put_octets(p + n, o->str, strlen(o->str));
+    } else if (type == AGENTX_INTEGER || type == AGENTX_GAUGE) {
+        agentx_put32(p + n, static_cast<uint32_t>(o->value));
+        n += 4;
+    }
+    return n;
+}
+
+// First object after oid, or at it with include, and before end unless end is empty
+const struct agentx_object *agentx_next(const uint32_t *oid, int len, bool include, const uint32_t *end, int endlen)
+{
+    int lo = 0, hi = agentx_object_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int c = oid_compare(agentx_objects[mid].oid, agentx_objects[mid].len, oid, len);
+        if (c < 0 || (c == 0 && !include)) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == agentx_object_count) return NULL;
+
+    const struct agentx_object *o = &agentx_objects[lo];
+    if (endlen > 0 && oid_compare(o->oid, o->len, end, endlen) >= 0) return NULL;
+    return o;
+}
+
+int agentx_get(const uint32_t *oid, int len, const struct agentx_object **found)
+{
+    *found = agentx_next(oid, len, true, NULL, 0);
+    if (*found && oid_compare((*found)->oid, (*found)->len, oid, len) == 0) return 0;
+    *found = NULL;
+
+    // A known column or scalar without that instance
+    const struct agentx_object *o = len > 1 ? agentx_next(oid, len - 1, true, NULL, 0) : NULL;
+    bool column = o && o->len == len && oid_compare(o->oid, len - 1, oid, len - 1) == 0;
+    return column ? AGENTX_NO_SUCH_INSTANCE : AGENTX_NO_SUCH_OBJECT;
+}
+
+// Answer a Get, GetNext or GetBulk
+void agentx_answer(int type, const uint8_t *p, const uint8_t *end, bool be, const uint8_t *header)
+{
+    size_t n = agentx_put_header(agentx_out, AGENTX_RESPONSE, agentx_get32(header + 4, be), agentx_get32(header + 8, be),
+                                 agentx_get32(header + 12, be));
+    agentx_put32(agentx_out + n, static_cast<uint32_t>((latency_clock() - agentx_started) * 100));
+    memset(agentx_out + n + 4, 0, 4); // No error
+    n += 8;
+
+    int non_repeaters = 0, repetitions = 1;
+    if (type == AGENTX_GETBULK) {
+        if (end - p < 4) return;
+        non_repeaters = be ? p[0] << 8 | p[1] : p[1] << 8 | p[0];
+        repetitions = be ? p[2] << 8 | p[3] : p[3] << 8 | p[2];
+        p += 4;
+    }
+
+    // Search ranges
+    uint32_t start[32][AGENTX_OID_MAX], stop[32][AGENTX_OID_MAX];
+    int start_len[32], stop_len[32], ranges = 0;
+    bool include[32];
+    while (p < end && ranges < 32) {
+        size_t a = agentx_get_oid(p, end, be, start[ranges], &start_len[ranges], &include[ranges]);
+        size_t b = a ? agentx_get_oid(p + a, end, be, stop[ranges], &stop_len[ranges], NULL) : 0;
+        if (!b) return;
+        p += a + b;
+        ++ranges;
+    }
+
+    for (int rep = 0; rep < (type == AGENTX_GETBULK ? repetitions : 1); ++rep) {
+        bool more = false;
+        for (int r = rep == 0 ? 0 : non_repeaters; r < ranges; ++r) {
+            // Leave room for a varbind with the longest OID and name
+            if (n > sizeof(agentx_out) - 256) break;
+
+            const struct agentx_object *o;
+            int exception = 0;
+            if (type == AGENTX_GET) {
+                exception = agentx_get(start[r], start_len[r], &o);
+            } else {
+                o = agentx_next(start[r], start_len[r], include[r], stop[r], stop_len[r]);
+                if (!o) exception = AGENTX_END_OF_MIB;
+            }
+            n += agentx_put_varbind(agentx_out + n, start[r], start_len[r], o, exception);
+
+            // The next repetition continues after this object
+            if (o && r >= non_repeaters) {
+                memcpy(start[r], o->oid, o->len * sizeof(uint32_t));
+                start_len[r] = o->len;
+                include[r] = false;
+                more = true;
+            }
+        }
+        if (!more) break;
+    }
+
+    agentx_send(n);
+}
+
+void agentx_drop(const char *reason)
+{
+    printf("AgentX master %s: %s, retrying in %.0f s\n", agentx_master, reason, agentx_backoff);
+    if (agentx_sockfd >= 0) close(agentx_sockfd);
+    agentx_sockfd = -1;
+    agentx_state = AGENTX_IDLE;
+    agentx_retry_at = latency_clock() + agentx_backoff;
+    agentx_backoff = agentx_backoff * 2 < 60 ? agentx_backoff * 2 : 60;
+}
+
+void agentx_send_open()
+{
+    // Open: 5 s timeout, no subagent OID, a description
+    static const char descr[] = "fancontrol";
+    size_t n = agentx_put_header(agentx_out, AGENTX_OPEN, 0, 0, ++agentx_packet);
+    agentx_out[n] = 5;
+    agentx_out[n + 1] = agentx_out[n + 2] = agentx_out[n + 3] = 0;
+    n += 4;
+    n += agentx_put_oid(agentx_out + n, NULL, 0);
+    n += agentx_put_octets(agentx_out + n, descr, sizeof(descr) - 1);
+    agentx_in_len = 0;
+    agentx_state = AGENTX_OPENING;
+    agentx_send(n);
+}
+
+void agentx_connect(double now)
+{
+    struct sockaddr_storage storage;
+    socklen_t addrlen;
+    memset(&storage, 0, sizeof(storage));
+
+    // A path, or <ip:port> for a master on TCP
+    const char *colon = strrchr(agentx_master, ':');
+    if (agentx_master[0] != '/' && colon) {
+        char host[64];
+        struct sockaddr_in *addr = reinterpret_cast<struct sockaddr_in *>(&storage);
+        addr->sin_family = AF_INET;
+        addr->sin_port = htons(atoi(colon + 1));
+        snprintf(host, sizeof(host), "%.*s", static_cast<int>(colon - agentx_master), agentx_master);
+        if (inet_pton(AF_INET, host, &addr->sin_addr) <= 0) {
+            agentx_drop("invalid address, expected a path or <ip:port>");
+            return;
+        }
+        addrlen = sizeof(*addr);
+    } else {
+        struct sockaddr_un *addr = reinterpret_cast<struct sockaddr_un *>(&storage);
+        addr->sun_family = AF_UNIX;
+        snprintf(addr->sun_path, sizeof(addr->sun_path), "%s", agentx_master);
+        addrlen = sizeof(*addr);
+    }
+
+    agentx_sockfd = socket(storage.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (agentx_sockfd < 0) {
+        agentx_drop(strerror(errno));
+        return;
+    }
+
+    agentx_since = now;
+    if (connect(agentx_sockfd, reinterpret_cast<struct sockaddr *>(&storage), addrlen) == 0) {
+        agentx_send_open();
+    } else if (errno == EINPROGRESS) {
+        agentx_state = AGENTX_CONNECTING;
+    } else {
+        agentx_drop(strerror(errno));
+    }
+}
+
+void agentx_handle(const uint8_t *pdu, size_t len)
+{
+    bool be = pdu[2] & AGENTX_NETWORK_BYTE_ORDER;
+    const uint8_t *p = pdu + AGENTX_HEADER, *end = pdu + len;
+    int type = pdu[1];
+
+    // Only the default context is registered, skip the context of a request
+    if ((pdu[2] & AGENTX_NON_DEFAULT_CONTEXT) && type != AGENTX_RESPONSE) {
+        if (end - p < 4) return;
+        p += 4 + ((agentx_get32(p, be) + 3) & ~3u);
+        if (p > end) return;
+    }
+
+    if (type == AGENTX_RESPONSE) {
+        if (end - p < 8 || agentx_get32(pdu + 12, be) != agentx_packet) return;
+        int error = be ? p[4] << 8 | p[5] : p[5] << 8 | p[4];
+        if (error) {
+            char reason[48];
+            snprintf(reason, sizeof(reason), "%s refused (error %d)", agentx_state == AGENTX_OPENING ? "open" : "register", error);
+            agentx_drop(reason);
+        } else if (agentx_state == AGENTX_OPENING) {
+            // Register the subtree: no timeout override, default priority
+            agentx_session = agentx_get32(pdu + 4, be);
+            size_t n = agentx_put_header(agentx_out, AGENTX_REGISTER, agentx_session, 0, ++agentx_packet);
+            agentx_out[n] = 0;
+            agentx_out[n + 1] = 127;
+            agentx_out[n + 2] = agentx_out[n + 3] = 0;
+            n += 4;
+            n += agentx_put_oid(agentx_out + n, agentx_base, AGENTX_BASE_LEN);
+            agentx_state = AGENTX_REGISTERING;
+            agentx_send(n);
+        } else if (agentx_state == AGENTX_REGISTERING) {
+            if (debug) printf("Registered with AgentX master %s\n", agentx_master);
+            agentx_state = AGENTX_UP;
+            agentx_backoff = 1;
+        }
+    } else if (type == AGENTX_GET || type == AGENTX_GETNEXT || type == AGENTX_GETBULK) {
+        agentx_answer(type, p, end, be, pdu);
+    } else if (type == AGENTX_TESTSET || type == AGENTX_COMMITSET || type == AGENTX_UNDOSET) {
+        // Everything is read-only
+        size_t n = agentx_put_header(agentx_out, AGENTX_RESPONSE, agentx_get32(pdu + 4, be), agentx_get32(pdu + 8, be),
+                                     agentx_get32(pdu + 12, be));
+        agentx_put32(agentx_out + n, static_cast<uint32_t>((latency_clock() - agentx_started) * 100));
+        agentx_out[n + 4] = 0;
+        agentx_out[n + 5] = type == AGENTX_TESTSET ? 17 : 0; // notWritable
+        agentx_out[n + 6] = 0;
+        agentx_out[n + 7] = type == AGENTX_TESTSET ? 1 : 0;
+        agentx_send(n + 8);
+    } else if (type == AGENTX_CLOSE) {
+        agentx_drop("closed by master");
+    }
+}
+
+// Advance the connection without blocking, and answer whatever the master sent
+void agentx_service()
+{
+    double now = latency_clock();
+    agentx_wake_at = now + 1;
+
+    if (agentx_state == AGENTX_IDLE) {
+        if (now < agentx_retry_at) return;
+        agentx_connect(now);
+    }
+
+    if (agentx_state == AGENTX_CONNECTING) {
+        struct pollfd pfd = { agentx_sockfd, POLLOUT, 0 };
+        if (poll(&pfd, 1, 0) <= 0) {
+            if (now - agentx_since > AGENTX_TIMEOUT) agentx_drop("connection timed out");
+            return;
+        }
+
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(agentx_sockfd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            agentx_drop(strerror(err));
+            return;
+        }
+        agentx_send_open();
+    }
+
+    if (agentx_state == AGENTX_IDLE) return;
+    if (agentx_state < AGENTX_UP && now - agentx_since > AGENTX_TIMEOUT) {
+        agentx_drop(agentx_state == AGENTX_OPENING ? "no response to open" : "no response to register");
+        return;
+    }
+
+    ssize_t n;
+    while ((n = recv(agentx_sockfd, agentx_in + agentx_in_len, sizeof(agentx_in) - agentx_in_len, MSG_DONTWAIT)) > 0) {
+        agentx_in_len += n;
+
+        while (agentx_in_len >= AGENTX_HEADER) {
+            size_t len = AGENTX_HEADER + agentx_get32(agentx_in + 16, agentx_in[2] & AGENTX_NETWORK_BYTE_ORDER);
+            if (agentx_in[0] != 1 || len > sizeof(agentx_in)) {
+                agentx_drop("bad PDU");
+                return;
+            }
+            if (agentx_in_len < len) break;
+
+            agentx_handle(agentx_in, len);
+            if (agentx_sockfd < 0) return;
+            agentx_in_len -= len;
+            memmove(agentx_in, agentx_in + len, agentx_in_len);
+        }
+    }
+
+    if (n == 0) agentx_drop("connection closed");
+    else if (errno != EAGAIN && errno != EINTR) agentx_drop(strerror(errno));
+}
+
+// Loopback test (--agentx_bench): a stand-in master in the same process, first on TCP
+// and then on a Unix socket. It checks the Open and the Register, walks the subtree
+// with GetNext, then sends a Get, a GetBulk and a TestSet. Finally it closes the
+// session, and the client must come back after its backoff.
+struct agentx_bench_master {
+    int listen_fd, fd;
+    uint8_t in[65536], pdu[65536], out[4096];
+    size_t in_len, pdu_len;
+    uint32_t packet;
+    int failures;
+};
+
+void agentx_bench_expect(struct agentx_bench_master *m, bool ok, const char *what)
+{
+    printf("%-4s %s\n", ok ? "ok" : "FAIL", what);
+    if (!ok) ++m->failures;
+}
+
+// Run the client until it has sent a whole PDU, false after seconds
+bool agentx_bench_receive(struct agentx_bench_master *m, double seconds)
+{
+    double until = latency_clock() + seconds;
+    for (;;) {
+        if (m->fd < 0) m->fd = accept4(m->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (m->fd >= 0) {
+            ssize_t n = recv(m->fd, m->in + m->in_len, sizeof(m->in) - m->in_len, MSG_DONTWAIT);
+            if (n > 0) m->in_len += n;
+
+            size_t len = m->in_len >= AGENTX_HEADER ? AGENTX_HEADER + agentx_get32(m->in + 16, m->in[2] & AGENTX_NETWORK_BYTE_ORDER) : 0;
+            if (len > 0 && len <= sizeof(m->pdu) && m->in_len >= len) {
+                memcpy(m->pdu, m->in, len);
+                m->pdu_len = len;
+                m->in_len -= len;
+                memmove(m->in, m->in + len, m->in_len);
+                return true;
+            }
+        }
+        if (latency_clock() > until) return false;
+        agentx_service();
+        poll(NULL, 0, 2);
+    }
+}
+
+// Send a PDU from the master, in network byte order
+void agentx_bench_send(struct agentx_bench_master *m, size_t len)
+{
+    agentx_put32(m->out + 16, static_cast<uint32_t>(len - AGENTX_HEADER));
+    if (send(m->fd, m->out, len, MSG_NOSIGNAL) != static_cast<ssize_t>(len)) agentx_bench_expect(m, false, "master can send");
+}
+
+// Answer the Open or Register the client just sent
+void agentx_bench_respond(struct agentx_bench_master *m, uint32_t session)
+{
+    size_t n = agentx_put_header(m->out, AGENTX_RESPONSE, session, agentx_get32(m->pdu + 8, true), agentx_get32(m->pdu + 12, true));
+    memset(m->out + n, 0, 8);
+    agentx_bench_send(m, n + 8);
+}
+
+// Start a request of the master, returns the offset of its payload
+size_t agentx_bench_request(struct agentx_bench_master *m, int type)
+{
+    return agentx_put_header(m->out, type, 42, 1, ++m->packet);
+}
+
+size_t agentx_bench_oid(uint8_t *p, const uint32_t *suffix, int n, bool include)
+{
+    uint32_t oid[AGENTX_OID_MAX];
+    memcpy(oid, agentx_base, sizeof(agentx_base));
+    memcpy(oid + AGENTX_BASE_LEN, suffix, n * sizeof(uint32_t));
+    size_t len = agentx_put_oid(p, oid, AGENTX_BASE_LEN + n);
+    p[2] = include ? 1 : 0;
+    return len;
+}
+
+// Wait for the response to the last request, returns its error status or -1
+int agentx_bench_response(struct agentx_bench_master *m, const uint8_t **p, const uint8_t **end)
+{
+    if (!agentx_bench_receive(m, 2) || m->pdu[1] != AGENTX_RESPONSE || m->pdu_len < AGENTX_HEADER + 8 ||
+        agentx_get32(m->pdu + 12, true) != m->packet) return -1;
+    *p = m->pdu + AGENTX_HEADER + 8;
+    *end = m->pdu + m->pdu_len;
+    return m->pdu[AGENTX_HEADER + 4] << 8 | m->pdu[AGENTX_HEADER + 5];
+}
+
+// Decode one varbind of a response, NULL when it is malformed
+const uint8_t *agentx_bench_varbind(const uint8_t *p, const uint8_t *end, struct agentx_object *o, char *str, size_t size)
+{
+    if (end - p < 4) return NULL;
+    o->type = p[0] << 8 | p[1];
+    size_t n = agentx_get_oid(p + 4, end, true, o->oid, &o->len, NULL);
+    if (!n) return NULL;
+    p += 4 + n;
+
+    str[0] = '\0';
+    if (o->type == AGENTX_INTEGER || o->type == AGENTX_GAUGE) {
+        if (end - p < 4) return NULL;
+        o->value = static_cast<int32_t>(agentx_get32(p, true));
+        p += 4;
+    } else if (o->type == AGENTX_OCTETS) {
+        if (end - p < 4) return NULL;
+        size_t len = agentx_get32(p, true);
+        if (static_cast<size_t>(end - p) < 4 + ((len + 3) & ~3u)) return NULL;
+        snprintf(str, size, "%.*s", static_cast<int>(len), reinterpret_cast<const char *>(p + 4));
+        p += 4 + ((len + 3) & ~3u);
+    }
+    return p;
+}
+
+// Check the next varbind of a response against the object at suffix
+bool agentx_bench_check(const uint8_t **p, const uint8_t *end, const uint32_t *suffix, int n, int type, long value, const char *str)
+{
+    struct agentx_object o;
+    char got[128];
+    *p = *p ? agentx_bench_varbind(*p, end, &o, got, sizeof(got)) : NULL;
+    if (!*p) return false;
+
+    uint32_t oid[AGENTX_OID_MAX];
+    memcpy(oid, agentx_base, sizeof(agentx_base));
+    memcpy(oid + AGENTX_BASE_LEN, suffix, n * sizeof(uint32_t));
+    return oid_compare(o.oid, o.len, oid, AGENTX_BASE_LEN + n) == 0 && o.type == type &&
+           (type == AGENTX_OCTETS ? strcmp(got, str) == 0 : type == AGENTX_INTEGER || type == AGENTX_GAUGE ? o.value == value : true);
+}
+
+int agentx_bench_session(struct agentx_bench_master *m, const char *transport)
+{
+    const uint8_t *p, *end;
+    char what[128];
+    size_t n;
+
+    // The first call only starts connecting
+    agentx_service();
+    bool ok = agentx_sockfd >= 0 && (fcntl(agentx_sockfd, F_GETFL) & O_NONBLOCK) &&
+              (agentx_state == AGENTX_CONNECTING || agentx_state == AGENTX_OPENING);
+    agentx_bench_expect(m, ok, "non-blocking connect, not waiting for the master");
+
+    ok = agentx_bench_receive(m, 2) && m->pdu[0] == 1 && m->pdu[1] == AGENTX_OPEN && (m->pdu[2] & AGENTX_NETWORK_BYTE_ORDER);
+    p = m->pdu + AGENTX_HEADER;
+    end = m->pdu + m->pdu_len;
+    ok = ok && end - p >= 16 && p[0] == 5 && p[4] == 0 && agentx_get32(p + 8, true) == 10 && memcmp(p + 12, "fancontrol", 10) == 0;
+    agentx_bench_expect(m, ok, "Open with a 5 s timeout and the description \"fancontrol\"");
+    if (!ok) return -1;
+    agentx_bench_respond(m, 42);
+
+    ok = agentx_bench_receive(m, 2) && m->pdu[1] == AGENTX_REGISTER && agentx_get32(m->pdu + 4, true) == 42;
+    p = m->pdu + AGENTX_HEADER;
+    if (ok) {
+        uint32_t subtree[AGENTX_OID_MAX];
+        int len;
+        ok = m->pdu_len >= AGENTX_HEADER + 4 && p[1] == 127 && agentx_get_oid(p + 4, m->pdu + m->pdu_len, true, subtree, &len, NULL) > 0 &&
+             oid_compare(subtree, len, agentx_base, AGENTX_BASE_LEN) == 0;
+    }
+    agentx_bench_expect(m, ok, "Register of the subtree in session 42, priority 127");
+    if (!ok) return -1;
+    agentx_bench_respond(m, 42);
+    for (int i = 0; i < 100 && agentx_state != AGENTX_UP; ++i) {
+        agentx_service();
+        poll(NULL, 0, 2);
+    }
+    agentx_bench_expect(m, agentx_state == AGENTX_UP, "registered");
+
+    // Walk the subtree with GetNext, without an end
+    uint32_t last[AGENTX_OID_MAX] = { 0 };
+    int last_len = 0, walked = 0;
+    bool ordered = true;
+    n = agentx_bench_request(m, AGENTX_GETNEXT);
+    n += agentx_bench_oid(m->out + n, NULL, 0, false);
+    n += agentx_put_oid(m->out + n, NULL, 0);
+    for (;;) {
+        agentx_bench_send(m, n);
+        struct agentx_object o;
+        char str[128];
+        if (agentx_bench_response(m, &p, &end) != 0 || !agentx_bench_varbind(p, end, &o, str, sizeof(str))) {
+            ordered = false;
+            break;
+        }
+        if (o.type == AGENTX_END_OF_MIB) break;
+        ordered &= oid_compare(o.oid, o.len, last, last_len) > 0;
+        memcpy(last, o.oid, o.len * sizeof(uint32_t));
+        last_len = o.len;
+        ++walked;
+
+        n = agentx_bench_request(m, AGENTX_GETNEXT);
+        n += agentx_put_oid(m->out + n, o.oid, o.len);
+        n += agentx_put_oid(m->out + n, NULL, 0);
+    }
+    snprintf(what, sizeof(what), "walk returns all %d objects in order", agentx_object_count);
+    agentx_bench_expect(m, ordered && walked == agentx_object_count, what);
+
+    // Get: fcPwm.0, fcSensorName.2, fcSensorTemp.9, and an OID outside the MIB
+    static const uint32_t pwm[] = { 1, 1, 0 }, name2[] = { 2, 1, 2, 2 }, temp9[] = { 2, 1, 4, 9 }, nothing[] = { 1, 99, 0 };
+    n = agentx_bench_request(m, AGENTX_GET);
+    n += agentx_bench_oid(m->out + n, pwm, 3, false);
+    n += agentx_put_oid(m->out + n, NULL, 0);
+    n += agentx_bench_oid(m->out + n, name2, 4, false);
+    n += agentx_put_oid(m->out + n, NULL, 0);
+    n += agentx_bench_oid(m->out + n, temp9, 4, false);
+    n += agentx_put_oid(m->out + n, NULL, 0);
+    n += agentx_bench_oid(m->out + n, nothing, 3, false);
+    n += agentx_put_oid(m->out + n, NULL, 0);
+    agentx_bench_send(m, n);
+    ok = agentx_bench_response(m, &p, &end) == 0;
+    ok = ok && agentx_bench_check(&p, end, pwm, 3, AGENTX_INTEGER, 128, NULL);
+    ok = ok && agentx_bench_check(&p, end, name2, 4, AGENTX_OCTETS, 0, "bay1");
+    ok = ok && agentx_bench_check(&p, end, temp9, 4, AGENTX_NO_SUCH_INSTANCE, 0, NULL);
+    ok = ok && agentx_bench_check(&p, end, nothing, 3, AGENTX_NO_SUCH_OBJECT, 0, NULL) && p == end;
+    agentx_bench_expect(m, ok, "Get of a scalar, a sensor name, a missing row and a missing object");
+
+    // GetBulk: fcController as a non-repeater, three rows of fcSensorName
+    static const uint32_t controller[] = { 1 }, names[] = { 2, 1, 2 }, name1[] = { 2, 1, 2, 1 }, name3[] = { 2, 1, 2, 3 };
+    n = agentx_bench_request(m, AGENTX_GETBULK);
+    m->out[n] = 0;
+    m->out[n + 1] = 1;
+    m->out[n + 2] = 0;
+    m->out[n + 3] = 3;
+    n += 4;
+    n += agentx_bench_oid(m->out + n, controller, 1, false);
+    n += agentx_put_oid(m->out + n, NULL, 0);
+    n += agentx_bench_oid(m->out + n, names, 3, false);
+    n += agentx_put_oid(m->out + n, NULL, 0);
+    agentx_bench_send(m, n);
+    ok = agentx_bench_response(m, &p, &end) == 0;
+    ok = ok && agentx_bench_check(&p, end, pwm, 3, AGENTX_INTEGER, 128, NULL);
+    ok = ok && agentx_bench_check(&p, end, name1, 4, AGENTX_OCTETS, 0, "bay0");
+    ok = ok && agentx_bench_check(&p, end, name2, 4, AGENTX_OCTETS, 0, "bay1");
+    ok = ok && agentx_bench_check(&p, end, name3, 4, AGENTX_OCTETS, 0, "bay2") && p == end;
+    agentx_bench_expect(m, ok, "GetBulk with one non-repeater and three repetitions");
+
+    // TestSet: notWritable on the first varbind
+    n = agentx_bench_request(m, AGENTX_TESTSET);
+    m->out[n] = 0;
+    m->out[n + 1] = AGENTX_INTEGER;
+    m->out[n + 2] = m->out[n + 3] = 0;
+    n += 4;
+    n += agentx_bench_oid(m->out + n, pwm, 3, false);
+    agentx_put32(m->out + n, 255);
+    n += 4;
+    agentx_bench_send(m, n);
+    ok = agentx_bench_response(m, &p, &end) == 17 && m->pdu[AGENTX_HEADER + 7] == 1;
+    agentx_bench_expect(m, ok, "TestSet refused as notWritable");
+
+    // Close, the client reconnects after its backoff of 1 s
+    n = agentx_bench_request(m, AGENTX_CLOSE);
+    m->out[n] = 1; // reasonOther
+    m->out[n + 1] = m->out[n + 2] = m->out[n + 3] = 0;
+    agentx_bench_send(m, n + 4);
+    double closed_at = latency_clock();
+    close(m->fd);
+    m->fd = -1;
+    m->in_len = 0;
+    ok = agentx_bench_receive(m, 3) && m->pdu[1] == AGENTX_OPEN;
+    double waited = latency_clock() - closed_at;
+    snprintf(what, sizeof(what), "Open again after %.2f s, backoff 1 s", waited);
+    agentx_bench_expect(m, ok && waited >= 1 && waited < 1.5, what);
+
+    printf("AgentX loopback over %s: %d objects walked, %d failed checks\n", transport, walked, m->failures);
+    return 0;
+}
+
+int agentx_benchmark()
+{
+    static struct agentx_bench_master m;
+    static char master[64];
+
+    // Three drives and the fans
+    for (int i = 0; i < 3; ++i) {
+        char name[16];
+        snprintf(name, sizeof(name), "bay%d", i);
+        struct sensor *s = add_sensor(name, SENSOR_DRIVE, setpoint);
+        if (!s) return 1;
+        s->temp = 35 + i;
+    }
+    agentx_started = latency_clock();
+    agentx_update(128, 40, 0);
+
+    for (int pass = 0; pass < 2; ++pass) {
+        struct sockaddr_storage storage;
+        socklen_t addrlen = sizeof(storage);
+        memset(&storage, 0, sizeof(storage));
+        if (pass == 0) {
+            struct sockaddr_in *addr = reinterpret_cast<struct sockaddr_in *>(&storage);
+            addr->sin_family = AF_INET;
+            inet_pton(AF_INET, "127.0.0.1", &addr->sin_addr);
+        } else {
+            struct sockaddr_un *addr = reinterpret_cast<struct sockaddr_un *>(&storage);
+            addr->sun_family = AF_UNIX;
+            snprintf(master, sizeof(master), "/tmp/fancontrol-agentx-%d.sock", static_cast<int>(getpid()));
+            snprintf(addr->sun_path, sizeof(addr->sun_path), "%s", master);
+            unlink(master);
+        }
+
+        m.fd = -1;
+        m.in_len = 0;
+        m.listen_fd = socket(storage.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (m.listen_fd < 0 || bind(m.listen_fd, reinterpret_cast<struct sockaddr *>(&storage), pass == 0 ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_un)) < 0 ||
+            listen(m.listen_fd, 4) < 0 || getsockname(m.listen_fd, reinterpret_cast<struct sockaddr *>(&storage), &addrlen) < 0) {
+            printf("Error: Could not listen for the AgentX test: %s\n", strerror(errno));
+            return 1;
+        }
+        if (pass == 0) snprintf(master, sizeof(master), "127.0.0.1:%d", ntohs(reinterpret_cast<struct sockaddr_in *>(&storage)->sin_port));
+        agentx_master = master;
+
+        agentx_bench_session(&m, pass == 0 ? "TCP" : "a Unix socket");
+
+        // Start over for the next transport
+        if (agentx_sockfd >= 0) close(agentx_sockfd);
+        agentx_sockfd = -1;
+        agentx_state = AGENTX_IDLE;
+        agentx_retry_at = 0;
+        agentx_backoff = 1;
+        if (m.fd >= 0) close(m.fd);
+        close(m.listen_fd);
+        if (pass == 1) unlink(master);
+    }
+
+    return m.failures == 0 ? 0 : 1;
+}
+
+// Listen on a Unix socket for one-line commands, e.g.
+//   echo "profile night" | nc -U /run/fancontrol.sock
+int open_control_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Error: Control socket path too long\n");
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        printf("Error: Could not create control socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+        printf("Error: Could not listen on control socket %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    chmod(path, 0600);
+    return fd;
+}
+
+// Execute one control command and write the reply into out
+void handle_command(char *line, char *out, size_t outlen)
+{
+    line[strcspn(line, "\r\n")] = '\0';
+
+    if (strncmp(line, "profile ", 8) == 0) {
+        const char *name = line + 8;
+        if (strcmp(name, "auto") == 0) {
+            profile_manual = -1;
+            snprintf(out, outlen, "ok following schedule\n");
+        } else if (find_profile(name) >= 0) {
+            profile_manual = find_profile(name);
+            snprintf(out, outlen, "ok profile %s\n", name);
+        } else {
+            snprintf(out, outlen, "error unknown profile %s\n", name);
+        }
+    } else if (strncmp(line, "precool ", 8) == 0) {
+        double start_minutes, duration_hours;
+        if (sscanf(line + 8, "%lf %lf", &start_minutes, &duration_hours) == 2 &&
+            add_precool(monotonic_now(), start_minutes, duration_hours) == 0) {
+            snprintf(out, outlen, "ok precool in %.0f minutes for %.1f hours\n", start_minutes, duration_hours);
+        } else {
+            snprintf(out, outlen, "error usage: precool <start in minutes> <duration in hours>\n");
+        }
+    } else if (strcmp(line, "clear_alarm") == 0) {
+        for (int i = 0; i < FAN_COUNT; ++i) fans[i].alarm = false;
+        snprintf(out, outlen, "ok alarms cleared\n");
+    } else if (strcmp(line, "status") == 0) {
+        static const char *fan_states[] = { "ok", "kick", "failed" };
+        int n = snprintf(out, outlen, "profile %s%s setpoint %.1f pwmmin %d pwmmax %d precool %.1f\n",
+                         profiles[profile_target].name, profile_manual >= 0 ? " (manual)" : "",
+                         profile_active.setpoint, pwmmin, pwmceil, precool_offset(monotonic_now()));
+        for (int i = 0; i < FAN_COUNT && n > 0 && (size_t)n < outlen; ++i) {
+            n += snprintf(out + n, outlen - n, "%s pwm %d rpm %d %s%s\n", fans[i].name, fans[i].written, fans[i].rpm,
+                          fan_states[fans[i].state], fans[i].alarm ? " alarm" : "");
+        }
+        for (int i = 0; i < sensor_count && n > 0 && (size_t)n < outlen; ++i) {
+            if (sensors[i].breaker == BREAKER_OK) continue;
+            n += snprintf(out + n, outlen - n, "%s breaker %s failures %d\n", sensors[i].name,
+                          breaker_names[sensors[i].breaker], sensors[i].failures);
+        }
+    } else {
+        snprintf(out, outlen, "error unknown command\n");
+    }
+}
+
+void serve_control_client(int listen_fd)
+{
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) return;
+
+    // Commands are a single short line, do not let a slow client stall the loop
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    char line[256];
+    char reply[512];
+    ssize_t n = poll(&pfd, 1, 100) > 0 ? read(fd, line, sizeof(line) - 1) : -1;
+
+    if (n > 0) {
+        line[n] = '\0';
+        handle_command(line, reply, sizeof(reply));
+        if (write(fd, reply, strlen(reply)) < 0 && debug) printf("Control socket: %s\n", strerror(errno));
+    }
+
+    close(fd);
+}
+
+// Wait for the given number of seconds, serving the control socket meanwhile
+void idle(double seconds)
+{
+    double deadline = monotonic_now() + seconds;
+
+    for (;;) {
+        double now = monotonic_now();
+        if (now >= deadline || stop_requested) break;
+
+        // Wake up for the next ramp step, or at the deadline
+        double wait = deadline - now;
+        if (wait > ramp_tick) wait = ramp_tick;
+
+        short mqtt_events = POLLIN | (mqtt_state == MQTT_CONNECTING || mqtt_out_len > 0 ? POLLOUT : 0);
+        short agentx_events = POLLIN | (agentx_state == AGENTX_CONNECTING ? POLLOUT : 0);
+        struct pollfd pfds[4] = { { control_sockfd, POLLIN, 0 }, { uevent_sockfd, POLLIN, 0 }, { mqtt_sockfd, mqtt_events, 0 },
+                                  { agentx_sockfd, agentx_events, 0 } };
+        int timeout = simulate ? 0 : static_cast<int>(wait * 1000) + 1;
+
+        // Negative descriptors are ignored by poll()
+        if (poll(pfds, 4, timeout) > 0) {
+            if (pfds[0].revents & POLLIN) serve_control_client(control_sockfd);
+            if (pfds[1].revents & POLLIN) handle_uevents(uevent_sockfd);
+        }
+        if (mqtt_server && (pfds[2].revents || latency_clock() >= mqtt_wake_at)) mqtt_service();
+        if (agentx_master && (pfds[3].revents || latency_clock() >= agentx_wake_at)) agentx_service();
+
+        if (simulate) sim_advance(wait);
+        if (monotonic_now() - fans_ramp_last >= ramp_tick) fans_ramp(monotonic_now());
+    }
+}
+
+// PWM base clock of a fan channel, from bits 6:4 of its clock select register
+int get_pwm_freq_select(const struct fan *f)
+{
+    return (ecread(f->freq_reg) >> 4) & 0x07;
+}
+
+void set_pwm_freq_select(const struct fan *f, int sel)
+{
+    ecwrite(f->freq_reg, (ecread(f->freq_reg) & 0x8f) | ((sel & 0x07) << 4));
+}
+
+int pwm_freq_hz(int sel)
+{
+    static const int base_clock[8] = { 48000000, 24000000, 12000000, 8000000, 6000000, 3000000, 1500000, 750000 };
+    return base_clock[sel & 0x07] / 256;
+}
+
+// Step the duty cycle down until each fan stalls, and return the lowest PWM at which
+// it still turned and its speed there
+void calibrate_min_pwm(int min_pwm[FAN_COUNT], int min_rpm[FAN_COUNT])
+{
+    const double settle = 3; // Seconds for a fan to reach its new speed
+    bool turning[FAN_COUNT];
+
+    // Spin up first, a fan that stopped at the previous clock needs a kick
+    for (int i = 0; i < FAN_COUNT; ++i) {
+        set_fan_pwm(&fans[i], pwmmax);
+        min_pwm[i] = pwmmax;
+        min_rpm[i] = 0;
+        turning[i] = true;
+    }
+    idle(settle);
+
+    for (int duty = 128; duty >= 0; duty -= 4) {
+        for (int i = 0; i < FAN_COUNT; ++i) {
+            if (turning[i]) set_fan_pwm(&fans[i], duty);
+        }
+        idle(settle);
+
+        bool any = false;
+        for (int i = 0; i < FAN_COUNT; ++i) {
+            if (!turning[i]) continue;
+            if (fans[i].rpm < (stall_rpm > 0 ? stall_rpm : 1)) {
+                turning[i] = false;
+                set_fan_pwm(&fans[i], pwmmax);
+            } else {
+                min_pwm[i] = duty;
+                min_rpm[i] = fans[i].rpm;
+                any = true;
+            }
+        }
+        if (!any) break;
+    }
+}
+
+// Try every PWM base clock and keep the one at which the fans keep turning at the
+// lowest speed. Fans sharing a clock select register are measured together.
+int calibrate_pwm_freq()
+{
+    int best_sel = -1, best_rpm = 0;
+
+    calibrating = true;
+    for (int sel = 0; sel < 8; ++sel) {
+        for (int i = 0; i < FAN_COUNT; ++i) set_pwm_freq_select(&fans[i], sel);
+
+        int min_pwm[FAN_COUNT], min_rpm[FAN_COUNT];
+        calibrate_min_pwm(min_pwm, min_rpm);
+
+        // Both fans get the same PWM, so the slowest common speed is set by the stiffer fan
+        int rpm = 0, duty = 0;
+        for (int i = 0; i < FAN_COUNT; ++i) {
+            if (min_rpm[i] > rpm) rpm = min_rpm[i];
+            if (min_pwm[i] > duty) duty = min_pwm[i];
+            printf("Calibration: %d Hz, %s turns down to PWM %d at %d RPM\n", pwm_freq_hz(sel), fans[i].name, min_pwm[i], min_rpm[i]);
+        }
+
+        if (rpm > 0 && (best_sel < 0 || rpm < best_rpm)) {
+            best_sel = sel;
+            best_rpm = rpm;
+            calibrated_pwmmin = duty + calibration_margin;
+        }
+    }
+    calibrating = false;
+
+    if (best_sel < 0) {
+        printf("Calibration failed: no fan turned at any PWM frequency\n");
+        return -1;
+    }
+
+    for (int i = 0; i < FAN_COUNT; ++i) set_pwm_freq_select(&fans[i], best_sel);
+    calibrated_freq_select = best_sel;
+    printf("Calibration: using %d Hz, minimum PWM %d (%d RPM)\n", pwm_freq_hz(best_sel), calibrated_pwmmin, best_rpm);
+    return 0;
+}
+
+int save_calibration(const char *path)
+{
+    char tmp[512];
+    snprintf(tmp, sizeof(tmp), "%s", path);
+
+    // Create the directory on first use
+    char *slash = strrchr(tmp, '/');
+    if (slash && slash != tmp) {
+        *slash = '\0';
+        mkdir(tmp, 0755);
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+        printf("Error: Could not write %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+
+    fprintf(f, "pwm_freq_select=%d\npwmmin=%d\n", calibrated_freq_select, calibrated_pwmmin);
+    if (fclose(f) != 0 || rename(tmp, path) < 0) {
+        printf("Error: Could not write %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int load_calibration(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+
+    char line[128];
+    while (fgets(line, sizeof(line), f)) {
+        sscanf(line, "pwm_freq_select=%d", &calibrated_freq_select);
+        sscanf(line, "pwmmin=%d", &calibrated_pwmmin);
+    }
+    fclose(f);
+
+    return calibrated_freq_select >= 0 && calibrated_freq_select < 8 && calibrated_pwmmin > 0 ? 0 : -1;
+}
+
+// SuperIO and EC setup, done at startup and again after a resume, when the chip may
+// have lost it. The configuration writes are read back; -1 means they did not stick.
+int ec_init()
+{
+    if (simulate) return 0;
+
+    // Enter the configuration mode of the IT8613E
+    outb(0x87, port);
+    outb(0x01, port);
+    outb(0x55, port);
+    outb(0x55, port);
+
+    // Sanity checks commented out so that it works for both chips.
+    // Sanity check that this is the IT8772E
+    //assert(ioread(0x20) == 0x87);
+    //assert(ioread(0x21) == 0x72);
+
+    // Sanity check that this is the IT8613E
+    //assert(ioread(0x20) == 0x86);
+    //assert(ioread(0x21) == 0x13);
 
-void send_to_graphite(const char *message) {
-    if (graphite_sockfd < 0 && connect_to_graphite() < 0) {
-        return;
-    }
+    // Set LDN = 4 to access environment registers
+    iowrite(0x07, 0x04);
 
-    int ret = send(graphite_sockfd, message, strlen(message), 0);
-    if (ret < 0) {
-        printf("Error: Could not send to Graphite: %s\n", strerror(errno));
-        printf("Closing connection to Graphite server\n");
-        close(graphite_sockfd);
-        graphite_sockfd = -1;
+    // Activate environment controller (EC)
+    iowrite(0x30, 0x01);
 
-        // Try to reconnect and send again
-        if (connect_to_graphite() > 0) {
-            send(graphite_sockfd, message, strlen(message), 0);
-        }
+    if (ioread(0x07) != 0x04 || ioread(0x30) != 0x01) {
+        printf("Error: The SuperIO did not accept the EC setup\n");
+        return -1;
     }
-}
-
-int calculate_new_pwm(double error, double timediff, double &integral, double &prev_error) {
-    integral += error * timediff;
 
-    if (integral > imax) integral = imax;
-    else if (integral < -imax) integral = -imax;
+    // Read EC bar
+    ecbar = (ioread(0x60) << 8) + ioread(0x61);
+    if (ecbar == 0 || ecbar == 0xffff) {
+        printf("Error: Invalid EC base address 0x%x\n", ecbar);
+        return -1;
+    }
+    return 0;
+}
 
-    double derivative = (error - prev_error) / timediff;
-    prev_error = error;
+// Put the fan outputs under software control. Bit 7 selects the automatic mode.
+int ec_software_mode()
+{
+    ecwrite(0x16, 0x00);
+    ecwrite(0x17, 0x00);
 
-    // Compute the new PWM
-    double newPWM_double = pwminit + kp * error + ki * integral + kd * derivative;
+    if ((ecread(0x16) & 0x80) || (ecread(0x17) & 0x80)) {
+        printf("Error: The EC stayed in automatic fan mode\n");
+        return -1;
+    }
+    return 0;
+}
 
-    if (newPWM_double > pwmmax) newPWM_double = pwmmax;
-    else if (newPWM_double < pwmmin) newPWM_double = pwmmin;
+// Time the system spent suspended since boot. CLOCK_MONOTONIC stops during suspend,
+// CLOCK_BOOTTIME does not.
+double suspended_seconds()
+{
+    if (simulate) return sim_clock >= sim_suspend_at && sim_suspend_at > 0 ? sim_suspend_for : 0;
 
-    int newPWM = static_cast<int>(newPWM_double);
+    struct timespec boot, mono;
+    clock_gettime(CLOCK_BOOTTIME, &boot);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    return (boot.tv_sec - mono.tv_sec) + (boot.tv_nsec - mono.tv_nsec) / 1000000000.0;
+}
 
-    // Send pid values to Graphite
-    if (graphite_server) {
-        char message[256];
+// Bring the chip back after a resume: redo the setup, rewrite the PWM frequency and
+// duty cycles the EC may have forgotten, and check that they stuck
+int resume_ec()
+{
+    if (ec_init() < 0) return -1;
 
-        snprintf(message, sizeof(message), "fancontrol.p %f %ld\n", error * kp, time(NULL));
-        send_to_graphite(message);
+    if (pwm_freq_select >= 0) {
+        for (int i = 0; i < FAN_COUNT; ++i) set_pwm_freq_select(&fans[i], pwm_freq_select);
+    }
 
-        snprintf(message, sizeof(message), "fancontrol.i %f %ld\n", integral * ki, time(NULL));
-        send_to_graphite(message);
+    for (int i = 0; i < FAN_COUNT; ++i) {
+        int value = fans[i].written;
+        fans[i].written = -1; // Force the write
+        set_fan_pwm(&fans[i], value);
+        if (ecread(fans[i].pwm_reg) != value) {
+            printf("Error: %s did not take PWM %d after resume\n", fans[i].name, value);
+            return -1;
+        }
 
-        snprintf(message, sizeof(message), "fancontrol.d %f %ld\n", derivative * kd, time(NULL));
-        send_to_graphite(message);
+        // Stall detection starts over, the fans were stopped on purpose
+        fans[i].stall_since = 0;
+        if (fans[i].state == FAN_KICK) fans[i].state = FAN_OK;
     }
 
-    return newPWM;
+    return ec_software_mode();
 }
 
 int main(int argc, char *argv[])
@@ -236,10 +5721,21 @@ int main(int argc, char *argv[])
     }
 
     const char *drive_list = NULL;
+    const char *profile_specs[MAX_PROFILES];
+    const char *helper_specs[MAX_HELPERS];
+    const char *sim_fail_spec = NULL;
+    int helper_spec_count = 0;
+    int profile_spec_count = 0;
+    const char *schedule_spec = NULL;
+    bool pwmmin_set = false;
+    double precool_start_minutes = -1;
+    double precool_duration_hours = 0;
 
     for (int i = 1; i < argc; ++i) {
         if (strncmp(argv[i], "--drive_list=", 13) == 0) {
             drive_list = argv[i] + 13;
+        } else if (strncmp(argv[i], "--drive_filter=", 15) == 0) {
+            drive_filter = argv[i] + 15;
         } else if (strncmp(argv[i], "--debug=", 8) == 0) {
             debug = atoi(argv[i] + 8);
         } else if (strncmp(argv[i], "--setpoint=", 11) == 0) {
@@ -252,6 +5748,7 @@ int main(int argc, char *argv[])
             overheat = atoi(argv[i] + 11);
         } else if (strncmp(argv[i], "--pwmmin=", 9) == 0) {
             pwmmin = atoi(argv[i] + 9);
+            pwmmin_set = true;
         } else if (strncmp(argv[i], "--kp=", 5) == 0) {
             kp = atof(argv[i] + 5);
         } else if (strncmp(argv[i], "--ki=", 5) == 0) {
@@ -262,6 +5759,236 @@ int main(int argc, char *argv[])
             kd = atof(argv[i] + 5);
         } else if (strncmp(argv[i], "--cpu_avg=", 10) == 0) {
             cputemp_max_values = atof(argv[i] + 10);
+        } else if (strncmp(argv[i], "--sensors=", 10) == 0) {
+            sensor_config = argv[i] + 10;
+        } else if (strncmp(argv[i], "--aggregate=", 12) == 0) {
+            if (strcmp(argv[i] + 12, "max") == 0) {
+                aggregate_mean = 0;
+            } else if (strcmp(argv[i] + 12, "mean") == 0) {
+                aggregate_mean = 1;
+            } else {
+                printf("Invalid aggregate '%s'. Expected max or mean\n", argv[i] + 12);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--error_expr=", 13) == 0) {
+            error_expr_src = argv[i] + 13;
+        } else if (strncmp(argv[i], "--pwm_expr=", 11) == 0) {
+            pwm_expr_src = argv[i] + 11;
+        } else if (strncmp(argv[i], "--expr_bench=", 13) == 0) {
+            expr_bench = atol(argv[i] + 13);
+        } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+            if (profile_spec_count >= MAX_PROFILES - 1) {
+                printf("Too many profiles (max %d)\n", MAX_PROFILES - 1);
+                return 1;
+            }
+            profile_specs[profile_spec_count++] = argv[i] + 10;
+        } else if (strncmp(argv[i], "--helper=", 9) == 0) {
+            if (helper_spec_count >= MAX_HELPERS) {
+                printf("Too many helpers (max %d)\n", MAX_HELPERS);
+                return 1;
+            }
+            helper_specs[helper_spec_count++] = argv[i] + 9;
+        } else if (strncmp(argv[i], "--helper_timeout=", 17) == 0) {
+            helper_timeout = atof(argv[i] + 17);
+        } else if (strncmp(argv[i], "--smart_interval=", 17) == 0) {
+            smart_interval = atoi(argv[i] + 17);
+        } else if (strncmp(argv[i], "--smart_alert=", 14) == 0) {
+            if (parse_smart_alerts(argv[i] + 14) < 0) {
+                print_usage();
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--latency_factor=", 17) == 0) {
+            latency_factor = atof(argv[i] + 17);
+        } else if (strncmp(argv[i], "--breaker_trips=", 16) == 0) {
+            breaker_trips = atoi(argv[i] + 16);
+        } else if (strncmp(argv[i], "--breaker_slow=", 15) == 0) {
+            breaker_slow = atof(argv[i] + 15);
+        } else if (strncmp(argv[i], "--breaker_backoff=", 18) == 0) {
+            breaker_backoff = atoi(argv[i] + 18);
+        } else if (strncmp(argv[i], "--breaker_margin=", 17) == 0) {
+            breaker_margin = atoi(argv[i] + 17);
+        } else if (strncmp(argv[i], "--breaker_pwm=", 14) == 0) {
+            breaker_pwm = atoi(argv[i] + 14);
+        } else if (strncmp(argv[i], "--array_interval=", 17) == 0) {
+            array_interval = atoi(argv[i] + 17);
+        } else if (strncmp(argv[i], "--mdstat=", 9) == 0) {
+            mdstat_path = argv[i] + 9;
+        } else if (strncmp(argv[i], "--zfs_kstat=", 12) == 0) {
+            zfs_kstat_dir = argv[i] + 12;
+        } else if (strncmp(argv[i], "--zfs_busy_mbps=", 16) == 0) {
+            zfs_busy_mbps = atof(argv[i] + 16);
+        } else if (strncmp(argv[i], "--array_check=", 14) == 0) {
+            array_check = argv[i] + 14;
+        } else if (strncmp(argv[i], "--maint_delta=", 14) == 0) {
+            maint_delta = atof(argv[i] + 14);
+        } else if (strncmp(argv[i], "--maint_pwm=", 12) == 0) {
+            maint_pwm = atoi(argv[i] + 12);
+        } else if (strncmp(argv[i], "--throttle=", 11) == 0) {
+            if (add_throttle(argv[i] + 11) < 0) return 1;
+        } else if (strncmp(argv[i], "--throttle_span=", 16) == 0) {
+            throttle_span = atoi(argv[i] + 16);
+        } else if (strncmp(argv[i], "--throttle_hysteresis=", 22) == 0) {
+            throttle_hysteresis = atoi(argv[i] + 22);
+        } else if (strncmp(argv[i], "--throttle_cpu=", 15) == 0) {
+            throttle_cpu = atof(argv[i] + 15);
+        } else if (strncmp(argv[i], "--throttle_io=", 14) == 0) {
+            throttle_io = atof(argv[i] + 14);
+        } else if (strncmp(argv[i], "--throttle_io_start=", 20) == 0) {
+            throttle_io_start = atof(argv[i] + 20);
+        } else if (strncmp(argv[i], "--cgroup_root=", 14) == 0) {
+            cgroup_root = argv[i] + 14;
+        } else if (strncmp(argv[i], "--rapl_zone=", 12) == 0) {
+            rapl_zone = argv[i] + 12;
+        } else if (strncmp(argv[i], "--rapl_min=", 11) == 0) {
+            rapl_min = atof(argv[i] + 11);
+        } else if (strncmp(argv[i], "--rapl_step=", 12) == 0) {
+            rapl_step = atof(argv[i] + 12);
+        } else if (strncmp(argv[i], "--shm=", 6) == 0) {
+            shm_path = argv[i] + 6;
+        } else if (strncmp(argv[i], "--fleet_server=", 15) == 0) {
+            fleet_server = argv[i] + 15;
+        } else if (strncmp(argv[i], "--fleet_tcp=", 12) == 0) {
+            fleet_tcp = atoi(argv[i] + 12) != 0;
+        } else if (strncmp(argv[i], "--fleet_name=", 13) == 0) {
+            fleet_name = argv[i] + 13;
+        } else if (strncmp(argv[i], "--fleet_listen=", 15) == 0) {
+            fleet_listen = atoi(argv[i] + 15);
+        } else if (strncmp(argv[i], "--fleet_flush=", 14) == 0) {
+            fleet_flush = atoi(argv[i] + 14);
+            if (fleet_flush < 1) fleet_flush = 1;
+        } else if (strncmp(argv[i], "--fleet_bench=", 14) == 0) {
+            fleet_bench = atoi(argv[i] + 14);
+        } else if (strncmp(argv[i], "--mqtt_server=", 14) == 0) {
+            mqtt_server = argv[i] + 14;
+        } else if (strncmp(argv[i], "--mqtt_topic=", 13) == 0) {
+            mqtt_topic = argv[i] + 13;
+        } else if (strncmp(argv[i], "--mqtt_discovery=", 17) == 0) {
+            mqtt_discovery = argv[i] + 17;
+        } else if (strncmp(argv[i], "--mqtt_keepalive=", 17) == 0) {
+            mqtt_keepalive = atoi(argv[i] + 17);
+            if (mqtt_keepalive < 0 || mqtt_keepalive > 65535) mqtt_keepalive = 60;
+        } else if (strncmp(argv[i], "--mqtt_user=", 12) == 0) {
+            mqtt_user = argv[i] + 12;
+        } else if (strncmp(argv[i], "--mqtt_password=", 16) == 0) {
+            mqtt_password = argv[i] + 16;
+        } else if (strncmp(argv[i], "--mqtt_bench=", 13) == 0) {
+            mqtt_bench = atoi(argv[i] + 13) != 0;
+        } else if (strncmp(argv[i], "--agentx=", 9) == 0) {
+            agentx_master = argv[i] + 9;
+        } else if (strncmp(argv[i], "--agentx_bench=", 15) == 0) {
+            agentx_bench = atoi(argv[i] + 15) != 0;
+        } else if (strncmp(argv[i], "--hook=", 7) == 0) {
+            const char *spec = argv[i] + 7;
+            const char *colon = strchr(spec, ':');
+            int event = 0;
+            while (colon && event < HOOK_COUNT &&
+                   (strncmp(spec, hook_names[event], colon - spec) != 0 || hook_names[event][colon - spec] != '\0')) ++event;
+            if (!colon || event == HOOK_COUNT || !colon[1]) {
+                printf("Error: Invalid hook %s, expected <overheat|stall|sensor|smart>:<command>\n", spec);
+                return 1;
+            }
+            hook_commands[event] = colon + 1;
+        } else if (strncmp(argv[i], "--hook_interval=", 16) == 0) {
+            hook_interval = atoi(argv[i] + 16);
+        } else if (strncmp(argv[i], "--hook_max=", 11) == 0) {
+            hook_max = atoi(argv[i] + 11);
+            if (hook_max < 1) hook_max = 1;
+            if (hook_max > HOOK_MAX_RUNNING) hook_max = HOOK_MAX_RUNNING;
+        } else if (strncmp(argv[i], "--hook_timeout=", 15) == 0) {
+            hook_timeout = atoi(argv[i] + 15);
+        } else if (strncmp(argv[i], "--schedule=", 11) == 0) {
+            schedule_spec = argv[i] + 11;
+        } else if (strncmp(argv[i], "--profile_ramp=", 15) == 0) {
+            profile_ramp = atof(argv[i] + 15);
+        } else if (strncmp(argv[i], "--control_socket=", 17) == 0) {
+            control_socket = argv[i] + 17;
+        } else if (strncmp(argv[i], "--precool=", 10) == 0) {
+            if (sscanf(argv[i] + 10, "%lf:%lf", &precool_start_minutes, &precool_duration_hours) != 2) {
+                printf("Invalid precool format. Expected <start in minutes>:<duration in hours>\n");
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--precool_lead=", 15) == 0) {
+            precool_lead = atof(argv[i] + 15);
+        } else if (strncmp(argv[i], "--precool_delta=", 16) == 0) {
+            precool_delta = atof(argv[i] + 16);
+        } else if (strncmp(argv[i], "--precool_dir=", 14) == 0) {
+            precool_dir = argv[i] + 14;
+        } else if (strncmp(argv[i], "--slew_up=", 10) == 0) {
+            slew_up = atof(argv[i] + 10);
+        } else if (strncmp(argv[i], "--slew_down=", 12) == 0) {
+            slew_down = atof(argv[i] + 12);
+        } else if (strncmp(argv[i], "--ramp_tick=", 12) == 0) {
+            ramp_tick = atof(argv[i] + 12);
+            if (ramp_tick <= 0) {
+                printf("Invalid ramp_tick, must be positive\n");
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--pwm_deadband=", 15) == 0) {
+            pwm_deadband = atoi(argv[i] + 15);
+        } else if (strncmp(argv[i], "--temp_hysteresis=", 18) == 0) {
+            temp_hysteresis = atoi(argv[i] + 18);
+        } else if (strncmp(argv[i], "--stall_rpm=", 12) == 0) {
+            stall_rpm = atoi(argv[i] + 12);
+        } else if (strncmp(argv[i], "--stall_pwm=", 12) == 0) {
+            stall_pwm = atoi(argv[i] + 12);
+        } else if (strncmp(argv[i], "--stall_time=", 13) == 0) {
+            stall_time = atof(argv[i] + 13);
+        } else if (strncmp(argv[i], "--kick_time=", 12) == 0) {
+            kick_time = atof(argv[i] + 12);
+        } else if (strncmp(argv[i], "--failover_pwm=", 15) == 0) {
+            failover_pwm = atoi(argv[i] + 15);
+        } else if (strncmp(argv[i], "--cascade=", 10) == 0) {
+            cascade = atoi(argv[i] + 10);
+        } else if (strncmp(argv[i], "--fan_rpm_max=", 14) == 0) {
+            fan_rpm_max = atoi(argv[i] + 14);
+        } else if (strncmp(argv[i], "--rpm_kp=", 9) == 0) {
+            rpm_kp = atof(argv[i] + 9);
+        } else if (strncmp(argv[i], "--rpm_ki=", 9) == 0) {
+            rpm_ki = atof(argv[i] + 9);
+        } else if (strncmp(argv[i], "--rpm_deadband=", 15) == 0) {
+            rpm_deadband = atoi(argv[i] + 15);
+        } else if (strncmp(argv[i], "--fan_sync=", 11) == 0) {
+            if (strcmp(argv[i] + 11, "off") == 0) {
+                fan_sync = SYNC_OFF;
+            } else if (strcmp(argv[i] + 11, "lock") == 0) {
+                fan_sync = SYNC_LOCK;
+            } else if (strcmp(argv[i] + 11, "gap") == 0) {
+                fan_sync = SYNC_GAP;
+            } else {
+                printf("Invalid fan_sync '%s'. Expected off, lock or gap\n", argv[i] + 11);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--fan_gap_rpm=", 14) == 0) {
+            fan_gap_rpm = atoi(argv[i] + 14);
+        } else if (strncmp(argv[i], "--fan_blades=", 13) == 0) {
+            fan_blades = atoi(argv[i] + 13);
+        } else if (strncmp(argv[i], "--pwm_freq=", 11) == 0) {
+            pwm_freq_select = atoi(argv[i] + 11);
+            if (pwm_freq_select < 0 || pwm_freq_select > 7) {
+                printf("Invalid pwm_freq, expected a clock select from 0 to 7\n");
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--calibrate=", 12) == 0) {
+            calibrate = atoi(argv[i] + 12);
+        } else if (strncmp(argv[i], "--calibration_file=", 19) == 0) {
+            calibration_file = argv[i] + 19;
+        } else if (strncmp(argv[i], "--simulate=", 11) == 0) {
+            simulate = atoi(argv[i] + 11);
+        } else if (strncmp(argv[i], "--sim_duration=", 15) == 0) {
+            sim_duration = atof(argv[i] + 15);
+        } else if (strncmp(argv[i], "--sim_ambient=", 14) == 0) {
+            sim_ambient = atof(argv[i] + 14);
+        } else if (strncmp(argv[i], "--sim_job_watts=", 16) == 0) {
+            sim_job_watts = atof(argv[i] + 16);
+        } else if (strncmp(argv[i], "--sim_stall=", 12) == 0) {
+            if (parse_sim_stall(argv[i] + 12) < 0) return 1;
+        } else if (strncmp(argv[i], "--sim_suspend=", 14) == 0) {
+            if (sscanf(argv[i] + 14, "%lf:%lf", &sim_suspend_at, &sim_suspend_for) != 2) {
+                printf("Invalid sim_suspend '%s'. Expected <s>:<s>\n", argv[i] + 14);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--sim_fail=", 11) == 0) {
+            sim_fail_spec = argv[i] + 11;
         } else if (strncmp(argv[i], "--graphite_server=", 18) == 0) {
             char *server_info = argv[i] + 18;
             char *colon_pos = strchr(server_info, ':');
@@ -280,6 +6007,13 @@ int main(int argc, char *argv[])
         }
     }
 
+    // The aggregator and the loopback tests do not control any fans
+    if (fleet_bench > 0) return fleet_benchmark(fleet_bench);
+    if (mqtt_bench) return mqtt_benchmark();
+    if (agentx_bench) return agentx_benchmark();
+    if (array_check) return array_selfcheck(array_check);
+    if (fleet_listen > 0) return run_aggregator();
+
     if (drive_list == NULL)
     {
         printf("Error: drive_list is required.\n");
@@ -287,49 +6021,133 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    char **drives = NULL;
-    int count = split_drive_names(drive_list, &drives);
+    if (strcmp(drive_list, "auto") == 0)
+    {
+        drive_auto = true;
+        discover_drives();
+        uevent_sockfd = open_uevent_socket();
+    }
+    else
+    {
+        char **drives = NULL;
+        int count = split_drive_names(drive_list, &drives);
+
+        if (count == 0)
+        {
+            return 1;
+        }
+
+        for (int i = 0; i < count; ++i)
+        {
+            if (!add_sensor(drives[i], SENSOR_DRIVE, setpoint)) return 1;
+            free(drives[i]);
+        }
+        free(drives);
+    }
+
+    // Allow for 20 degrees higher temperature than the drives
+    struct sensor *cpu_sensor = add_sensor("cpu", SENSOR_CPU, setpoint + 20);
+    if (!cpu_sensor) return 1;
+
+    for (int i = 0; i < helper_spec_count; ++i)
+    {
+        if (add_helper(helper_specs[i]) < 0) return 1;
+    }
+
+    // A helper that exits must not take the daemon down with it
+    signal(SIGPIPE, SIG_IGN);
 
-    if (count == 0)
+    if (sensor_config && apply_sensor_config(sensor_config, NULL) < 0)
     {
+        print_usage();
         return 1;
     }
 
-    // Obtain access to IO ports
-    iopl(3);
+    // The command line parameters are the default profile
+    struct profile *base = &profiles[profile_count++];
+    snprintf(base->name, sizeof(base->name), "default");
+    base->setpoint = setpoint;
+    base->pwmmin = pwmmin;
+    base->pwmmax = pwmmax;
+    base->kp = kp;
+    base->ki = ki;
+    base->kd = kd;
+    profile_active = profile_from = *base;
 
-    // Initialize the IT8613E
-    outb(0x87, port);
-    outb(0x01, port);
-    outb(0x55, port);
-    outb(0x55, port);
+    for (int i = 0; i < profile_spec_count; ++i)
+    {
+        if (add_profile(profile_specs[i]) < 0) return 1;
+    }
 
-    // Sanity checks commented out so that it works for both chips.
-    // Sanity check that this is the IT8772E
-    //assert(ioread(0x20) == 0x87);
-    //assert(ioread(0x21) == 0x72);
+    if (schedule_spec && parse_schedule(schedule_spec) < 0) return 1;
+    if (sim_fail_spec && parse_sim_fail(sim_fail_spec) < 0) return 1;
 
-    // Sanity check that this is the IT8613E
-    //assert(ioread(0x20) == 0x86);
-    //assert(ioread(0x21) == 0x13);
+    // Compile the expressions once, they only reference the sensor table from here on
+    if (error_expr_src && expr_compile(error_expr_src, &error_expr) < 0) return 1;
+    if (pwm_expr_src && expr_compile(pwm_expr_src, &pwm_expr) < 0) return 1;
 
-    // Set LDN = 4 to access environment registers
-    iowrite(0x07, 0x04);
+    if (expr_bench > 0)
+    {
+        // Give every sensor a plausible reading so that nothing short-circuits to NaN
+        for (int i = 0; i < sensor_count; ++i) sensors[i].temp = setpoint;
+        expr_vars[VAR_SETPOINT] = setpoint;
+        expr_vars[VAR_PWM] = pwminit;
+        if (error_expr_src) expr_benchmark("error_expr", &error_expr, expr_bench);
+        if (pwm_expr_src) expr_benchmark("pwm_expr", &pwm_expr, expr_bench);
+        return 0;
+    }
 
-    // Activate environment controller (EC)
-    iowrite(0x30, 0x01);
+    start_time = time(NULL);
 
-    // Read EC bar
-    ecbar = (ioread(0x60) << 8) + ioread(0x61);
+    if (simulate)
+    {
+        printf("Simulating, the fans and sensors are not touched\n");
+        sim_init();
+    }
+    else
+    {
+        // Obtain access to IO ports
+        iopl(3);
+
+        if (ec_init() < 0) return 1;
+    }
 
     // Initialize the PWM value
-    uint8_t pwm = pwminit;
-    ecwrite(0x6b, pwm);
-    ecwrite(0x73, pwm);
+    int pwm = pwminit;
+    for (int i = 0; i < FAN_COUNT; ++i) init_fan_pwm(&fans[i], pwm);
+    fans_ramp_last = monotonic_now();
 
     // Set software operation
-    ecwrite(0x16, 0x00);
-    ecwrite(0x17, 0x00);
+    if (ec_software_mode() < 0) return 1;
+
+    if (calibrate)
+    {
+        int ret = calibrate_pwm_freq() == 0 && save_calibration(calibration_file) == 0 ? 0 : 1;
+        if (ret == 0) printf("Calibration saved to %s\n", calibration_file);
+        if (simulate) sim_report();
+        for (int i = 0; i < FAN_COUNT; ++i) set_fan_pwm(&fans[i], pwminit);
+        return ret;
+    }
+
+    // Apply a previous calibration, unless the command line says otherwise
+    if (load_calibration(calibration_file) == 0)
+    {
+        if (pwm_freq_select < 0) pwm_freq_select = calibrated_freq_select;
+        if (!pwmmin_set) pwmmin = profiles[0].pwmmin = profile_active.pwmmin = profile_from.pwmmin = calibrated_pwmmin;
+        if (debug) printf("Loaded calibration from %s\n", calibration_file);
+    }
+
+    if (pwm_freq_select >= 0)
+    {
+        for (int i = 0; i < FAN_COUNT; ++i) set_pwm_freq_select(&fans[i], pwm_freq_select);
+    }
+
+    if (debug)
+    {
+        for (int i = 0; i < FAN_COUNT; ++i)
+            printf("Fan %s: PWM frequency %d Hz (clock select %d), minimum PWM %d\n", fans[i].name,
+                   pwm_freq_hz(get_pwm_freq_select(&fans[i])), get_pwm_freq_select(&fans[i]), pwmmin);
+    }
 
     double integral = 0;
     double derivative = 0;
@@ -337,8 +6155,8 @@ int main(int argc, char *argv[])
     double prev_error = 0;
     double timediff = 0;
     int maxtemp = 0;
-    struct timespec curtime;
-    struct timespec lasttime;
+    double curtime;
+    double lasttime;
 
     int *cputemp_values = (int *)calloc(cputemp_max_values, sizeof(int));  // Store last 10 values
     int cputemp_index = 0;  // Circular index
@@ -349,50 +6167,153 @@ int main(int argc, char *argv[])
     // Setup graphite socket
     graphite_sockfd = graphite_server ? connect_to_graphite() : -1;
 
-    clock_gettime(CLOCK_MONOTONIC, &lasttime);
+    if (control_socket)
+    {
+        control_sockfd = open_control_socket(control_socket);
+        if (control_sockfd < 0) return 1;
+    }
+
+    if (precool_start_minutes >= 0 && add_precool(monotonic_now(), precool_start_minutes, precool_duration_hours) < 0)
+    {
+        printf("Error: Invalid precool request\n");
+        return 1;
+    }
+
+    if (!simulate) init_rapl();
+    if (shm_path && open_shm(shm_path) < 0) return 1;
+
+    static char hostname[64], mqtt_default_topic[96];
+    if (gethostname(hostname, sizeof(hostname)) < 0) snprintf(hostname, sizeof(hostname), "localhost");
+    hostname[sizeof(hostname) - 1] = '\0';
+    if (!fleet_name) fleet_name = hostname;
+
+    if (mqtt_server) {
+        char node[64];
+        sensor_name_from_id(hostname, node, sizeof(node));
+        snprintf(mqtt_node, sizeof(mqtt_node), "fancontrol_%s", node);
+        if (!mqtt_topic) {
+            snprintf(mqtt_default_topic, sizeof(mqtt_default_topic), "fancontrol/%s", node);
+            mqtt_topic = mqtt_default_topic;
+        }
+        mqtt_service();
+    }
+
+    if (agentx_master) {
+        agentx_started = latency_clock();
+        agentx_service();
+    }
+
+    lasttime = monotonic_now();
+
+    // Leave the loop on SIGTERM/SIGINT so that throttles do not outlive the daemon
+    struct sigaction stop_action;
+    memset(&stop_action, 0, sizeof(stop_action));
+    stop_action.sa_handler = request_stop;
+    sigaction(SIGTERM, &stop_action, NULL);
+    sigaction(SIGINT, &stop_action, NULL);
+
+    double suspended = suspended_seconds();
+    bool resume_pending = false;
 
-    while (true)
+    while (!stop_requested && (!simulate || sim_duration <= 0 || sim_clock < sim_duration))
     {
         maxtemp = 0;
-        char smartcmd[200];
-        char tempstring[20];
 
-        // Execute the smartctl command for each drive in the list
-        for (int i = 0; i < count; ++i)
+        // The EC can come back from a suspend in automatic mode with stale registers
+        if (suspended_seconds() - suspended > 1)
+        {
+            printf("Resumed after %.0f seconds in suspend, setting up the EC again\n", suspended_seconds() - suspended);
+            suspended = suspended_seconds();
+            resume_pending = true;
+        }
+
+        bool resumed = false;
+        if (resume_pending && resume_ec() == 0)
         {
-            snprintf(smartcmd, sizeof(smartcmd), "smartctl -n standby -A -d sat /dev/%s | grep Temperature_Celsius | awk '{print $10}'", drives[i]);
+            resume_pending = false;
+            resumed = true;
+        }
+
+        // Pick up drives that were added or removed
+        if (discover_at > 0 && monotonic_now() >= discover_at)
+        {
+            discover_at = 0;
+            discover_drives();
+        }
 
-            FILE *pipe = popen(smartcmd, "r");
-            if (!pipe)
+        // Read the temperature of each drive in the list
+        for (int i = 0; i < sensor_count; ++i)
+        {
+            struct sensor *drive = &sensors[i];
+            if (drive->kind != SENSOR_DRIVE || !drive->present || !breaker_allows(drive)) continue;
+
+            // The first probe also detects the drive type, leave it out of the latencies
+            bool detected = drive->type != DRIVE_UNKNOWN;
+            double probe_start = latency_clock();
+            int temp = read_drive_temp(drive);
+            double took = latency_clock() - probe_start;
+            if (detected && !simulate) record_latency(drive, took);
+
+            // A probe that took too long counts as failed, its reading is not used
+            bool too_slow = detected && !simulate && took > breaker_slow;
+            if (too_slow && debug) printf("Drive: /dev/%s (%s) took %.1f seconds, ignoring its reading\n", drive->dev, drive->name, took);
+            if (temp < 0 || too_slow)
             {
+                breaker_failure(drive);
                 continue;
             }
 
-            // This can fail when drives are in standby mode. In this case we will report 0 temperature.
-            int temp = fgets(tempstring, sizeof(tempstring), pipe) ? atoi(tempstring) : 0;
-            pclose(pipe);
+            set_sensor_temp(drive, temp);
+            breaker_success(drive, temp);
 
-            if (temp > maxtemp) maxtemp = temp;
+            if (debug) printf("Drive: /dev/%s (%s) has temperature %d\n", drive->dev, drive->name, temp);
 
-            if (debug) printf("Drive: /dev/%s has temperature %d\n", drives[i], temp);
+            if (drive->smart_fresh) smart_report(drive);
 
             // Send disk temperature to Graphite
             if (graphite_server) {
                 char message[256];
 
-                snprintf(message, sizeof(message), "fancontrol.%s %d %ld\n", drives[i], temp, time(NULL));
+                snprintf(message, sizeof(message), "fancontrol.%.*s %d %ld\n", SENSOR_NAME_MAX, drive->name, temp, time(NULL));
+                send_to_graphite(message);
+            }
+        }
+
+        check_latency_outliers();
+
+        for (int i = 0; i < helper_count; ++i)
+        {
+            struct helper *h = &helpers[i];
+            if (!breaker_allows(h->sensor)) continue;
+
+            int temp = read_helper_temp(h);
+            if (temp < 0)
+            {
+                breaker_failure(h->sensor);
+                continue;
+            }
+
+            set_sensor_temp(h->sensor, temp);
+            breaker_success(h->sensor, temp);
+
+            if (debug) printf("Helper: %s has temperature %d\n", h->sensor->name, temp);
+
+            if (graphite_server) {
+                char message[256];
+
+                snprintf(message, sizeof(message), "fancontrol.%.*s %d %ld\n", SENSOR_NAME_MAX, h->sensor->name, temp, time(NULL));
                 send_to_graphite(message);
             }
         }
 
         // Get CPU temperature
-        FILE *cpupipe = popen("sensors | grep -i 'Package id' | awk -F'[+.°]' '{print $2}'", "r");
-        if (cpupipe)
+        int cputemp = breaker_allows(cpu_sensor) ? read_cpu_temp(cpu_sensor) : -1;
+        if (cputemp < 0 && breaker_allows(cpu_sensor))
+        {
+            breaker_failure(cpu_sensor);
+        }
+        else if (cputemp >= 0)
         {
-            char cputempstring[10];
-            fgets(cputempstring, sizeof(cputempstring), cpupipe);
-            pclose(cpupipe);
-            int cputemp = atoi(cputempstring);
 
             // Rolling average logic
             if (cputemp_count < cputemp_max_values) {
@@ -412,40 +6333,152 @@ int main(int argc, char *argv[])
             // Compute rolling average
             cpu_avg_temp = cputemp_sum / cputemp_count;
 
-            if (cpu_avg_temp - 20 > maxtemp) maxtemp = cpu_avg_temp - 20; // Allow for 20 degrees higher temperature than the drives
+            set_sensor_temp(cpu_sensor, cpu_avg_temp);
+            breaker_success(cpu_sensor, cpu_avg_temp);
 
             if (debug) printf("Current CPU Temperature: %d°C | Rolling Avg (last %d): %d°C\n", cputemp, cputemp_count, cpu_avg_temp);
         }
 
-        if (debug) printf("Max Temperature: %d\n", maxtemp);
+        report_breakers();
+
+        // Pick up schedule changes and control socket commands
+        update_profile(monotonic_now(), integral);
+
+        // Lower the setpoint ahead of announced heavy jobs
+        if (precool_dir) scan_precool_dir(monotonic_now());
+        double precool = precool_offset(monotonic_now());
+        setpoint_shift += precool;
+
+        // Scrubs and rebuilds heat every member drive for hours
+        if (array_interval > 0 && monotonic_now() >= array_scan_at) scan_arrays(monotonic_now());
+        if (maint_active) setpoint_shift -= maint_delta;
+
+        // Every sensor is compared against its own setpoint, the worst one drives the fans
+        struct sensor *driving = aggregate_error(&error);
+
+        // Overheat and throttling go by real readings, what the single
+        // max(drives, cpu - 20) used to report
+        maxtemp = hottest_level();
+
+        // The error the controller acts on, expressed as a temperature
+        int error_temp = static_cast<int>(setpoint + setpoint_shift + error);
+
+        if (error_expr_src || pwm_expr_src) {
+            time_t now = wall_now();
+            struct tm local;
+            localtime_r(&now, &local);
+
+            expr_vars[VAR_SETPOINT] = setpoint + setpoint_shift;
+            expr_vars[VAR_ERROR] = error;
+            expr_vars[VAR_MAXTEMP] = maxtemp;
+            expr_vars[VAR_LOAD] = read_cpu_load();
+            expr_vars[VAR_HOUR] = local.tm_hour;
+            expr_vars[VAR_MINUTE] = local.tm_min;
+            expr_vars[VAR_MAINT] = maint_active ? 1 : 0;
+            expr_vars[VAR_POWER] = rapl_power;
+        }
+
+        if (error_expr_src) {
+            double expr_error = expr_eval(&error_expr);
+            if (!__builtin_isnan(expr_error)) error = expr_error;
+            if (debug) printf("error_expr = %f\n", expr_error);
+        }
+
+        if (debug) {
+            for (int i = 0; i < sensor_count; ++i) {
+                if (sensors[i].temp == 0) continue;
+                printf("Sensor: %s temperature %d, setpoint %d, error %.1f\n",
+                       sensors[i].name, sensors[i].temp, sensors[i].setpoint, sensors[i].error);
+            }
+            printf("Max Temperature: %d, error at %d, driving sensor: %s\n", maxtemp, error_temp, driving ? driving->name : "none");
+        }
 
         if (graphite_server) {
             char message[256];
 
             snprintf(message, sizeof(message), "fancontrol.maxtemp %d %ld\n", maxtemp, time(NULL));
             send_to_graphite(message);
+
+            snprintf(message, sizeof(message), "fancontrol.error_temp %d %ld\n", error_temp, time(NULL));
+            send_to_graphite(message);
+
+            for (int i = 0; i < sensor_count; ++i) {
+                if (sensors[i].temp == 0) continue;
+                snprintf(message, sizeof(message), "fancontrol.error.%.*s %f %ld\n", SENSOR_NAME_MAX, sensors[i].name, sensors[i].error, time(NULL));
+                send_to_graphite(message);
+            }
+
+            snprintf(message, sizeof(message), "fancontrol.driving_sensor %ld %ld\n", driving ? (long)(driving - sensors) : -1L, time(NULL));
+            send_to_graphite(message);
+
+            snprintf(message, sizeof(message), "fancontrol.profile %d %ld\n", profile_target, time(NULL));
+            send_to_graphite(message);
+
+            snprintf(message, sizeof(message), "fancontrol.precool %f %ld\n", precool, time(NULL));
+            send_to_graphite(message);
+        }
+
+        // Past overheat the fans alone are not enough, slow down the heat sources
+        update_throttle(maxtemp);
+
+        // Every sensor on its own, on the scale of the global setpoint
+        for (int i = 0; i < sensor_count && hook_commands[HOOK_OVERHEAT]; ++i) {
+            struct sensor *s = &sensors[i];
+            int level = sensor_level(s);
+            char message[160];
+            snprintf(message, sizeof(message), "Temperature %d is %s overheat %d", level, level > overheat ? "above" : "back below", overheat);
+            if (s->temp > 0 && level > overheat) hook_raise(HOOK_OVERHEAT, s->name, true, level, overheat, message);
+            else if (s->temp == 0 || level <= overheat - throttle_hysteresis) hook_raise(HOOK_OVERHEAT, s->name, false, level, overheat, message);
+        }
+        hook_dispatch(monotonic_now());
+
+        // Everything cooled down while suspended, what the controller learned before
+        // no longer applies
+        if (resumed)
+        {
+            integral = 0;
+            prev_error = error;
+            lasttime = monotonic_now() - interval;
+            rapl_last_energy = -1;
         }
 
         // Calculate time since last poll
-        clock_gettime(CLOCK_MONOTONIC, &curtime);
-        timediff = ((1000000000LL * (curtime.tv_sec - lasttime.tv_sec) +
-                    (curtime.tv_nsec - lasttime.tv_nsec))) / 1000000000.0;
+        curtime = monotonic_now();
+        timediff = curtime - lasttime;
 
         if (timediff == 0) {
-            sleep(interval);
+            idle(interval);
             continue;
         }
 
         // Update lasttime to the new time
-        lasttime.tv_sec = curtime.tv_sec;
-        lasttime.tv_nsec = curtime.tv_nsec;
-
-        // Calculate PID values
-        error = maxtemp - setpoint;
+        lasttime = curtime;
 
         // Compute the new PWM using the function
         int newPWM = calculate_new_pwm(error, timediff, integral, prev_error);
 
+        if (pwm_expr_src) {
+            expr_vars[VAR_PWM] = newPWM;
+            double expr_pwm = expr_eval(&pwm_expr);
+            if (!__builtin_isnan(expr_pwm)) {
+                if (expr_pwm > pwmmax) expr_pwm = pwmmax;
+                else if (expr_pwm < 0) expr_pwm = 0;
+                newPWM = static_cast<int>(expr_pwm);
+            }
+            if (debug) printf("pwm_expr = %f\n", expr_pwm);
+        }
+
+        // Failed sensors may be hiding heat
+        if (breaker_pwm > 0 && newPWM < breaker_pwm && breakers_open())
+        {
+            newPWM = breaker_pwm;
+        }
+
+        if (maint_active && newPWM < maint_pwm)
+        {
+            newPWM = maint_pwm;
+        }
+
         if (debug)
         {
             printf("maxtemp = %d, error = %f, p = %f, i = %f, d = %f, pwm = %d\n",
@@ -453,11 +6486,26 @@ int main(int argc, char *argv[])
             fflush(stdout);
         }
 
+        // Small corrections are not worth a change in fan noise, but the limits must stay reachable
+        if (pwm_deadband > 0 && abs(newPWM - pwm) < pwm_deadband && newPWM != pwmmin && newPWM != pwmceil)
+        {
+            ++pwm_suppressed;
+            newPWM = pwm;
+        }
+
         pwm = newPWM;
 
-        // Write new PWM
-        ecwrite(0x6b, pwm);
-        ecwrite(0x73, pwm);
+        // Set the new PWM target, the fans ramp towards it until the next cycle
+        set_fan_targets(pwm);
+        fans_ramp(monotonic_now());
+
+        // With the fans maxed out, CPU heat can only be reduced at the source
+        if (!simulate) update_rapl(monotonic_now(), cpu_sensor, pwm >= pwmceil);
+
+        publish_shm(pwm, maxtemp, error);
+        if (fleet_server) fleet_publish(pwm);
+        if (mqtt_server) mqtt_publish_state(pwm, maxtemp);
+        if (agentx_master) agentx_update(pwm, maxtemp, error);
 
         // Send PWM value to Graphite if configured
         if (graphite_server) {
@@ -467,16 +6515,50 @@ int main(int argc, char *argv[])
             snprintf(message, sizeof(message), "fancontrol.pwm %d %ld\n", pwm, time(NULL));
             send_to_graphite(message);
 
+            // Send the ramped duty cycle actually written to each fan, its speed and alarm
+            for (int i = 0; i < FAN_COUNT; ++i) {
+                snprintf(message, sizeof(message), "fancontrol.%s.pwm %d %ld\n", fans[i].name, fans[i].written, time(NULL));
+                send_to_graphite(message);
+
+                snprintf(message, sizeof(message), "fancontrol.%s.rpm %d %ld\n", fans[i].name, fans[i].rpm, time(NULL));
+                send_to_graphite(message);
+
+                snprintf(message, sizeof(message), "fancontrol.%s.alarm %d %ld\n", fans[i].name, fans[i].alarm ? 1 : 0, time(NULL));
+                send_to_graphite(message);
+
+                if (cascade) {
+                    snprintf(message, sizeof(message), "fancontrol.%s.rpm_target %d %ld\n", fans[i].name, fans[i].target_rpm, time(NULL));
+                    send_to_graphite(message);
+                }
+            }
+
+            snprintf(message, sizeof(message), "fancontrol.beat_hz %f %ld\n", fan_beat_hz(fans[0].rpm, fans[1].rpm), time(NULL));
+            send_to_graphite(message);
+
+            snprintf(message, sizeof(message), "fancontrol.ec_writes %ld %ld\n", ec_writes, time(NULL));
+            send_to_graphite(message);
+
+            snprintf(message, sizeof(message), "fancontrol.suppressed.pwm %ld %ld\n", pwm_suppressed, time(NULL));
+            send_to_graphite(message);
+
+            snprintf(message, sizeof(message), "fancontrol.suppressed.temp %ld %ld\n", temp_suppressed, time(NULL));
+            send_to_graphite(message);
+
             // Send CPU average temperature
             snprintf(message, sizeof(message), "fancontrol.cpu_avg_temp %d %ld\n", cpu_avg_temp, time(NULL));
             send_to_graphite(message);
         }
 
         // Sleep at end of loop
-        sleep(interval);
+        idle(interval);
     }
 
-    free(drives);
+    if (throttle_step >= 0) apply_throttle(-1);
+    if (rapl_limit != rapl_limit_orig) write_rapl_limit(rapl_limit_orig);
+    if (shm_path) unlink(shm_path);
+    if (mqtt_server) mqtt_disconnect();
+    if (simulate) sim_report();
+
     iopl(0);
     free(cputemp_values);
     return 0;
@@ -0,0 +1,134 @@
+// MIT License
+
+// Copyright (c) 2019 Eudean Sun
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Live state of fancontrol, published with --shm=<path> once per control cycle.
+// The layout is fixed; readers map the file and take consistent snapshots without
+// system calls:
+//
+//   const struct fancontrol_shm *shm = fancontrol_shm_open(FANCONTROL_SHM_PATH);
+//   struct fancontrol_shm snap;
+//   if (shm && fancontrol_shm_read(shm, &snap) == 0)
+//       printf("%s %d\n", snap.sensors[0].name, snap.sensors[0].temp);
+//
+// Works from C and C++. Writers bump seq to an odd value, update the data and bump
+// it to even again, so a reader retries when seq was odd or changed while copying.
+
+#ifndef FANCONTROL_SHM_H
+#define FANCONTROL_SHM_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define FANCONTROL_SHM_PATH "/dev/shm/fancontrol"
+#define FANCONTROL_SHM_MAGIC 0x434e4146 // "FANC"
+#define FANCONTROL_SHM_VERSION 1
+#define FANCONTROL_SHM_SENSORS 64
+#define FANCONTROL_SHM_FANS 2
+
+struct fancontrol_shm_sensor {
+    char name[96];
+    int32_t kind;        // 0 drive, 1 cpu, 2 helper
+    int32_t present;     // 0 for a drive that has been removed
+    int32_t temp;        // °C, 0 when there is no reading
+    int32_t setpoint;    // °C
+    double error;        // Weighted error the controller sees
+    int32_t breaker;     // 0 ok, 1 degraded, 2 open
+    int32_t reserved;
+    double updated;      // Seconds since the epoch of the last good reading
+};
+
+struct fancontrol_shm_fan {
+    char name[16];
+    int32_t pwm;         // Duty cycle written to the EC, 0-255
+    int32_t target;      // Duty cycle it ramps towards
+    int32_t rpm;
+    int32_t state;       // 0 ok, 1 kick-start, 2 failed
+    int32_t alarm;
+    int32_t reserved;
+};
+
+struct fancontrol_shm {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;        // Odd while the daemon is writing
+    uint32_t size;       // sizeof(struct fancontrol_shm) of the writer
+
+    double updated;      // Seconds since the epoch of this snapshot
+    int32_t pwm;         // Controller output
+    int32_t maxtemp;     // Hottest reading plus offset, on the global setpoint scale
+    double setpoint;     // Effective setpoint, after profiles and pre-cooling
+    double error;
+    double p, i, d;      // PID terms of the last cycle
+    double cpu_power;    // W, 0 without RAPL
+    int32_t throttle;    // Workload throttling in percent
+    int32_t maintenance; // 1 while an md array resyncs or a ZFS pool is read-busy
+
+    int32_t fan_count;
+    int32_t sensor_count;
+    struct fancontrol_shm_fan fans[FANCONTROL_SHM_FANS];
+    struct fancontrol_shm_sensor sensors[FANCONTROL_SHM_SENSORS];
+};
+
+// Map the state published by the daemon, NULL when it is not there or incompatible
+static inline const struct fancontrol_shm *fancontrol_shm_open(const char *path)
+{
+    // Closed right after mapping, no need for O_CLOEXEC (which strict C modes hide)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    void *p = mmap(NULL, sizeof(struct fancontrol_shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return NULL;
+
+    const struct fancontrol_shm *shm = (const struct fancontrol_shm *)p;
+    if (shm->magic != FANCONTROL_SHM_MAGIC || shm->version != FANCONTROL_SHM_VERSION ||
+        shm->size != sizeof(struct fancontrol_shm)) {
+        munmap(p, sizeof(struct fancontrol_shm));
+        return NULL;
+    }
+    return shm;
+}
+
+static inline void fancontrol_shm_close(const struct fancontrol_shm *shm)
+{
+    if (shm) munmap((void *)shm, sizeof(struct fancontrol_shm));
+}
+
+// Copy a consistent snapshot, -1 if the daemon kept writing for too long
+static inline int fancontrol_shm_read(const struct fancontrol_shm *shm, struct fancontrol_shm *out)
+{
+    for (int tries = 0; tries < 10000; ++tries) {
+        uint32_t before = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+        if (before & 1) continue;
+
+        memcpy(out, shm, sizeof(*out));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == before) return 0;
+    }
+    return -1;
+}
+
+#endif // FANCONTROL_SHM_H